@@ -9,175 +9,6194 @@
  *   - HideAllWindows() - Hide all windows of current process
  *   - ShowAllWindows() - Show all windows of current process
  *   - HideFromTaskbar(HWND hwnd, BOOL hide) - Hide/show window from taskbar
+ *   - GetWindowHiderStats(WindowHiderStats* stats) - Read internal counters
+ *   - SetWindowHiderSharedMonitor(HMONITOR monitor) - Hint which monitor is being shared
+ *   - BeginWindowHiderUpdate() - Start buffering changes on the calling thread
+ *   - CommitWindowHiderUpdate() - Apply buffered changes in one pass
+ *   - AbortWindowHiderUpdate() - Discard buffered changes
+ *   - HideAllWindowsWithin(DWORD budgetMicros, HANDLE* continuation) - Time-sliced HideAllWindows
+ *   - WindowHiderPump(DWORD budgetMicros) - Run deferred work from the host's idle time
+ *   - EnableWindowHiderPump() - Switch to host-pumped mode before the DLL starts any thread
+ *   - SetWindowHiderPolicy(const WindowHiderPolicy* policy) - Change window filter and auto-protect settings
+ *   - LoadWindowHiderRules(LPCWSTR path) - Map a compiled class/title rule file
+ *   - SetWindowHiderDesiredState(const WindowHiderDesiredState* state) - Declare capture/taskbar state to maintain
+ *   - SetWindowHiderEnumStrategy(DWORD strategy) - Choose or calibrate how windows are enumerated
+ *   - GetWindowHiderEnumInfo(WindowHiderEnumInfo* info) - Read the enumeration strategy and calibration timings
+ *   - RegisterWindowHiderWindow(HWND hwnd) - Get a compact token for a window
+ *   - UnregisterWindowHiderWindow(DWORD token) - Release a window token
+ *   - SetWindowVisibilityByToken(DWORD token, BOOL hide) - SetWindowVisibility for a registered window
+ *   - HideFromTaskbarByToken(DWORD token, BOOL hide) - HideFromTaskbar for a registered window
+ *   - CreateWindowHiderGroup(LPCWSTR name) - Create or look up a named window group
+ *   - DeleteWindowHiderGroup(DWORD group) - Delete a window group
+ *   - AddWindowHiderGroupMember(DWORD group, HWND hwnd) - Add a window to a group
+ *   - RemoveWindowHiderGroupMember(DWORD group, HWND hwnd) - Remove a window from a group
+ *   - SetWindowHiderGroupVisibility(DWORD group, BOOL hide) - Hide/show every member of a group
+ *   - CloakWindows(const HWND* windows, DWORD count, DWORD flags) - Hide/show windows from capture and the taskbar in one pass
+ *   - GetWindowHiderCapability(WindowHiderCapability* info) - Read how this system supports hiding
+ *   - HideWindowsOnMonitor(HMONITOR monitor) - Hide the windows on one monitor
+ *   - HideWindowsInRect(const RECT* rect) - Hide the windows overlapping a screen rectangle
+ *   - SetWindowHiderEvents(BOOL enable) - Turn the WinEvent hooks on or off
+ *   - SetWindowHiderProfile(BOOL enable) - Opt in to recording hides in the startup profile
  *
  * Requirements: Windows 10 v2004+ for proper hiding (older versions show black box)
  */
 
 #define WIN32_LEAN_AND_MEAN
 #include <Windows.h>
+#include <TlHelp32.h>
+#include <ShObjIdl.h>
+#include <emmintrin.h>
+#include <stdlib.h>
+
+/**
+ * Counters reported by GetWindowHiderStats.
+ * New fields are only ever appended; callers set cbSize to the size they know.
+ */
+typedef struct {
+    DWORD cbSize;
+    DWORD hidesApplied;          // Windows protected by a hide
+    DWORD showsQueued;           // Show requests accepted into the queue
+    DWORD showsApplied;          // Windows actually restored by a show
+    DWORD showsCancelled;        // Shows dropped because a later hide covered them
+    DWORD maxHideLatencyMicros;  // Worst time from hide request to window protected
+    DWORD lastSweepExposure;     // Area-weighted exposure of the last hide sweep (megapixel-microseconds)
+    DWORD lastSweepMaxExposedMicros; // Longest time a window of the last sweep stayed capturable
+    DWORD sweepSlices;           // HideAllWindowsWithin calls
+    DWORD lastSliceOvershootMicros; // Time the last slice ran past its budget
+    DWORD maxSliceOvershootMicros;  // Worst slice overshoot seen
+    DWORD pumpCalls;             // WindowHiderPump calls
+    DWORD maxPumpOvershootMicros;   // Worst time a pump call ran past its budget
+    DWORD trackedWindows;        // Windows currently watched by the verifier
+    DWORD verifierTicks;         // Verifier passes run
+    DWORD driftEvents;           // Windows found capturable again and re-hidden
+    DWORD maxVerifierTickMicros; // Longest single verifier pass
+    DWORD heapAllocations;       // Heap allocations made by the DLL; flat in steady state
+    DWORD bytesPerTrackedWindow; // Memory held by window records and their index, per tracked window
+    DWORD recreatedHides;        // New windows re-hidden because they matched a destroyed hidden window
+    DWORD profileHides;          // Windows hidden because they matched the saved profile
+    DWORD startupToProtectedMicros; // Process start to first window protected, 0 until then
+    DWORD attachMicros;          // Time spent in DLL_PROCESS_ATTACH
+    DWORD autoProtectHides;      // Windows hidden by WINDOWHIDER_AUTOPROTECT
+    DWORD policiesPending;       // Replaced snapshots not yet freed
+    DWORD policyReaderFallbacks;  // Policy reads that found every reader slot busy and took g_policyLock shared
+    DWORD ruleCount;             // Rules in the loaded rule file
+    DWORD rulesLoadMicros;       // Time LoadWindowHiderRules took to map and check the file
+    DWORD rulesFirstEvalMicros;  // Time of the first rule evaluation after loading
+    DWORD reconcilePasses;       // Windows or whole desktops compared against the desired state
+    DWORD reconcileChanges;      // Windows changed to match the desired state
+    DWORD lastReconcileLagMicros; // Time from the last change event to convergence
+    DWORD maxReconcileLagMicros;  // Worst reconcile lag seen
+    DWORD predicateOrder;        // IsValidAppWindow predicate order, 4 bits per position, first in the low bits
+    DWORD predicateSamples[6];   // Sampled evaluations per predicate (PREDICATE_* ids)
+    DWORD predicateRejections[6]; // Sampled rejections per predicate
+    DWORD predicateNanos[6];     // Average cost per predicate (nanoseconds)
+    DWORD rejectCacheHits;       // Filter checks answered by the rejection cache
+    DWORD rejectCacheMisses;     // Filter checks that ran the predicates
+    DWORD titleFetches;          // Titles read from windows by the filter and rules
+    DWORD titleCacheHits;        // Titles answered by the title cache
+    DWORD snapshotAdded;         // Windows in the last sweep the sweep before had not protected
+    DWORD hidesSkipped;          // Windows found still protected and not re-applied
+    DWORD tokenCount;            // Windows registered with RegisterWindowHiderWindow
+    DWORD tokensInvalidated;     // Tokens retired because their window was destroyed
+    DWORD groupMembersPruned;    // Destroyed members compacted out of groups
+    DWORD cloakCalls;            // CloakWindows calls
+    DWORD frameChanges;          // Frames refreshed after a taskbar style change, one repaint each
+    DWORD taskbarUnchanged;      // Taskbar changes skipped because the style already matched
+    DWORD hidesUnsupported;      // Hides skipped because this system cannot hide windows
+    DWORD spatialWindows;        // Windows in the spatial index
+    DWORD lastSpatialExamined;   // Windows the last region query looked at
+    DWORD movesMerged;           // Moves merged into one already pending
+    DWORD maxMoveFlushMicros;    // Longest budgeted pass applying pending moves
+    DWORD taskbarListFallbacks;  // CLOAK_TASKBAR_LIST calls done with window styles because the thread was in the MTA
+    DWORD configErrors;          // CONFIG_ERROR_* flags for environment settings rejected at startup
+} WindowHiderStats;
+
+/**
+ * Settings passed to SetWindowHiderPolicy.
+ */
+typedef struct {
+    DWORD cbSize;
+    DWORD filterFlags;          // FILTER_* flags applied by HideAllWindows
+    DWORD autoProtect;          // AUTO_PROTECT_* mode
+    LPCWSTR autoProtectClass;   // Window class for AUTO_PROTECT_CLASS, may be NULL otherwise
+} WindowHiderPolicy;
+
+/**
+ * State passed to SetWindowHiderDesiredState, for every window passing
+ * the HideAllWindows filter.
+ */
+typedef struct {
+    DWORD cbSize;
+    DWORD capture;              // DESIRED_* for screen capture
+    DWORD taskbar;              // DESIRED_* for the taskbar button
+} WindowHiderDesiredState;
+
+#define ENUM_STRATEGY_ENUMWINDOWS 0     // EnumWindows (default)
+#define ENUM_STRATEGY_THREADS 1         // EnumThreadWindows over the process's threads
+#define ENUM_STRATEGY_ZORDER 2          // GetTopWindow / GetWindow(GW_HWNDNEXT) walk
+#define ENUM_STRATEGY_FINDWINDOW 3      // FindWindowExW loop
+#define ENUM_STRATEGY_REGISTRY 4        // Top-level windows registered by the WinEvent hook
+#define ENUM_STRATEGY_COUNT 5
+#define ENUM_STRATEGY_CALIBRATE 5       // Time every strategy now, keep the fastest
+#define ENUM_UNAVAILABLE 0xFFFFFFFF     // Calibration time of a strategy that could not complete
+
+/**
+ * Enumeration strategy and calibration results, read with
+ * GetWindowHiderEnumInfo.
+ */
+typedef struct {
+    DWORD cbSize;
+    DWORD strategy;             // ENUM_STRATEGY_* in use, ENUM_STRATEGY_CALIBRATE while calibration runs
+    DWORD calibrated;           // TRUE once a calibration pass has run
+    DWORD fallbacks;            // Enumerations redone with EnumWindows because a walk came back incomplete
+    DWORD calibrationNanos[ENUM_STRATEGY_COUNT]; // Best time per strategy, ENUM_UNAVAILABLE if it failed
+} WindowHiderEnumInfo;
+
+#define VISIBILITY_PENDING 2            // SetWindowVisibility: accepted but not applied yet
+
+#define CLOAK_CAPTURE 0x1               // Hide from screen capture
+#define CLOAK_TASKBAR 0x2               // Remove the taskbar button
+#define CLOAK_REVEAL 0x4                // Undo instead: show in capture and on the taskbar
+#define CLOAK_TASKBAR_LIST 0x8          // Use ITaskbarList tabs instead of window styles
+
+#define CAPABILITY_SUPPORTED 0          // WDA_EXCLUDEFROMCAPTURE works
+#define CAPABILITY_OLD_BUILD 1          // Build before 19041 (Windows 10 2004): WDA_MONITOR
+#define CAPABILITY_PROBE_FAILED 2       // A hide was rejected with WDA_EXCLUDEFROMCAPTURE but not WDA_MONITOR: WDA_MONITOR
+#define CAPABILITY_UNSUPPORTED 3        // Build before Windows 7: no hiding
+
+/**
+ * How this system supports hiding, read with GetWindowHiderCapability.
+ */
+typedef struct {
+    DWORD cbSize;
+    DWORD affinity;             // Affinity hides apply: WDA_EXCLUDEFROMCAPTURE, WDA_MONITOR, or WDA_NONE when hiding is disabled
+    DWORD reason;               // CAPABILITY_* explaining the choice
+    DWORD buildNumber;          // Windows build from RtlGetVersion, 0 if unavailable
+    DWORD probeError;           // GetLastError from the hide that stepped down, 0 if none did
+} WindowHiderCapability;
+
+/**
+ * Queued show request. Shows are lazy; a hide issued after the show was
+ * queued cancels it for every window the hide covers.
+ */
+typedef struct {
+    HWND hwnd;      // Target window, or NULL for all windows of the process
+    LONG stamp;     // Destroy stamp of hwnd when the show was queued
+    LONG hideSeq;   // Value of g_hideSeq when the show was queued
+    DWORD progress; // Windows already handled when a budgeted drain stopped
+} ShowOp;
+
+/**
+ * Shown window waiting to be reconciled outside the WinEvent hook.
+ */
+typedef struct {
+    HWND hwnd;
+    LONG stamp;         // Destroy stamp of hwnd when it was shown
+    LONGLONG eventAt;   // QPC time of the show event
+} ReconcileOp;
+
+/**
+ * Hook event waiting in the event queue. sequence is the cell's position
+ * in the ring: equal to the producer's position when free, one past it
+ * once filled.
+ */
+typedef struct {
+    volatile LONG sequence;
+    DWORD event;        // EVENT_OBJECT_*
+    HWND hwnd;
+    LONG stamp;         // Destroy stamp before a destroy event moved it
+    LONGLONG eventAt;   // QPC time of the event
+} WindowEvent;
+
+/**
+ * Per-window record for a window the DLL hid and keeps watching for lost
+ * affinity. Records live in slabs and are identified by a DWORD id; freed
+ * records are recycled through a free list, so once the host's window
+ * count is steady, tracking allocates nothing.
+ */
+typedef struct {
+    HWND hwnd;          // NULL while the record is free
+    LONG stamp;         // Destroy stamp of hwnd when it was tracked
+    DWORD affinity;     // Affinity the DLL applied
+    DWORD nextFree;     // Free list link (record id + 1) while free
+    DWORD signature;    // WindowSignature, kept for re-hiding a recreated window
+} WindowRecord;
+
+static_assert(sizeof(WindowRecord) <= 32, "WindowRecord must stay within 32 bytes");
+
+#define PROFILE_MAGIC 0x46504857    // "WHPF"
+#define PROFILE_VERSION 1
+#define PROFILE_SLOTS 1024          // Power of two
+#define PROFILE_MAX_PROBES 16
+#define PROFILE_REMOVED 1           // Slot value left behind by a removal
+
+/**
+ * Persistent hide profile, mapped straight from its file. Slots hold
+ * signatures of windows the DLL hid (class name and title, which survive
+ * a restart), open-addressed; 0 = empty. Slots are updated with
+ * interlocked operations, so several instances can share one file.
+ */
+typedef struct {
+    DWORD magic;
+    DWORD version;
+    DWORD slotCount;            // PROFILE_SLOTS
+    volatile LONG used;         // Live signatures
+    volatile LONG slots[PROFILE_SLOTS];
+} HideProfile;
+
+#define FILTER_REQUIRE_TITLE 0x1        // Skip windows without a title
+#define FILTER_SKIP_TOOL_WINDOWS 0x2    // Skip WS_EX_TOOLWINDOW windows
+#define FILTER_ADAPTIVE_ORDER 0x4       // Reorder IsValidAppWindow checks from their profile
+
+// IsValidAppWindow predicates, in their original fixed order
+#define PREDICATE_IS_WINDOW 0
+#define PREDICATE_VISIBLE 1
+#define PREDICATE_PARENT 2
+#define PREDICATE_STYLE 3
+#define PREDICATE_EXSTYLE 4
+#define PREDICATE_TITLE 5
+#define PREDICATE_COUNT 6
+#define PREDICATE_DEFAULT_ORDER 0x543210    // 4 bits per position, first in the low bits
+#define PREDICATE_SAMPLE_RATE 16            // Profile one evaluation in this many, power of two
+#define PREDICATE_REORDER_SAMPLES 256       // Sampled evaluations between adaptive reorders
+
+#define PREDICATE_PASSED PREDICATE_COUNT  // RunPredicates result when every predicate passed
+#define REJECT_RULE PREDICATE_COUNT       // Rejection reason: a skip rule matched
+#define REJECT_CACHE_SLOTS 1024           // Direct-mapped by HWND, power of two
+#define TITLE_CACHE_SLOTS 256             // Direct-mapped by HWND, power of two
+#define TITLE_CACHE_CHARS 60              // Longer titles cache only their length
+
+typedef BOOL (*WindowPredicate)(HWND hwnd, DWORD filterFlags);
+
+/**
+ * Sampled profile of one IsValidAppWindow predicate. Later predicates are
+ * only sampled when earlier ones passed.
+ */
+typedef struct {
+    volatile LONG samples;
+    volatile LONG rejections;
+    volatile LONGLONG ticks;    // QPC ticks spent in sampled evaluations
+} PredicateProfile;
+
+/**
+ * Cached IsValidAppWindow rejection. Style changes raise no WinEvent, so
+ * the styles seen at rejection are kept and compared on lookup; the other
+ * inputs (visibility aside, which is a style bit) are covered by events.
+ */
+typedef struct {
+    HWND hwnd;                  // NULL = empty
+    LONG stamp;                 // Destroy stamp at rejection
+    LONG generation;            // g_rejectGeneration at rejection
+    LONG version;               // Bumped by every invalidation of this slot
+    DWORD reason;               // PREDICATE_* id or REJECT_RULE
+    LONG_PTR style;
+    LONG_PTR exStyle;
+} RejectEntry;
+
+/**
+ * Cached window title. Only the length is kept for titles longer than
+ * TITLE_CACHE_CHARS; rules then read those titles from the window.
+ */
+typedef struct {
+    HWND hwnd;                  // NULL = empty
+    LONG stamp;                 // Destroy stamp when filled
+    LONG version;               // Bumped by every hook refresh of this slot
+    WORD length;
+    WCHAR text[TITLE_CACHE_CHARS];
+} TitleEntry;
+
+#define AUTO_PROTECT_OFF 0
+#define AUTO_PROTECT_TITLED 1   // Top-level windows passing the HideAllWindows filter
+#define AUTO_PROTECT_ALL 2      // Every top-level window
+#define AUTO_PROTECT_CLASS 3    // Top-level windows of one window class
+
+#define CONFIG_ERROR_AUTOPROTECT 0x1    // Unknown WINDOWHIDER_AUTOPROTECT value; auto-protect left off
+#define CONFIG_ERROR_RULES 0x2          // WINDOWHIDER_RULES named a missing or invalid rule file
+
+#define DESIRED_UNCHANGED 0     // Not managed by the reconciler
+#define DESIRED_HIDDEN 1
+#define DESIRED_VISIBLE 2
+
+#define RULES_MAGIC 0x4C504857      // "WHPL"
+#define RULES_VERSION 1
+#define RULES_MAX_BYTES (64 * 1024 * 1024)
+
+/**
+ * Header of a compiled rule file (compile_policy.py). All offsets are from
+ * the start of the file, so it is used in place wherever it is mapped.
+ */
+typedef struct {
+    DWORD magic;            // RULES_MAGIC
+    WORD version;           // RULES_VERSION
+    WORD headerSize;        // sizeof(RulesHeader)
+    DWORD fileSize;
+    DWORD ruleCount;
+    DWORD bucketCount;      // Power of two; one extra bucket after them holds rules with no class
+    DWORD bucketsOffset;    // DWORD[bucketCount + 1]: first rule index + 1 of each chain, 0 = empty
+    DWORD rulesOffset;      // RuleEntry[ruleCount]
+    DWORD stringsOffset;    // Strings: WORD length in UTF-16 units, then the characters
+} RulesHeader;
+
+#define RULE_NONE 0
+#define RULE_HIDE 1         // Protect matching windows
+#define RULE_SKIP 2         // Leave matching windows alone
+
+#define TITLE_ANY 0
+#define TITLE_EXACT 1
+#define TITLE_PREFIX 2
+#define TITLE_CONTAINS 3
+
+/**
+ * One compiled rule. Rules are chained per class-name hash bucket in
+ * ascending index order; the lowest-index matching rule wins.
+ */
+typedef struct {
+    BYTE action;            // RULE_HIDE or RULE_SKIP
+    BYTE titleMatch;        // TITLE_*
+    WORD reserved;
+    DWORD classOffset;      // Class name string, 0 = any class
+    DWORD titleOffset;      // Title string, unused for TITLE_ANY
+    DWORD next;             // Next rule index + 1 in the same bucket, 0 = end
+} RuleEntry;
+
+static_assert(sizeof(RulesHeader) == 32 && sizeof(RuleEntry) == 16, "Rule file layout is fixed");
+
+/**
+ * A mapped rule file, shared by every policy snapshot that uses it and
+ * unmapped when the last one is freed.
+ */
+typedef struct {
+    const BYTE* view;
+    DWORD size;
+    volatile LONG refs;
+    volatile LONG evaluated;    // Set by the first evaluation
+} RuleSet;
+
+/**
+ * Immutable policy snapshot. Once published it is never written again,
+ * except for the retirement fields after it has been replaced.
+ */
+typedef struct HidePolicy {
+    DWORD filterFlags;
+    LONG autoProtect;
+    WCHAR autoProtectClass[256];
+    RuleSet* rules;                 // Class/title rules, NULL if none; one reference per snapshot
+    LONG desiredCapture;            // DESIRED_*
+    LONG desiredTaskbar;            // DESIRED_*
+    LONGLONG retiredAt;             // Policy epoch when replaced
+    struct HidePolicy* nextRetired;
+} HidePolicy;
+
+/**
+ * Reader slot announcing the policy epoch an active reader started in.
+ * One per cache line, so readers on different slots never share a line.
+ */
+typedef struct {
+    __declspec(align(64)) volatile LONGLONG epoch;  // 0 = free
+} PolicyReader;
+
+#define POLICY_READER_SLOTS 64
+
+#define SLAB_RECORDS 512        // Records per slab, power of two
+#define MAX_SLABS 512           // Up to 262144 tracked windows
+
+#define VERIFY_INTERVAL_MS 1000         // Time between verifier passes
+#define VERIFY_TICK_BUDGET_MICROS 250   // CPU budget of one verifier pass
+
+/**
+ * Window collected by a hide sweep, with the exposure score used to order it.
+ */
+typedef struct {
+    HWND hwnd;
+    LONG stamp;         // Destroy stamp of hwnd when it was collected
+    DWORD zOrder;       // Position in EnumWindows order, 0 = topmost
+    DWORD area;         // Visible pixels, clipped to the window's monitor
+    ULONGLONG score;    // Higher scores are protected first
+    LONGLONG protectedAt; // QPC timestamp when protected, 0 if not yet
+} SweepCandidate;
+
+/**
+ * Sorted set of window handles. Each entry holds the handle's 32
+ * significant bits in the high half and a payload in the low half, so
+ * sorting and diffing look at the high half only.
+ */
+typedef struct {
+    ULONGLONG* items;
+    ULONGLONG* scratch;         // Radix sort buffer, same capacity
+    DWORD count;
+    DWORD capacity;
+} WindowSnapshot;
+
+/**
+ * Growable candidate buffer reused across sweeps.
+ */
+typedef struct {
+    SweepCandidate* items;
+    DWORD count;
+    DWORD capacity;
+} CandidateList;
+
+/**
+ * A hide-all sweep that may run across several time slices.
+ */
+typedef struct {
+    CandidateList candidates;
+    DWORD next;             // Index of the next candidate to protect
+    LONGLONG requestedAt;   // QPC timestamp of the hide request
+    LONG showSeq;           // g_showSeq when the sweep started
+    WORD generation;        // Bumped on reuse; part of the continuation token
+    BOOL active;
+    WindowSnapshot kept;    // Windows found or left protected, unsorted until the sweep ends
+} HideSweep;
+
+#define SWEEP_SLOT_COUNT 4
+#define RECENT_SHOW_CAPACITY 64
+
+/**
+ * Net change buffered for one window inside a BeginWindowHiderUpdate batch.
+ */
+typedef struct {
+    HWND hwnd;          // NULL marks an empty slot
+    LONG stamp;         // Destroy stamp of hwnd when the entry was created
+    LONG hideSeq;       // g_hideSeq when the capture change was recorded
+    BYTE captureSet;    // SetWindowVisibility was called
+    BYTE captureHide;   // Last requested capture state
+    BYTE taskbarSet;    // HideFromTaskbar was called
+    BYTE taskbarHide;   // Last requested taskbar state
+} BatchEntry;
+
+#define BATCH_CAPACITY 256      // Entries per arena, power of two
+#define BATCH_ARENA_COUNT 8     // Threads that can hold an open batch at once
+
+/**
+ * Per-thread batch arena, open-addressed by HWND so repeated calls for the
+ * same window collapse into one entry.
+ */
+typedef struct {
+    volatile LONG inUse;
+    DWORD depth;        // Nesting of BeginWindowHiderUpdate calls
+    DWORD count;
+    BatchEntry entries[BATCH_CAPACITY];
+} UpdateBatch;
 
 /**
  * Context structure for EnumWindows callback
  */
-typedef struct {
-    DWORD targetPID;
-    DWORD affinity;
-} EnumWindowsContext;
+typedef struct {
+    DWORD targetPID;
+    const ShowOp* showOp;      // Set when draining a queued show, NULL for hides
+    LONGLONG requestedAt;      // QPC timestamp of the hide request
+    CandidateList* candidates; // Set when collecting a hide sweep instead of applying
+    DWORD zOrder;              // Windows seen so far, in EnumWindows order
+    HWND foreground;           // Foreground window at the start of the sweep
+    LONGLONG deadline;         // QPC timestamp to stop a show at, 0 for no limit
+    DWORD handled;             // Windows a show has handled so far
+    BOOL stopped;              // Set when a show ran out of time
+    WindowSnapshot* snapshot;  // Set when a hide sweep collects handles for diffing
+    HWND early;                // Foreground window a sweep protected as enumeration reached it
+    LONGLONG earlyAt;          // QPC timestamp when it was protected
+} EnumWindowsContext;
+
+#define DESTROY_STAMP_BUCKETS 4096   // Power of two
+#define HWND_LIST_INLINE 256         // HwndList capacity before it moves to the heap
+#define FRAME_CHANGE_FLAGS (SWP_NOMOVE | SWP_NOSIZE | SWP_NOZORDER | SWP_NOOWNERZORDER | SWP_NOACTIVATE | SWP_FRAMECHANGED)
+#define BUILD_WINDOWS_7 7600                // First build with SetWindowDisplayAffinity
+#define BUILD_EXCLUDE_FROM_CAPTURE 19041    // Windows 10 2004, first build with WDA_EXCLUDEFROMCAPTURE
+
+#define PUMP_UNDECIDED 0             // No thread or timer started yet
+#define PUMP_OFF 1                   // The DLL uses its own threads and timers
+#define PUMP_ON 2                    // Host-pumped: the DLL never starts a thread or timer
+
+#define EVENT_QUEUE_CAPACITY 1024    // Hook events awaiting the drain, power of two
+#define EVENTS_OFF 0                 // No caller opted in yet
+#define EVENTS_STARTING 1            // Hook owner installing the hooks
+#define EVENTS_ACTIVE 2              // Hooks in; caches, registry and spatial index kept
+#define EVENTS_STOPPED 3             // Hooks removed or failed; not installed again
+
+#define ENUM_WALK_LIMIT 65536        // Cap on z-order and FindWindowExW walks
+#define ENUM_CALIBRATION_RUNS 3      // Timed runs per strategy; the best one counts
+#define REGISTRY_CAPACITY 1024       // Top-level windows the registry can hold
+#define RECREATE_SLOTS 256           // Remembered signatures, power of two
+#define RECREATE_WINDOW_MS 3000      // How long a destroyed window's signature matches
+#define SHOW_QUEUE_CAPACITY 64
+#define RECONCILE_QUEUE_CAPACITY 64  // Shown windows awaiting reconcile; beyond that, one full pass
+#define RECENT_HIDE_CAPACITY 64
+#define SNAPSHOT_COMMON 0x80000000   // Snapshot payload flag: handle also in the previous set
+#define TOKEN_CAPACITY 1024          // Registered windows; the token's low word is slot + 1
+#define TOKEN_HASH_SLOTS 1024        // HWND hash chains over the token slots, power of two
+
+/**
+ * Slot behind a window token. A token is (generation << 16) | (slot + 1);
+ * retiring the slot bumps the generation, so old tokens stop matching.
+ */
+typedef struct {
+    HWND hwnd;          // NULL = free
+    WORD generation;
+    WORD nextHash;      // Hash chain link while in use, free list link while free; slot + 1, 0 = end
+} TokenSlot;
+
+#define GROUP_CAPACITY 64            // Groups; the group id's low word is slot + 1
+#define GROUP_NAME_CHARS 64          // Including the terminator
+
+/**
+ * Member of a window group.
+ */
+typedef struct {
+    HWND hwnd;
+    LONG stamp;         // Destroy stamp when added
+} GroupMember;
+
+/**
+ * Named window group. Members live in a dense array; a member whose stamp
+ * moved is dead and removed by the next operation on the group.
+ */
+typedef struct {
+    WCHAR name[GROUP_NAME_CHARS];   // Empty = free slot
+    WORD generation;                // Bumped on delete; high word of the group id
+    GroupMember* members;
+    DWORD count;
+    DWORD capacity;
+} WindowGroup;
+
+#define SPATIAL_CAPACITY 4096        // Indexed windows
+#define SPATIAL_HASH_SLOTS 4096      // HWND hash chains, power of two
+#define SPATIAL_CELL_SHIFT 8         // Grid cells are 256 x 256 pixels
+#define SPATIAL_BUCKETS 1024         // Hashed grid buckets, power of two
+#define SPATIAL_MAX_CELLS 64         // Windows covering more cells go on the large list
+#define SPATIAL_NONE 0xFFFF          // No entry
+#define SPATIAL_LARGE 0x1            // Entry flag: on the large list instead of in grid cells
+#define SPATIAL_MOVE_PENDING 0x2     // Entry flag: moved since its bounds were last applied
+#define MOVE_FLUSH_INTERVAL_MS 16    // Pending moves are applied at most this often
+#define MOVE_FLUSH_BUDGET_MICROS 500 // Time cap per pass; what is left waits for the next one
+
+#define SPATIAL_OFF 0                // Not in use
+#define SPATIAL_SEEDING 1            // Kept by the hooks, seeding pass still running
+#define SPATIAL_READY 2              // Kept by the hooks and complete
+#define SPATIAL_UNUSABLE 3           // Missed a window; queries enumerate instead
+
+/**
+ * Window in the spatial index.
+ */
+typedef struct {
+    HWND hwnd;                  // NULL = free
+    RECT bounds;                // Screen rectangle when last indexed
+    DWORD queryMark;            // Last query that examined the entry
+    WORD nextHash;              // HWND hash chain or free list link, entry + 1, 0 = end
+    WORD flags;                 // SPATIAL_LARGE, SPATIAL_MOVE_PENDING
+} SpatialEntry;
+
+/**
+ * Entries whose bounds cover one grid bucket. Cells hash into buckets, so
+ * a bucket may also hold entries of other cells; queries test the bounds.
+ */
+typedef struct {
+    WORD* items;                // Entry ids, one per covered cell hashing here
+    DWORD count;
+    DWORD capacity;
+} SpatialBucket;
+
+/**
+ * Window handles collected by an enumeration strategy, on the stack up to
+ * HWND_LIST_INLINE and on the heap beyond.
+ */
+typedef struct {
+    HWND* items;
+    DWORD count;
+    DWORD capacity;
+    BOOL failed;                // Out of memory while growing
+    HWND inlineItems[HWND_LIST_INLINE];
+} HwndList;
+
+/**
+ * Enumeration strategy: collect the top-level windows, at least all of
+ * this process's, in z-order where the strategy can.
+ *
+ * @return FALSE if the walk may have missed windows
+ */
+typedef BOOL (*EnumStrategy)(HwndList* list);
+
+// g_queueLock guards the show queue and the recent hide ring.
+// g_applyLock makes "check cancellation, then apply" atomic against hides.
+static SRWLOCK g_queueLock = SRWLOCK_INIT;
+static SRWLOCK g_applyLock = SRWLOCK_INIT;
+static ShowOp g_showQueue[SHOW_QUEUE_CAPACITY];
+static int g_showCount = 0;
+static volatile LONG g_hideSeq = 0;
+static HWND g_recentHides[RECENT_HIDE_CAPACITY];  // Indexed by hide sequence, NULL = all windows
+static volatile LONG g_drainActive = 0;
+static WindowHiderStats g_stats = { sizeof(WindowHiderStats) };
+
+// Destroy stamps, bucketed by HWND hash. A destroyed top-level window bumps
+// its bucket, invalidating every record stamped with the old value. Bucket
+// collisions only cause spurious invalidation, never a stale match.
+static volatile LONG g_destroyStamps[DESTROY_STAMP_BUCKETS];
+
+// WinEvent hooks, installed and removed by the hook owner, a thread pool
+// callback that holds no reference on the DLL. The hooks only push events
+// into the queue, a bounded ring with lock-free producers; g_eventLock
+// serialises the consumers, which run the owner and the exports. A full
+// queue drops the event and sets g_eventOverflow, and the next drain
+// resynchronises everything the events keep.
+static volatile LONG g_eventsState = EVENTS_OFF;
+static HWINEVENTHOOK g_eventHook = NULL;
+static HWINEVENTHOOK g_changeHook = NULL;   // Name and parent changes
+static HANDLE g_eventSignal = NULL;          // Auto-reset: wakes the hook owner
+static HANDLE g_hooksGone = NULL;           // Set once the hook owner has returned
+static DWORD g_eventThreadId = 0;           // Pumped mode: the thread owning the hooks
+static WindowEvent g_events[EVENT_QUEUE_CAPACITY];
+static volatile LONG g_eventTail = 0;       // Next position to fill
+static volatile LONG g_eventHead = 0;       // Next position to drain, under g_eventLock
+static volatile LONG g_eventWake = 0;       // Set while a wake-up is outstanding
+static volatile LONG g_eventOverflow = 0;
+static SRWLOCK g_eventLock = SRWLOCK_INIT;
+
+// Enumeration strategy. The registry holds this process's top-level
+// windows once seeded, kept current by the WinEvent hook.
+static volatile LONG g_enumStrategy = ENUM_STRATEGY_ENUMWINDOWS;
+static volatile LONG g_enumCalibrating = 0;
+static WindowHiderEnumInfo g_enumInfo = { sizeof(WindowHiderEnumInfo) };
+static SRWLOCK g_registryLock = SRWLOCK_INIT;
+static HWND g_registry[REGISTRY_CAPACITY];
+static DWORD g_registryCount = 0;
+static volatile LONG g_registryActive = 0;
+static volatile LONG g_registryOverflow = 0;
+
+// Signatures of hidden windows destroyed recently, direct-mapped by
+// signature. Each slot packs (signature << 32) | GetTickCount() at destroy,
+// so it is read and cleared atomically without a lock; 0 = empty.
+static volatile LONGLONG g_recreateSlots[RECREATE_SLOTS];
+static volatile LONG g_lastHiddenDestroy = 0;   // GetTickCount() of the latest entry
+
+// Persistent profile view, NULL until a host opts in or when the file
+// could not be mapped. Opened once, under g_profileLock, never in DllMain.
+static HideProfile* g_profile = NULL;
+static SRWLOCK g_profileLock = SRWLOCK_INIT;
+static volatile BOOL g_profileEnabled = FALSE;  // Set by SetWindowHiderProfile
+static ULONGLONG g_processStart = 0;    // Process creation time, FILETIME units
+
+// Policy snapshots, RCU style. g_policy is swapped atomically. A reader
+// claims a slot, writes the current epoch into it, then loads g_policy, and
+// never locks. A writer swaps the pointer, then bumps the epoch and stamps
+// the old snapshot with it; the snapshot is freed once no slot holds an
+// older epoch. g_policyLock serialises writers, and readers that find
+// every slot busy take it shared instead of spinning.
+static HidePolicy g_defaultPolicy = { FILTER_REQUIRE_TITLE | FILTER_SKIP_TOOL_WINDOWS, AUTO_PROTECT_OFF };
+static HidePolicy* volatile g_policy = &g_defaultPolicy;
+static volatile LONGLONG g_policyEpoch = 1;
+static PolicyReader g_policyReaders[POLICY_READER_SLOTS];
+static SRWLOCK g_policyLock = SRWLOCK_INIT;
+static HidePolicy* g_retiredPolicies = NULL;
+
+// IsValidAppWindow profile and adaptive order
+static PredicateProfile g_predicateProfile[PREDICATE_COUNT];
+static volatile LONG g_predicateOrder = PREDICATE_DEFAULT_ORDER;
+static volatile LONG g_predicateCalls = 0;
+static volatile LONG g_predicateSampled = 0;
+
+// Rejection cache. g_rejectGeneration moves with every policy publish.
+static SRWLOCK g_rejectLock = SRWLOCK_INIT;
+static RejectEntry g_rejectCache[REJECT_CACHE_SLOTS];
+static volatile LONG g_rejectGeneration = 0;
+
+// Title cache, filled and refreshed by the WinEvent hooks
+static SRWLOCK g_titleLock = SRWLOCK_INIT;
+static TitleEntry g_titleCache[TITLE_CACHE_SLOTS];
+
+static HMODULE g_module = NULL;
+
+// Hiding capability, from the build number and, if a hide steps down,
+// from that hide. Written under g_capabilityLock.
+static SRWLOCK g_capabilityLock = SRWLOCK_INIT;
+static volatile BOOL g_capabilityReady = FALSE;
+static volatile DWORD g_hideAffinity = WDA_EXCLUDEFROMCAPTURE;
+static WindowHiderCapability g_capability;
+
+// Window tokens. Slots below g_tokenHighWater have been used at least once.
+static SRWLOCK g_tokenLock = SRWLOCK_INIT;
+static TokenSlot g_tokens[TOKEN_CAPACITY];
+static WORD g_tokenHash[TOKEN_HASH_SLOTS];       // Chain heads, slot + 1
+static WORD g_tokenFree = 0;
+static volatile LONG g_tokenHighWater = 0;
+
+// Window groups. Member arrays are reused when a slot is recycled.
+static SRWLOCK g_groupLock = SRWLOCK_INIT;
+static WindowGroup g_groups[GROUP_CAPACITY];
+
+// Spatial index of this process's top-level windows, kept by the hooks
+// from the first region query on. Entries are found by HWND through hash
+// chains and by position through the hashed grid.
+static SRWLOCK g_spatialLock = SRWLOCK_INIT;
+static SpatialEntry g_spatial[SPATIAL_CAPACITY];
+static WORD g_spatialHash[SPATIAL_HASH_SLOTS];    // Chain heads, entry + 1
+static SpatialBucket g_spatialGrid[SPATIAL_BUCKETS];
+static SpatialBucket g_spatialLarge;
+static WORD g_spatialFree = 0;                    // Free list head, entry + 1
+static DWORD g_spatialHighWater = 0;
+static DWORD g_spatialMark = 0;
+static volatile LONG g_spatialState = SPATIAL_OFF;
+static HWINEVENTHOOK g_locationHook = NULL;
+static volatile LONG g_locationWanted = 0;       // Hook owner request: add the move hook
+
+// Also under g_spatialLock: windows with a pending move, and the region
+// of the last HideWindowsOnMonitor / HideWindowsInRect call.
+static WORD g_movePending[SPATIAL_CAPACITY];
+static DWORD g_movePendingCount = 0;
+static RECT g_scopeRect;
+static BOOL g_scopeActive = FALSE;
+
+// g_moveLock serialises passes applying pending moves; lock order:
+// g_moveLock, then g_spatialLock or g_applyLock. The move timer runs a
+// pass for moves left pending when the events stop.
+static SRWLOCK g_moveLock = SRWLOCK_INIT;
+static volatile LONGLONG g_lastMoveFlush = 0;
+static volatile LONG g_moveTimerArmed = 0;
+static PTP_TIMER g_moveTimer = NULL;
+static TP_CALLBACK_ENVIRON g_moveEnviron;
+
+// Shown windows the event drain left for the reconciler, a ring under
+// g_reconcileLock. The reconcile timer, or WindowHiderPump in pumped
+// mode, drains it; an overflow turns the drain into one full pass.
+static SRWLOCK g_reconcileLock = SRWLOCK_INIT;
+static ReconcileOp g_reconcileQueue[RECONCILE_QUEUE_CAPACITY];
+static DWORD g_reconcileHead = 0;
+static DWORD g_reconcileCount = 0;
+static volatile LONG g_reconcileOverflow = 0;
+static volatile LONG g_reconcileTimerArmed = 0;
+static PTP_TIMER g_reconcileTimer = NULL;
+static TP_CALLBACK_ENVIRON g_reconcileEnviron;
+
+// g_sweepLock serialises work on hide sweeps. g_fullSweep serves
+// HideAllWindows; the slots back HideAllWindowsWithin continuations.
+static SRWLOCK g_sweepLock = SRWLOCK_INIT;
+static HideSweep g_fullSweep;
+static HideSweep g_sweepSlots[SWEEP_SLOT_COUNT];
+
+// Also under g_sweepLock: the handles a sweep is collecting, and the
+// sorted set of windows the last finished sweep left protected.
+static WindowSnapshot g_sweepSnapshot;
+static WindowSnapshot g_protectedSnapshot;
+
+// Shows requested recently, so a resumed sweep does not re-hide them.
+static volatile LONG g_showSeq = 0;
+static HWND g_recentShows[RECENT_SHOW_CAPACITY];  // Indexed by show sequence, NULL = all windows
+static HMONITOR volatile g_sharedMonitor = NULL;
+
+// Batch arenas are handed out to threads by BeginWindowHiderUpdate.
+static UpdateBatch g_batchArenas[BATCH_ARENA_COUNT];
+static __declspec(thread) UpdateBatch* t_batch = NULL;
+
+// Chosen once: by EnableWindowHiderPump, or by the first thread or timer
+// the DLL starts. In pumped mode deferred work is left for the pump.
+static volatile LONG g_pumpMode = PUMP_UNDECIDED;
+
+// Window records: slabs of SLAB_RECORDS records, allocated on demand and
+// never freed; released records go on a free list for reuse. An
+// open-addressed index (slot -> record id + 1, 0 = empty) gives O(1)
+// lookup by HWND. Lock order: g_applyLock before g_trackLock.
+static SRWLOCK g_trackLock = SRWLOCK_INIT;
+static WindowRecord* g_slabs[MAX_SLABS];
+static DWORD g_slabCount = 0;
+static DWORD g_recordHighWater = 0;     // Records ever handed out
+static DWORD g_freeRecords = 0;         // Free list head (record id + 1)
+static DWORD g_trackedCount = 0;
+static DWORD* g_trackIndex = NULL;
+static DWORD g_trackIndexSize = 0;      // Power of two, at least twice g_trackedCount
+static DWORD g_verifyCursor = 0;        // Next record id to verify
+static LONGLONG g_lastVerify = 0;
+
+// The verifier timer only exists while windows are tracked and the host
+// does not pump; the callback library reference keeps the DLL loaded while
+// a callback runs.
+static PTP_TIMER g_verifyTimer = NULL;
+static TP_CALLBACK_ENVIRON g_verifyEnviron;
+
+static VOID CALLBACK VerifierTimerCallback(PTP_CALLBACK_INSTANCE instance, PVOID context, PTP_TIMER timer);
+static void RememberDestroyedWindow(HWND hwnd, LONG stamp);
+static BOOL RehideRecreatedWindow(HWND hwnd);
+static BOOL ProtectProfiledWindow(HWND hwnd);
+static void TrackMove(HWND hwnd);
+static void AutoProtectWindow(HWND hwnd);
+static void ReconcileShownWindow(HWND hwnd, LONGLONG eventAt);
+static BOOL EnableWindowEvents();
+static void DrainWindowEvents();
+
+/**
+ * Current QueryPerformanceCounter value.
+ */
+static LONGLONG QpcNow() {
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    return now.QuadPart;
+}
+
+/**
+ * QueryPerformanceCounter ticks per second.
+ */
+static LONGLONG QpcFrequency() {
+    static LONGLONG frequency = 0;
+    if (frequency == 0) {
+        LARGE_INTEGER freq;
+        QueryPerformanceFrequency(&freq);
+        frequency = freq.QuadPart;
+    }
+    return frequency;
+}
+
+/**
+ * TRUE once the host chose pumped mode with EnableWindowHiderPump.
+ */
+static BOOL HostPumped() {
+    return g_pumpMode == PUMP_ON;
+}
+
+/**
+ * Internal: Called before starting a thread, timer or thread pool
+ * callback. Settles on threaded mode unless the host chose pumped mode
+ * first, so pumped mode can never begin with a timer already running.
+ *
+ * @return TRUE if the DLL may start it, FALSE in pumped mode
+ */
+static BOOL UseDllThreads() {
+    InterlockedCompareExchange(&g_pumpMode, PUMP_OFF, PUMP_UNDECIDED);
+    return g_pumpMode == PUMP_OFF;
+}
+
+/**
+ * TRUE while the hooks are in. Only then do destroy stamps move and are
+ * the caches, registry and spatial index kept.
+ */
+static BOOL EventsActive() {
+    return g_eventsState == EVENTS_ACTIVE;
+}
+
+/**
+ * Convert a QueryPerformanceCounter interval to microseconds.
+ */
+static DWORD QpcToMicros(LONGLONG ticks) {
+    LONGLONG frequency = QpcFrequency();
+    return (DWORD)((ticks / frequency) * 1000000 + (ticks % frequency) * 1000000 / frequency);
+}
+
+/**
+ * Convert microseconds to QueryPerformanceCounter ticks.
+ */
+static LONGLONG MicrosToQpc(DWORD micros) {
+    return (LONGLONG)micros * QpcFrequency() / 1000000;
+}
+
+/**
+ * Raise a counter in g_stats to at least value.
+ */
+static void StatsMax(DWORD* field, DWORD value) {
+    volatile LONG* target = (volatile LONG*)field;
+    LONG current = *target;
+    while ((DWORD)current < value) {
+        LONG seen = InterlockedCompareExchange(target, (LONG)value, current);
+        if (seen == current) {
+            break;
+        }
+        current = seen;
+    }
+}
+
+/**
+ * Add one to a counter in g_stats.
+ */
+static void StatsIncrement(DWORD* field) {
+    InterlockedIncrement((volatile LONG*)field);
+}
+
+/**
+ * Allocate from the process heap, counting the allocation.
+ * Every heap allocation made by the DLL goes through here or ReallocMemory.
+ */
+static void* AllocMemory(SIZE_T bytes, BOOL zero) {
+    StatsIncrement(&g_stats.heapAllocations);
+    return HeapAlloc(GetProcessHeap(), zero ? HEAP_ZERO_MEMORY : 0, bytes);
+}
+
+/**
+ * Grow a block from AllocMemory, counting the allocation.
+ */
+static void* ReallocMemory(void* block, SIZE_T bytes) {
+    if (block == NULL) {
+        return AllocMemory(bytes, FALSE);
+    }
+    StatsIncrement(&g_stats.heapAllocations);
+    return HeapReAlloc(GetProcessHeap(), 0, block, bytes);
+}
+
+/**
+ * Release a block from AllocMemory.
+ */
+static void FreeMemory(void* block) {
+    if (block != NULL) {
+        HeapFree(GetProcessHeap(), 0, block);
+    }
+}
+
+/**
+ * Hash a window handle for open-addressed tables.
+ *
+ * @param hwnd Window handle
+ * @param mask Table size minus one
+ * @return Home slot for hwnd
+ */
+static DWORD HashHwnd(HWND hwnd, DWORD mask) {
+    return (DWORD)(((ULONG_PTR)hwnd >> 2) * 2654435761u) & mask;
+}
+
+/**
+ * Current destroy stamp of a window handle. A handle reused after its
+ * window was destroyed reads a different stamp, so state remembered for
+ * the old window is never applied to the new one.
+ */
+static LONG WindowStamp(HWND hwnd) {
+    return g_destroyStamps[HashHwnd(hwnd, DESTROY_STAMP_BUCKETS - 1)];
+}
+
+/**
+ * Internal: Read a window's title through the title cache. Titles are
+ * read with InternalGetWindowText, never WM_GETTEXT. Entries are filled
+ * when a create or show event is drained and refreshed on every
+ * name change, so a sweep only reads titles it has not seen. Without the
+ * hooks nothing is cached.
+ *
+ * @param hwnd Window handle
+ * @param title Receives the title (256 WCHARs), or NULL if only the length is needed
+ * @return Title length in characters
+ */
+static int CachedTitle(HWND hwnd, WCHAR* title) {
+    BOOL enabled = EventsActive();
+    TitleEntry* entry = &g_titleCache[HashHwnd(hwnd, TITLE_CACHE_SLOTS - 1)];
+    LONG version = 0;
+    if (enabled) {
+        AcquireSRWLockShared(&g_titleLock);
+        version = entry->version;
+        int length = -1;
+        if (entry->hwnd == hwnd && entry->stamp == WindowStamp(hwnd) &&
+            (title == NULL || entry->length <= TITLE_CACHE_CHARS)) {
+            length = entry->length;
+            if (title != NULL) {
+                memcpy(title, entry->text, length * sizeof(WCHAR));
+                title[length] = L'\0';
+            }
+        }
+        ReleaseSRWLockShared(&g_titleLock);
+        if (length >= 0) {
+            StatsIncrement(&g_stats.titleCacheHits);
+            return length;
+        }
+    }
+
+    WCHAR buffer[256];
+    WCHAR* text = title != NULL ? title : buffer;
+    int length = InternalGetWindowText(hwnd, text, 256);
+    StatsIncrement(&g_stats.titleFetches);
+
+    if (enabled) {
+        // Dropped if a name change refreshed the slot meanwhile
+        AcquireSRWLockExclusive(&g_titleLock);
+        if (entry->version == version) {
+            entry->hwnd = hwnd;
+            entry->stamp = WindowStamp(hwnd);
+            entry->length = (WORD)length;
+            if (length <= TITLE_CACHE_CHARS) {
+                memcpy(entry->text, text, length * sizeof(WCHAR));
+            }
+        }
+        ReleaseSRWLockExclusive(&g_titleLock);
+    }
+    return length;
+}
+
+/**
+ * Internal: Refresh a window's cached title after it was created, shown
+ * or renamed. Called while draining hook events; sends no message.
+ */
+static void RefreshTitle(HWND hwnd) {
+    WCHAR title[256];
+    int length = InternalGetWindowText(hwnd, title, 256);
+
+    TitleEntry* entry = &g_titleCache[HashHwnd(hwnd, TITLE_CACHE_SLOTS - 1)];
+    AcquireSRWLockExclusive(&g_titleLock);
+    entry->version = (entry->version + 1) & MAXLONG;
+    entry->hwnd = hwnd;
+    entry->stamp = WindowStamp(hwnd);
+    entry->length = (WORD)length;
+    if (length <= TITLE_CACHE_CHARS) {
+        memcpy(entry->text, title, length * sizeof(WCHAR));
+    }
+    ReleaseSRWLockExclusive(&g_titleLock);
+}
+
+/**
+ * Internal: Drop a snapshot's reference to a rule set, unmapping it with
+ * the last one.
+ */
+static void ReleaseRuleSet(RuleSet* rules) {
+    if (rules != NULL && InterlockedDecrement(&rules->refs) == 0) {
+        UnmapViewOfFile(rules->view);
+        FreeMemory(rules);
+    }
+}
+
+/**
+ * String at an offset in a rule file, bounds-checked.
+ *
+ * @param rules Rule set
+ * @param offset Offset of the string's length prefix
+ * @param len Receives the length in UTF-16 units
+ * @return The characters, or NULL if the offset is out of range
+ */
+static const WCHAR* RuleString(const RuleSet* rules, DWORD offset, DWORD* len) {
+    if (offset == 0 || (offset & 1) != 0 || offset > rules->size - sizeof(WORD)) {
+        return NULL;
+    }
+    *len = *(const WORD*)(rules->view + offset);
+    if (*len > (rules->size - offset - sizeof(WORD)) / sizeof(WCHAR)) {
+        return NULL;
+    }
+    return (const WCHAR*)(rules->view + offset + sizeof(WORD));
+}
+
+/**
+ * ASCII upper case of a UTF-16 unit; matches the folding in compile_policy.py.
+ */
+static WCHAR FoldAscii(WCHAR c) {
+    return c >= L'a' && c <= L'z' ? (WCHAR)(c - L'a' + L'A') : c;
+}
+
+/**
+ * Compare two strings, ASCII case-insensitively.
+ */
+static BOOL SameText(const WCHAR* a, DWORD lenA, const WCHAR* b, DWORD lenB) {
+    if (lenA != lenB) {
+        return FALSE;
+    }
+    for (DWORD i = 0; i < lenA; i++) {
+        if (FoldAscii(a[i]) != FoldAscii(b[i])) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+/**
+ * Check one rule against a window's class and title.
+ */
+static BOOL RuleMatches(const RuleSet* rules, const RuleEntry* rule, const WCHAR* className, DWORD classLen,
+                        const WCHAR* title, DWORD titleLen) {
+    DWORD len;
+    if (rule->classOffset != 0) {
+        const WCHAR* text = RuleString(rules, rule->classOffset, &len);
+        if (text == NULL || !SameText(text, len, className, classLen)) {
+            return FALSE;
+        }
+    }
+
+    if (rule->titleMatch == TITLE_ANY) {
+        return TRUE;
+    }
+    const WCHAR* text = RuleString(rules, rule->titleOffset, &len);
+    if (text == NULL || len > titleLen) {
+        return FALSE;
+    }
+
+    switch (rule->titleMatch) {
+    case TITLE_EXACT:
+        return SameText(text, len, title, titleLen);
+    case TITLE_PREFIX:
+        return SameText(text, len, title, len);
+    case TITLE_CONTAINS:
+        for (DWORD start = 0; start + len <= titleLen; start++) {
+            if (SameText(text, len, title + start, len)) {
+                return TRUE;
+            }
+        }
+        return FALSE;
+    default:
+        return FALSE;
+    }
+}
+
+/**
+ * Lowest-index matching rule in one bucket chain, below a limit.
+ * Chains must be strictly ascending, so a corrupt file cannot loop.
+ *
+ * @return Matching rule index, or limit if none
+ */
+static DWORD FirstMatchInChain(const RuleSet* rules, DWORD head, DWORD limit, const WCHAR* className,
+                               DWORD classLen, const WCHAR* title, DWORD titleLen) {
+    const RulesHeader* header = (const RulesHeader*)rules->view;
+    const RuleEntry* entries = (const RuleEntry*)(rules->view + header->rulesOffset);
+
+    DWORD previous = 0;
+    for (DWORD next = head; next != 0 && next > previous && next - 1 < limit; next = entries[next - 1].next) {
+        previous = next;
+        if (RuleMatches(rules, &entries[next - 1], className, classLen, title, titleLen)) {
+            return next - 1;
+        }
+    }
+    return limit;
+}
+
+/**
+ * Evaluate a rule set against a window in place: one bucket chain for its
+ * class plus the chain of class-less rules. Sends no message.
+ *
+ * @return RULE_HIDE, RULE_SKIP, or RULE_NONE if no rule matches
+ */
+static LONG EvaluateRules(RuleSet* rules, HWND hwnd) {
+    LONGLONG start = QpcNow();
+    const RulesHeader* header = (const RulesHeader*)rules->view;
+    const DWORD* buckets = (const DWORD*)(rules->view + header->bucketsOffset);
+
+    WCHAR className[256];
+    WCHAR title[256];
+    DWORD classLen = (DWORD)GetClassNameW(hwnd, className, 256);
+    DWORD titleLen = (DWORD)CachedTitle(hwnd, title);
+
+    DWORD hash = 2166136261u;
+    for (DWORD i = 0; i < classLen; i++) {
+        hash = (hash ^ FoldAscii(className[i])) * 16777619u;
+    }
+
+    DWORD limit = header->ruleCount;
+    DWORD match = FirstMatchInChain(rules, buckets[hash & (header->bucketCount - 1)], limit,
+                                    className, classLen, title, titleLen);
+    match = FirstMatchInChain(rules, buckets[header->bucketCount], match, className, classLen, title, titleLen);
+
+    LONG action = RULE_NONE;
+    if (match < limit) {
+        action = ((const RuleEntry*)(rules->view + header->rulesOffset))[match].action;
+    }
+
+    if (rules->evaluated == 0 && InterlockedExchange(&rules->evaluated, 1) == 0) {
+        g_stats.rulesFirstEvalMicros = QpcToMicros(QpcNow() - start);
+    }
+    return action;
+}
+
+/**
+ * Map a compiled rule file and check its header. Nothing else is read
+ * until a rule is evaluated.
+ *
+ * @param path Rule file
+ * @return Rule set holding one reference, or NULL if the file is missing or invalid
+ */
+static RuleSet* MapRuleSet(LPCWSTR path) {
+    HANDLE file = CreateFileW(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        return NULL;
+    }
+
+    LARGE_INTEGER size;
+    HANDLE mapping = NULL;
+    if (GetFileSizeEx(file, &size) && size.QuadPart >= (LONGLONG)sizeof(RulesHeader) &&
+        size.QuadPart <= RULES_MAX_BYTES) {
+        mapping = CreateFileMappingW(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    }
+    CloseHandle(file);
+    if (mapping == NULL) {
+        return NULL;
+    }
+
+    const BYTE* view = (const BYTE*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(mapping);
+    if (view == NULL) {
+        return NULL;
+    }
+
+    // Header check: sections in range and aligned, so evaluation only has
+    // to bounds-check string offsets and chain links
+    const RulesHeader* header = (const RulesHeader*)view;
+    DWORD bytes = (DWORD)size.QuadPart;
+    BOOL valid = header->magic == RULES_MAGIC && header->version == RULES_VERSION &&
+                 header->headerSize == sizeof(RulesHeader) && header->fileSize == bytes &&
+                 header->bucketCount != 0 && (header->bucketCount & (header->bucketCount - 1)) == 0 &&
+                 header->bucketCount < RULES_MAX_BYTES / sizeof(DWORD) &&
+                 header->ruleCount < RULES_MAX_BYTES / sizeof(RuleEntry) &&
+                 (header->bucketsOffset & 3) == 0 && (header->rulesOffset & 3) == 0 &&
+                 header->bucketsOffset >= sizeof(RulesHeader) &&
+                 (ULONGLONG)header->bucketsOffset + (header->bucketCount + 1) * sizeof(DWORD) <= bytes &&
+                 header->rulesOffset >= sizeof(RulesHeader) &&
+                 (ULONGLONG)header->rulesOffset + header->ruleCount * sizeof(RuleEntry) <= bytes;
+
+    RuleSet* rules = valid ? (RuleSet*)AllocMemory(sizeof(RuleSet), TRUE) : NULL;
+    if (rules == NULL) {
+        UnmapViewOfFile(view);
+        return NULL;
+    }
+    rules->view = view;
+    rules->size = bytes;
+    rules->refs = 1;
+    return rules;
+}
+
+/**
+ * Start reading the current policy. Lock-free while a reader slot is
+ * free: each slot is tried once, starting from one picked by thread id.
+ * If all are busy the read takes g_policyLock shared instead, which keeps
+ * writers, and so reclamation, out until ReleasePolicy. Pair with
+ * ReleasePolicy and keep the snapshot only until then; do not publish a
+ * policy in between.
+ *
+ * @param slot Receives the reader slot to release
+ * @return Current policy snapshot
+ */
+static const HidePolicy* AcquirePolicy(DWORD* slot) {
+    DWORD first = (GetCurrentThreadId() >> 2) % POLICY_READER_SLOTS;
+    for (DWORD probe = 0; probe < POLICY_READER_SLOTS; probe++) {
+        DWORD i = (first + probe) % POLICY_READER_SLOTS;
+        // Interlocked read, so the 64-bit epoch is atomic on x86 too
+        LONGLONG epoch = InterlockedCompareExchange64(&g_policyEpoch, 0, 0);
+        if (InterlockedCompareExchange64(&g_policyReaders[i].epoch, epoch, 0) == 0) {
+            // The slot write above is a full barrier, so this load sees any
+            // snapshot published before a writer could have checked the slot
+            *slot = i;
+            return g_policy;
+        }
+    }
+
+    AcquireSRWLockShared(&g_policyLock);
+    StatsIncrement(&g_stats.policyReaderFallbacks);
+    *slot = POLICY_READER_SLOTS;
+    return g_policy;
+}
+
+/**
+ * Finish reading a policy snapshot from AcquirePolicy.
+ */
+static void ReleasePolicy(DWORD slot) {
+    if (slot == POLICY_READER_SLOTS) {
+        ReleaseSRWLockShared(&g_policyLock);
+        return;
+    }
+    InterlockedExchange64(&g_policyReaders[slot].epoch, 0);
+}
+
+/**
+ * Internal: Free replaced snapshots no active reader can still hold.
+ * Caller holds g_policyLock.
+ */
+static void ReclaimPolicies() {
+    LONGLONG oldest = MAXLONGLONG;
+    for (DWORD i = 0; i < POLICY_READER_SLOTS; i++) {
+        LONGLONG epoch = InterlockedCompareExchange64(&g_policyReaders[i].epoch, 0, 0);
+        if (epoch != 0 && epoch < oldest) {
+            oldest = epoch;
+        }
+    }
+
+    // A reader that started in an epoch at or after retiredAt loaded the
+    // pointer after the swap, so it holds a newer snapshot
+    DWORD pending = 0;
+    HidePolicy** link = &g_retiredPolicies;
+    while (*link != NULL) {
+        HidePolicy* policy = *link;
+        if (policy->retiredAt <= oldest) {
+            *link = policy->nextRetired;
+            ReleaseRuleSet(policy->rules);
+            FreeMemory(policy);
+        } else {
+            link = &policy->nextRetired;
+            pending++;
+        }
+    }
+    g_stats.policiesPending = pending;
+}
+
+/**
+ * Internal: Make a new snapshot current. Never waits for readers; the
+ * old snapshot is retired and freed by this or a later publish.
+ *
+ * @param policy Snapshot from AllocMemory, not yet visible to readers
+ */
+static void PublishPolicy(HidePolicy* policy) {
+    AcquireSRWLockExclusive(&g_policyLock);
+
+    HidePolicy* old = (HidePolicy*)InterlockedExchangePointer((PVOID volatile*)&g_policy, policy);
+    LONGLONG retiredAt = InterlockedIncrement64(&g_policyEpoch);
+    if (old != &g_defaultPolicy) {
+        old->retiredAt = retiredAt;
+        old->nextRetired = g_retiredPolicies;
+        g_retiredPolicies = old;
+    }
+    ReclaimPolicies();
+    InterlockedIncrement(&g_rejectGeneration);
+
+    ReleaseSRWLockExclusive(&g_policyLock);
+}
+
+/**
+ * Internal: Allocate a copy of the current policy for a writer to change
+ * and publish.
+ *
+ * @return New snapshot, or NULL if out of memory
+ */
+static HidePolicy* CopyPolicy() {
+    HidePolicy* policy = (HidePolicy*)AllocMemory(sizeof(HidePolicy), FALSE);
+    if (policy != NULL) {
+        DWORD slot;
+        const HidePolicy* current = AcquirePolicy(&slot);
+        *policy = *current;
+        policy->retiredAt = 0;
+        policy->nextRetired = NULL;
+        if (policy->rules != NULL) {
+            InterlockedIncrement(&policy->rules->refs);
+        }
+        ReleasePolicy(slot);
+    }
+    return policy;
+}
+
+/**
+ * Internal: Map a rule file and publish it in a new policy snapshot.
+ *
+ * @param path Compiled rule file, or NULL to remove the rules
+ * @return FALSE if the file is missing, invalid, or memory runs out
+ */
+static BOOL ReplaceRules(LPCWSTR path) {
+    LONGLONG start = QpcNow();
+
+    RuleSet* rules = NULL;
+    if (path != NULL) {
+        rules = MapRuleSet(path);
+        if (rules == NULL) {
+            return FALSE;
+        }
+    }
+
+    HidePolicy* next = CopyPolicy();
+    if (next == NULL) {
+        ReleaseRuleSet(rules);
+        return FALSE;
+    }
+    ReleaseRuleSet(next->rules);
+    next->rules = rules;
+    PublishPolicy(next);
+
+    g_stats.ruleCount = rules != NULL ? ((const RulesHeader*)rules->view)->ruleCount : 0;
+    g_stats.rulesLoadMicros = QpcToMicros(QpcNow() - start);
+    return TRUE;
+}
+
+/**
+ * Apply the policy's rules, if any, to a top-level window.
+ *
+ * @param policy Snapshot held by the caller
+ * @return RULE_HIDE, RULE_SKIP, or RULE_NONE to fall back to filterFlags
+ */
+static LONG PolicyRuleAction(const HidePolicy* policy, HWND hwnd) {
+    return policy->rules != NULL ? EvaluateRules(policy->rules, hwnd) : RULE_NONE;
+}
+
+/**
+ * IsValidAppWindow predicates. Each returns TRUE if the window passes.
+ * They form a plain conjunction, so any evaluation order gives the same
+ * answer; only the cost of reaching a rejection changes.
+ */
+static BOOL PredicateIsWindow(HWND hwnd, DWORD filterFlags) {
+    // Check if window handle is valid
+    return IsWindow(hwnd);
+}
+
+static BOOL PredicateVisible(HWND hwnd, DWORD filterFlags) {
+    // Must be visible
+    return IsWindowVisible(hwnd);
+}
+
+static BOOL PredicateParent(HWND hwnd, DWORD filterFlags) {
+    // Must be a top-level window (no parent, or parent is desktop)
+    HWND parent = GetParent(hwnd);
+    return parent == NULL || parent == GetDesktopWindow();
+}
+
+static BOOL PredicateStyle(HWND hwnd, DWORD filterFlags) {
+    // Must not be a child window
+    return (GetWindowLongPtr(hwnd, GWL_STYLE) & WS_CHILD) == 0;
+}
+
+static BOOL PredicateExStyle(HWND hwnd, DWORD filterFlags) {
+    // Must not be a tool window (floating toolbars, etc.)
+    return !(filterFlags & FILTER_SKIP_TOOL_WINDOWS) || (GetWindowLongPtr(hwnd, GWL_EXSTYLE) & WS_EX_TOOLWINDOW) == 0;
+}
+
+static BOOL PredicateTitle(HWND hwnd, DWORD filterFlags) {
+    // Must have a title (filters out internal/helper windows)
+    if (!(filterFlags & FILTER_REQUIRE_TITLE)) {
+        return TRUE;
+    }
+    return CachedTitle(hwnd, NULL) > 0;
+}
+
+// Indexed by PREDICATE_* ids
+static const WindowPredicate g_predicates[PREDICATE_COUNT] = {
+    PredicateIsWindow, PredicateVisible, PredicateParent, PredicateStyle, PredicateExStyle, PredicateTitle,
+};
+
+/**
+ * Internal: Re-derive the adaptive order from the profile. Sorting by
+ * cost divided by rejection rate puts first the predicates that reach a
+ * rejection most cheaply on this host. Unsampled predicates sort first so
+ * they get measured; predicates that never reject sort last.
+ */
+static void ReorderPredicates() {
+    double keys[PREDICATE_COUNT];
+    DWORD order[PREDICATE_COUNT];
+    for (DWORD i = 0; i < PREDICATE_COUNT; i++) {
+        LONG samples = g_predicateProfile[i].samples;
+        LONG rejections = g_predicateProfile[i].rejections;
+        if (samples == 0) {
+            keys[i] = 0;
+        } else if (rejections == 0) {
+            keys[i] = 1e300;
+        } else {
+            // (ticks / samples) / (rejections / samples)
+            keys[i] = (double)g_predicateProfile[i].ticks / rejections;
+        }
+
+        // Insertion sort; ties keep the original order
+        DWORD j = i;
+        while (j > 0 && keys[order[j - 1]] > keys[i]) {
+            order[j] = order[j - 1];
+            j--;
+        }
+        order[j] = i;
+    }
+
+    LONG packed = 0;
+    for (DWORD i = 0; i < PREDICATE_COUNT; i++) {
+        packed |= (LONG)order[i] << (i * 4);
+    }
+    InterlockedExchange(&g_predicateOrder, packed);
+}
+
+/**
+ * Internal: Run the predicates in the current order. One evaluation in
+ * PREDICATE_SAMPLE_RATE is timed per predicate and counted in the
+ * profile; with FILTER_ADAPTIVE_ORDER the order is re-derived every
+ * PREDICATE_REORDER_SAMPLES sampled evaluations.
+ *
+ * @return Id of the rejecting predicate, or PREDICATE_PASSED
+ */
+static DWORD RunPredicates(HWND hwnd, DWORD filterFlags) {
+    LONG order = (filterFlags & FILTER_ADAPTIVE_ORDER) ? g_predicateOrder : PREDICATE_DEFAULT_ORDER;
+
+    // A racy counter is fine for picking samples
+    g_predicateCalls++;
+    if ((g_predicateCalls & (PREDICATE_SAMPLE_RATE - 1)) != 0) {
+        for (DWORD i = 0; i < PREDICATE_COUNT; i++) {
+            DWORD id = (order >> (i * 4)) & 0xF;
+            if (!g_predicates[id](hwnd, filterFlags)) {
+                return id;
+            }
+        }
+        return PREDICATE_PASSED;
+    }
+
+    DWORD rejectedBy = PREDICATE_PASSED;
+    for (DWORD i = 0; i < PREDICATE_COUNT && rejectedBy == PREDICATE_PASSED; i++) {
+        DWORD id = (order >> (i * 4)) & 0xF;
+        LONGLONG start = QpcNow();
+        BOOL passed = g_predicates[id](hwnd, filterFlags);
+        InterlockedExchangeAdd64(&g_predicateProfile[id].ticks, QpcNow() - start);
+        InterlockedIncrement(&g_predicateProfile[id].samples);
+        if (!passed) {
+            InterlockedIncrement(&g_predicateProfile[id].rejections);
+            rejectedBy = id;
+        }
+    }
+
+    if ((filterFlags & FILTER_ADAPTIVE_ORDER) &&
+        InterlockedIncrement(&g_predicateSampled) % PREDICATE_REORDER_SAMPLES == 0) {
+        ReorderPredicates();
+    }
+    return rejectedBy;
+}
+
+/**
+ * Internal: Look a window up in the rejection cache. Only valid while the
+ * event hooks run, since they are what invalidates entries. Reads the
+ * window's styles but sends no message.
+ *
+ * @param hwnd Window handle
+ * @param version Receives the slot version, for RememberRejection
+ * @return TRUE if the window is still known to be rejected
+ */
+static BOOL LookupRejection(HWND hwnd, LONG* version) {
+    if (!EventsActive()) {
+        *version = -1;
+        return FALSE;
+    }
+
+    RejectEntry* entry = &g_rejectCache[HashHwnd(hwnd, REJECT_CACHE_SLOTS - 1)];
+    AcquireSRWLockShared(&g_rejectLock);
+    *version = entry->version;
+    BOOL hit = entry->hwnd == hwnd &&
+               entry->generation == g_rejectGeneration &&
+               entry->stamp == WindowStamp(hwnd) &&
+               entry->style == GetWindowLongPtr(hwnd, GWL_STYLE) &&
+               entry->exStyle == GetWindowLongPtr(hwnd, GWL_EXSTYLE);
+    ReleaseSRWLockShared(&g_rejectLock);
+    return hit;
+}
+
+/**
+ * Internal: Cache a rejection. Dropped if the slot was invalidated since
+ * LookupRejection, so an event raised while the predicates ran is not lost.
+ * Whatever the reason, nothing is cached for a handle that is no longer a
+ * live window or whose window was destroyed while the predicates ran: the
+ * rejection may describe the old window, and the cached stamp would match
+ * a new one reusing the handle.
+ *
+ * @param hwnd Rejected window
+ * @param reason Rejecting PREDICATE_* id or REJECT_RULE
+ * @param version Slot version returned by LookupRejection
+ * @param generation g_rejectGeneration read before the policy was
+ * @param stamp Destroy stamp of hwnd read before the predicates ran
+ */
+static void RememberRejection(HWND hwnd, DWORD reason, LONG version, LONG generation, LONG stamp) {
+    if (version < 0 || reason == PREDICATE_IS_WINDOW || WindowStamp(hwnd) != stamp || !IsWindow(hwnd)) {
+        return;
+    }
+
+    RejectEntry* entry = &g_rejectCache[HashHwnd(hwnd, REJECT_CACHE_SLOTS - 1)];
+    AcquireSRWLockExclusive(&g_rejectLock);
+    if (entry->version == version) {
+        entry->hwnd = hwnd;
+        entry->stamp = stamp;
+        entry->generation = generation;
+        entry->reason = reason;
+        entry->style = GetWindowLongPtr(hwnd, GWL_STYLE);
+        entry->exStyle = GetWindowLongPtr(hwnd, GWL_EXSTYLE);
+    }
+    ReleaseSRWLockExclusive(&g_rejectLock);
+}
+
+/**
+ * Internal: Drop a window's cached rejection after a change event.
+ * Called while draining hook events; takes g_rejectLock only briefly.
+ */
+static void ForgetRejection(HWND hwnd) {
+    RejectEntry* entry = &g_rejectCache[HashHwnd(hwnd, REJECT_CACHE_SLOTS - 1)];
+    AcquireSRWLockExclusive(&g_rejectLock);
+    // Bump even on a miss: a rejection of hwnd may be about to be cached
+    entry->version = (entry->version + 1) & MAXLONG;
+    if (entry->hwnd == hwnd) {
+        entry->hwnd = NULL;
+    }
+    ReleaseSRWLockExclusive(&g_rejectLock);
+}
+
+/**
+ * Internal: Run the window filter. Filters out invisible and child
+ * windows; then the policy's rules decide, and for windows no rule
+ * matches, filterFlags skip tool windows and windows without titles. The
+ * checks run as profiled predicates, in an adaptive order when the policy
+ * asks for it.
+ *
+ * @param policy Snapshot held by the caller
+ * @param filterFlags FILTER_* flags to apply
+ * @return PREDICATE_PASSED, or the rejecting PREDICATE_* id or REJECT_RULE
+ */
+static DWORD FilterWindow(const HidePolicy* policy, HWND hwnd, DWORD filterFlags) {
+    DWORD reason;
+    if (policy->rules == NULL) {
+        reason = RunPredicates(hwnd, filterFlags);
+    } else {
+        // Rules override the tool window and title checks, so run the
+        // structural checks first and those two only if no rule matches
+        reason = RunPredicates(hwnd, filterFlags & ~(FILTER_SKIP_TOOL_WINDOWS | FILTER_REQUIRE_TITLE));
+        if (reason == PREDICATE_PASSED) {
+            LONG action = PolicyRuleAction(policy, hwnd);
+            if (action == RULE_SKIP) {
+                reason = REJECT_RULE;
+            } else if (action == RULE_NONE) {
+                if (!PredicateExStyle(hwnd, filterFlags)) {
+                    reason = PREDICATE_EXSTYLE;
+                } else if (!PredicateTitle(hwnd, filterFlags)) {
+                    reason = PREDICATE_TITLE;
+                }
+            }
+        }
+    }
+    return reason;
+}
+
+/**
+ * Check if window is a valid application window that should be processed:
+ * the HideAllWindows filter, with the policy's filter flags. Rejections
+ * are cached until the window changes.
+ *
+ * @param hwnd Window handle to check
+ * @return TRUE if window should be processed, FALSE otherwise
+ */
+static BOOL IsValidAppWindow(HWND hwnd) {
+    LONG version;
+    if (LookupRejection(hwnd, &version)) {
+        StatsIncrement(&g_stats.rejectCacheHits);
+        return FALSE;
+    }
+    StatsIncrement(&g_stats.rejectCacheMisses);
+
+    // Read before the policy and the predicates, so a publish or a destroy
+    // in between keeps the entry out of the cache
+    LONG generation = g_rejectGeneration;
+    LONG stamp = WindowStamp(hwnd);
+    DWORD slot;
+    const HidePolicy* policy = AcquirePolicy(&slot);
+    DWORD reason = FilterWindow(policy, hwnd, policy->filterFlags);
+    ReleasePolicy(slot);
+
+    if (reason != PREDICATE_PASSED) {
+        RememberRejection(hwnd, reason, version, generation, stamp);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/**
+ * Check that a remembered HWND still names the same window.
+ * Without the destroy hook, stamps never move, so fall back to IsWindow.
+ *
+ * @param hwnd Remembered window handle
+ * @param stamp Destroy stamp taken when it was remembered
+ * @return TRUE if no window with this handle was destroyed since
+ */
+static BOOL IsStampCurrent(HWND hwnd, LONG stamp) {
+    if (!EventsActive()) {
+        return IsWindow(hwnd);
+    }
+    return WindowStamp(hwnd) == stamp;
+}
+
+/**
+ * Continue an FNV-1a hash over a string.
+ */
+static DWORD HashText(DWORD hash, const WCHAR* text, int len) {
+    for (int i = 0; i < len; i++) {
+        hash = (hash ^ text[i]) * 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * Identity signature of a top-level window: FNV-1a over its thread, class
+ * atom, owner and title. A toolkit that recreates a window produces the
+ * same signature for the new handle. The title is read with
+ * InternalGetWindowText, which sends no message, so this is safe while
+ * draining hook events and for windows of other threads.
+ *
+ * @param hwnd Window handle
+ * @return Signature, never 0
+ */
+static DWORD WindowSignature(HWND hwnd) {
+    DWORD parts[3];
+    parts[0] = GetWindowThreadProcessId(hwnd, NULL);
+    parts[1] = (DWORD)GetClassLongPtrW(hwnd, GCW_ATOM);
+    parts[2] = HashHwnd(GetWindow(hwnd, GW_OWNER), 0xFFFFFFFF);
+
+    DWORD hash = 2166136261u;
+    for (int i = 0; i < 3; i++) {
+        hash = (hash ^ parts[i]) * 16777619u;
+    }
+
+    WCHAR title[256];
+    int len = InternalGetWindowText(hwnd, title, 256);
+    hash = HashText(hash, title, len);
+    return hash != 0 ? hash : 1;
+}
+
+/**
+ * Signature of a window for the persistent profile. Thread ids, atoms and
+ * owner handles change between runs, so only the class name and title are
+ * hashed. Sends no message.
+ *
+ * @param hwnd Window handle
+ * @return Signature, never 0 or PROFILE_REMOVED
+ */
+static DWORD ProfileSignature(HWND hwnd) {
+    WCHAR text[256];
+    int len = GetClassNameW(hwnd, text, 256);
+    DWORD hash = HashText(2166136261u, text, len);
+
+    // Separator, so "ab" + "c" and "a" + "bc" differ
+    hash = (hash ^ 0xFFFF) * 16777619u;
+    len = InternalGetWindowText(hwnd, text, 256);
+    hash = HashText(hash, text, len);
+    return hash > PROFILE_REMOVED ? hash : hash + 2;
+}
+
+/**
+ * Internal: Add a top-level window to the registry. A full registry is
+ * marked overflowed and the registry strategy stops being used.
+ */
+static void RegisterWindow(HWND hwnd) {
+    AcquireSRWLockExclusive(&g_registryLock);
+    DWORD i = 0;
+    while (i < g_registryCount && g_registry[i] != hwnd) {
+        i++;
+    }
+    if (i == g_registryCount) {
+        if (g_registryCount < REGISTRY_CAPACITY) {
+            g_registry[g_registryCount++] = hwnd;
+        } else {
+            g_registryOverflow = 1;
+        }
+    }
+    ReleaseSRWLockExclusive(&g_registryLock);
+}
+
+/**
+ * Internal: Remove a destroyed window from the registry.
+ */
+static void UnregisterWindow(HWND hwnd) {
+    AcquireSRWLockExclusive(&g_registryLock);
+    for (DWORD i = 0; i < g_registryCount; i++) {
+        if (g_registry[i] == hwnd) {
+            g_registry[i] = g_registry[--g_registryCount];
+            break;
+        }
+    }
+    ReleaseSRWLockExclusive(&g_registryLock);
+}
+
+/**
+ * Internal: TRUE while the hooks keep the spatial index. An unusable
+ * index is never queried again, so it is not kept either.
+ */
+static BOOL SpatialKept() {
+    LONG state = g_spatialState;
+    return state == SPATIAL_SEEDING || state == SPATIAL_READY;
+}
+
+/**
+ * Internal: Grid cells covered by a screen rectangle, inclusive. An empty
+ * rectangle covers the cell at its top-left corner.
+ *
+ * @param rect Screen rectangle
+ * @param cells Receives the first and last cell in each direction
+ * @return Number of cells covered
+ */
+static ULONGLONG SpatialCellRange(const RECT* rect, RECT* cells) {
+    cells->left = rect->left >> SPATIAL_CELL_SHIFT;
+    cells->top = rect->top >> SPATIAL_CELL_SHIFT;
+    cells->right = (rect->right > rect->left ? rect->right - 1 : rect->left) >> SPATIAL_CELL_SHIFT;
+    cells->bottom = (rect->bottom > rect->top ? rect->bottom - 1 : rect->top) >> SPATIAL_CELL_SHIFT;
+    return (ULONGLONG)(cells->right - cells->left + 1) * (ULONGLONG)(cells->bottom - cells->top + 1);
+}
+
+/**
+ * Internal: Grid bucket a cell hashes to.
+ */
+static SpatialBucket* SpatialBucketFor(LONG x, LONG y) {
+    return &g_spatialGrid[(((DWORD)x * 73856093u) ^ ((DWORD)y * 19349663u)) & (SPATIAL_BUCKETS - 1)];
+}
+
+/**
+ * Internal: Append an entry id to a bucket, doubling its array as needed.
+ *
+ * @return TRUE on success, FALSE if out of memory
+ */
+static BOOL SpatialBucketAdd(SpatialBucket* bucket, WORD id) {
+    if (bucket->count == bucket->capacity) {
+        DWORD capacity = bucket->capacity == 0 ? 8 : bucket->capacity * 2;
+        WORD* items = (WORD*)ReallocMemory(bucket->items, capacity * sizeof(WORD));
+        if (items == NULL) {
+            return FALSE;
+        }
+        bucket->items = items;
+        bucket->capacity = capacity;
+    }
+    bucket->items[bucket->count++] = id;
+    return TRUE;
+}
+
+/**
+ * Internal: Remove one occurrence of an entry id from a bucket.
+ */
+static void SpatialBucketRemove(SpatialBucket* bucket, WORD id) {
+    for (DWORD i = 0; i < bucket->count; i++) {
+        if (bucket->items[i] == id) {
+            bucket->items[i] = bucket->items[--bucket->count];
+            return;
+        }
+    }
+}
+
+/**
+ * Internal: Remove an entry from the first limit cells of a range, in the
+ * order SpatialLinkLocked added them. Under g_spatialLock.
+ */
+static void SpatialUnlinkCells(WORD id, const RECT* cells, DWORD limit) {
+    for (LONG y = cells->top; y <= cells->bottom; y++) {
+        for (LONG x = cells->left; x <= cells->right; x++) {
+            if (limit-- == 0) {
+                return;
+            }
+            SpatialBucketRemove(SpatialBucketFor(x, y), id);
+        }
+    }
+}
+
+/**
+ * Internal: Add an entry to the cells its bounds cover, or to the large
+ * list if it covers too many or a bucket cannot grow. If even the large
+ * list cannot grow, the index stops being used. Under g_spatialLock.
+ */
+static void SpatialLinkLocked(WORD id) {
+    SpatialEntry* entry = &g_spatial[id];
+    RECT cells;
+    BOOL large = SpatialCellRange(&entry->bounds, &cells) > SPATIAL_MAX_CELLS;
+
+    DWORD linked = 0;
+    for (LONG y = cells.top; y <= cells.bottom && !large; y++) {
+        for (LONG x = cells.left; x <= cells.right && !large; x++) {
+            if (SpatialBucketAdd(SpatialBucketFor(x, y), id)) {
+                linked++;
+            } else {
+                large = TRUE;
+            }
+        }
+    }
+
+    entry->flags = (WORD)((entry->flags & ~SPATIAL_LARGE) | (large ? SPATIAL_LARGE : 0));
+    if (large) {
+        SpatialUnlinkCells(id, &cells, linked);
+        if (!SpatialBucketAdd(&g_spatialLarge, id)) {
+            g_spatialState = SPATIAL_UNUSABLE;
+        }
+    }
+}
+
+/**
+ * Internal: Remove an entry from the grid or the large list. Under g_spatialLock.
+ */
+static void SpatialUnlinkLocked(WORD id) {
+    SpatialEntry* entry = &g_spatial[id];
+    if (entry->flags & SPATIAL_LARGE) {
+        SpatialBucketRemove(&g_spatialLarge, id);
+    } else {
+        RECT cells;
+        SpatialCellRange(&entry->bounds, &cells);
+        SpatialUnlinkCells(id, &cells, MAXDWORD);
+    }
+}
+
+/**
+ * Internal: Entry indexing a window. Under g_spatialLock.
+ *
+ * @return Entry id, or SPATIAL_NONE if the window is not indexed
+ */
+static WORD SpatialFindLocked(HWND hwnd) {
+    WORD next = g_spatialHash[HashHwnd(hwnd, SPATIAL_HASH_SLOTS - 1)];
+    while (next != 0 && g_spatial[next - 1].hwnd != hwnd) {
+        next = g_spatial[next - 1].nextHash;
+    }
+    return next != 0 ? (WORD)(next - 1) : SPATIAL_NONE;
+}
+
+/**
+ * Internal: Move an entry to new bounds. A move within the same cells
+ * only rewrites the bounds. Under g_spatialLock.
+ */
+static void SpatialMoveLocked(WORD id, const RECT* bounds) {
+    SpatialEntry* entry = &g_spatial[id];
+    RECT oldCells;
+    RECT newCells;
+    ULONGLONG oldCount = SpatialCellRange(&entry->bounds, &oldCells);
+    SpatialCellRange(bounds, &newCells);
+    if (!(entry->flags & SPATIAL_LARGE) && oldCount <= SPATIAL_MAX_CELLS && EqualRect(&oldCells, &newCells)) {
+        entry->bounds = *bounds;
+    } else {
+        SpatialUnlinkLocked(id);
+        entry->bounds = *bounds;
+        SpatialLinkLocked(id);
+    }
+}
+
+/**
+ * Internal: Index a window at its current bounds, or move its entry. A
+ * full index is marked unusable, and queries enumerate instead.
+ */
+static void SpatialUpdate(HWND hwnd) {
+    RECT bounds;
+    if (!GetWindowRect(hwnd, &bounds)) {
+        return;
+    }
+
+    AcquireSRWLockExclusive(&g_spatialLock);
+    WORD id = SpatialFindLocked(hwnd);
+    if (id != SPATIAL_NONE) {
+        SpatialMoveLocked(id, &bounds);
+    } else {
+        if (g_spatialFree != 0) {
+            id = (WORD)(g_spatialFree - 1);
+            g_spatialFree = g_spatial[id].nextHash;
+        } else if (g_spatialHighWater < SPATIAL_CAPACITY) {
+            id = (WORD)g_spatialHighWater++;
+        } else {
+            g_spatialState = SPATIAL_UNUSABLE;
+        }
+
+        if (id != SPATIAL_NONE) {
+            WORD* head = &g_spatialHash[HashHwnd(hwnd, SPATIAL_HASH_SLOTS - 1)];
+            SpatialEntry* entry = &g_spatial[id];
+            entry->hwnd = hwnd;
+            entry->bounds = bounds;
+            entry->queryMark = 0;
+            entry->flags = 0;
+            entry->nextHash = *head;
+            *head = (WORD)(id + 1);
+            SpatialLinkLocked(id);
+            g_stats.spatialWindows++;
+        }
+    }
+    ReleaseSRWLockExclusive(&g_spatialLock);
+}
+
+/**
+ * Internal: Drop a destroyed window from the spatial index.
+ */
+static void SpatialRemove(HWND hwnd) {
+    AcquireSRWLockExclusive(&g_spatialLock);
+    WORD* link = &g_spatialHash[HashHwnd(hwnd, SPATIAL_HASH_SLOTS - 1)];
+    while (*link != 0 && g_spatial[*link - 1].hwnd != hwnd) {
+        link = &g_spatial[*link - 1].nextHash;
+    }
+    if (*link != 0) {
+        WORD id = (WORD)(*link - 1);
+        SpatialEntry* entry = &g_spatial[id];
+        *link = entry->nextHash;
+        SpatialUnlinkLocked(id);
+        if (entry->flags & SPATIAL_MOVE_PENDING) {
+            for (DWORD i = 0; i < g_movePendingCount; i++) {
+                if (g_movePending[i] == id) {
+                    g_movePending[i] = g_movePending[--g_movePendingCount];
+                    break;
+                }
+            }
+        }
+        entry->hwnd = NULL;
+        entry->nextHash = g_spatialFree;
+        g_spatialFree = (WORD)(id + 1);
+        g_stats.spatialWindows--;
+    }
+    ReleaseSRWLockExclusive(&g_spatialLock);
+}
+
+/**
+ * Internal: Link in the hash chain that holds or would hold a window's
+ * slot. Under g_tokenLock.
+ *
+ * @return Link to the window's slot, pointing at 0 if it has none
+ */
+static WORD* TokenLinkLocked(HWND hwnd) {
+    WORD* link = &g_tokenHash[HashHwnd(hwnd, TOKEN_HASH_SLOTS - 1)];
+    while (*link != 0 && g_tokens[*link - 1].hwnd != hwnd) {
+        link = &g_tokens[*link - 1].nextHash;
+    }
+    return link;
+}
+
+/**
+ * Internal: Retire a slot, unlink it from its chain and put it on the free
+ * list. Caller holds g_tokenLock exclusively.
+ *
+ * @param link Link to the slot, from TokenLinkLocked
+ */
+static void FreeTokenSlotLocked(WORD* link) {
+    DWORD index = *link - 1;
+    *link = g_tokens[index].nextHash;
+    g_tokens[index].hwnd = NULL;
+    g_tokens[index].generation++;
+    g_tokens[index].nextHash = g_tokenFree;
+    g_tokenFree = (WORD)(index + 1);
+    InterlockedDecrement((volatile LONG*)&g_stats.tokenCount);
+}
+
+/**
+ * Internal: Retire the token of a destroyed window. Most destroyed
+ * windows have none, so the chain is checked under the shared lock first.
+ */
+static void InvalidateWindowToken(HWND hwnd) {
+    AcquireSRWLockShared(&g_tokenLock);
+    BOOL registered = *TokenLinkLocked(hwnd) != 0;
+    ReleaseSRWLockShared(&g_tokenLock);
+    if (!registered) {
+        return;
+    }
+
+    AcquireSRWLockExclusive(&g_tokenLock);
+    WORD* link = TokenLinkLocked(hwnd);
+    if (*link != 0) {
+        FreeTokenSlotLocked(link);
+        StatsIncrement(&g_stats.tokensInvalidated);
+    }
+    ReleaseSRWLockExclusive(&g_tokenLock);
+}
+
+/**
+ * Internal: Resolve a token to its window. Without the event hook,
+ * destroyed windows are not retired, so fall back to IsWindow.
+ *
+ * @return The window, or NULL if the token is unknown or retired
+ */
+static HWND TokenWindow(DWORD token) {
+    DWORD index = (token & 0xFFFF) - 1;
+    if (index >= TOKEN_CAPACITY) {
+        return NULL;
+    }
+
+    AcquireSRWLockShared(&g_tokenLock);
+    HWND hwnd = g_tokens[index].generation == (WORD)(token >> 16) ? g_tokens[index].hwnd : NULL;
+    ReleaseSRWLockShared(&g_tokenLock);
+
+    if (hwnd != NULL && !EventsActive() && !IsWindow(hwnd)) {
+        return NULL;
+    }
+    return hwnd;
+}
+
+/**
+ * WinEvent hook for windows of this process. Runs in-context on the thread
+ * that raised the event, inside whatever the host was doing, so it takes
+ * no lock, allocates nothing and never waits: it drops child windows,
+ * moves the destroy stamp of a destroyed window so stale records stop
+ * matching at once, and pushes the event for DrainWindowEvents.
+ */
+static void CALLBACK WinEventCallback(HWINEVENTHOOK hook, DWORD event, HWND hwnd, LONG idObject,
+                                      LONG idChild, DWORD eventThread, DWORD eventTime) {
+    if (hwnd == NULL || idObject != OBJID_WINDOW || idChild != CHILDID_SELF || !EventsActive()) {
+        return;
+    }
+
+    // Only top-level windows are ever remembered
+    if (GetWindowLongPtr(hwnd, GWL_STYLE) & WS_CHILD) {
+        return;
+    }
+    if (event == EVENT_OBJECT_LOCATIONCHANGE && !SpatialKept()) {
+        return;
+    }
+
+    LONG stamp = 0;
+    if (event == EVENT_OBJECT_DESTROY) {
+        stamp = InterlockedIncrement(&g_destroyStamps[HashHwnd(hwnd, DESTROY_STAMP_BUCKETS - 1)]) - 1;
+    }
+
+    // Claim the cell at the tail, free when its sequence equals the position
+    LONG pos = g_eventTail;
+    for (;;) {
+        WindowEvent* cell = &g_events[(DWORD)pos & (EVENT_QUEUE_CAPACITY - 1)];
+        LONG diff = (LONG)((DWORD)cell->sequence - (DWORD)pos);
+        if (diff < 0) {
+            // Full: the next drain resynchronises instead
+            InterlockedExchange(&g_eventOverflow, 1);
+            break;
+        }
+        if (diff > 0) {
+            // Another producer took it
+            pos = g_eventTail;
+            continue;
+        }
+
+        LONG seen = InterlockedCompareExchange(&g_eventTail, pos + 1, pos);
+        if (seen == pos) {
+            cell->event = event;
+            cell->hwnd = hwnd;
+            cell->stamp = stamp;
+            cell->eventAt = QpcNow();
+            InterlockedExchange(&cell->sequence, pos + 1);
+            break;
+        }
+        pos = seen;
+    }
+
+    // No owner to wake in pumped mode
+    if (g_eventSignal != NULL && InterlockedExchange(&g_eventWake, 1) == 0) {
+        SetEvent(g_eventSignal);
+    }
+}
+
+typedef LONG (WINAPI* RtlGetVersionProc)(RTL_OSVERSIONINFOW* info);
+
+/**
+ * Internal: Windows build number from RtlGetVersion, which unlike
+ * GetVersionEx does not depend on the host's manifest.
+ *
+ * @return Build number, or 0 if unavailable
+ */
+static DWORD WindowsBuild() {
+    HMODULE ntdll = GetModuleHandleW(L"ntdll.dll");
+    RtlGetVersionProc rtlGetVersion = ntdll != NULL ? (RtlGetVersionProc)GetProcAddress(ntdll, "RtlGetVersion") : NULL;
+    if (rtlGetVersion == NULL) {
+        return 0;
+    }
+
+    RTL_OSVERSIONINFOW info;
+    memset(&info, 0, sizeof(info));
+    info.dwOSVersionInfoSize = sizeof(info);
+    return rtlGetVersion(&info) == 0 ? info.dwBuildNumber : 0;
+}
+
+/**
+ * Internal: Affinity to apply when hiding, picked on first use from the
+ * build number. Creates nothing, so it is safe from any thread. A build
+ * that turns out to reject WDA_EXCLUDEFROMCAPTURE is stepped down by
+ * StepDownAffinity when the first hide fails.
+ *
+ * @return WDA_EXCLUDEFROMCAPTURE, WDA_MONITOR, or WDA_NONE if windows cannot be hidden
+ */
+static DWORD HideAffinity() {
+    if (g_capabilityReady) {
+        return g_hideAffinity;
+    }
+
+    DWORD build = WindowsBuild();
+    AcquireSRWLockExclusive(&g_capabilityLock);
+    if (!g_capabilityReady) {
+        DWORD affinity = WDA_EXCLUDEFROMCAPTURE;
+        DWORD reason = CAPABILITY_SUPPORTED;
+        if (build != 0 && build < BUILD_WINDOWS_7) {
+            affinity = WDA_NONE;
+            reason = CAPABILITY_UNSUPPORTED;
+        } else if (build != 0 && build < BUILD_EXCLUDE_FROM_CAPTURE) {
+            affinity = WDA_MONITOR;
+            reason = CAPABILITY_OLD_BUILD;
+        }
+        g_capability.affinity = affinity;
+        g_capability.reason = reason;
+        g_capability.buildNumber = build;
+        g_capability.probeError = 0;
+        g_hideAffinity = affinity;
+        g_capabilityReady = TRUE;
+    }
+    ReleaseSRWLockExclusive(&g_capabilityLock);
+    return g_hideAffinity;
+}
+
+/**
+ * Internal: Switch every later hide to WDA_MONITOR, after a window
+ * rejected WDA_EXCLUDEFROMCAPTURE but accepted WDA_MONITOR.
+ *
+ * @param error GetLastError from the rejected hide
+ */
+static void StepDownAffinity(DWORD error) {
+    AcquireSRWLockExclusive(&g_capabilityLock);
+    if (g_hideAffinity == WDA_EXCLUDEFROMCAPTURE) {
+        g_capability.affinity = WDA_MONITOR;
+        g_capability.reason = CAPABILITY_PROBE_FAILED;
+        g_capability.probeError = error;
+        g_hideAffinity = WDA_MONITOR;
+    }
+    ReleaseSRWLockExclusive(&g_capabilityLock);
+}
+
+/**
+ * Record a hide request. Queued shows covered by the hide are dropped, and
+ * shows already being drained see the new sequence number and skip the window.
+ *
+ * @param hwnd Window being hidden, or NULL for all windows of the process
+ */
+static void BeginHide(HWND hwnd) {
+    AcquireSRWLockExclusive(&g_queueLock);
+
+    LONG seq = InterlockedIncrement(&g_hideSeq);
+    g_recentHides[(DWORD)seq % RECENT_HIDE_CAPACITY] = hwnd;
+
+    int kept = 0;
+    for (int i = 0; i < g_showCount; i++) {
+        if (hwnd == NULL || g_showQueue[i].hwnd == hwnd) {
+            StatsIncrement(&g_stats.showsCancelled);
+            continue;
+        }
+        g_showQueue[kept++] = g_showQueue[i];
+    }
+    g_showCount = kept;
+
+    ReleaseSRWLockExclusive(&g_queueLock);
+}
+
+/**
+ * Check whether a hide issued after the show was queued covers this window.
+ * When more hides arrived than the ring remembers, the show is treated as
+ * cancelled: staying hidden is always the safe outcome.
+ *
+ * Caller holds g_queueLock.
+ *
+ * @param op Show being applied
+ * @param hwnd Window the show is about to touch, or NULL to ask whether a
+ *        hide of all windows followed
+ * @return TRUE if the show must not touch the window
+ */
+static BOOL IsShowCancelledLocked(const ShowOp* op, HWND hwnd) {
+    LONG latest = g_hideSeq;
+    if (latest - op->hideSeq > RECENT_HIDE_CAPACITY) {
+        return TRUE;
+    }
+
+    for (LONG seq = op->hideSeq + 1; seq - latest <= 0; seq++) {
+        HWND hidden = g_recentHides[(DWORD)seq % RECENT_HIDE_CAPACITY];
+        if (hidden == NULL || hidden == hwnd) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+/**
+ * IsShowCancelledLocked for callers that do not hold g_queueLock.
+ */
+static BOOL IsShowCancelled(const ShowOp* op, HWND hwnd) {
+    AcquireSRWLockShared(&g_queueLock);
+    BOOL cancelled = IsShowCancelledLocked(op, hwnd);
+    ReleaseSRWLockShared(&g_queueLock);
+
+    return cancelled;
+}
+
+/**
+ * Record for a record id. Caller holds g_trackLock.
+ */
+static WindowRecord* RecordAt(DWORD id) {
+    return &g_slabs[id / SLAB_RECORDS][id % SLAB_RECORDS];
+}
+
+/**
+ * Find the index slot holding hwnd, or the empty slot where it would go.
+ * Caller holds g_trackLock.
+ */
+static DWORD TrackSlotFor(HWND hwnd) {
+    DWORD mask = g_trackIndexSize - 1;
+    DWORD slot = HashHwnd(hwnd, mask);
+    while (g_trackIndex[slot] != 0 && RecordAt(g_trackIndex[slot] - 1)->hwnd != hwnd) {
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+/**
+ * Double the HWND index and re-insert every live record.
+ * Caller holds g_trackLock exclusively.
+ *
+ * @return FALSE if memory could not be allocated
+ */
+static BOOL GrowTrackIndex() {
+    DWORD size = g_trackIndexSize ? g_trackIndexSize * 2 : 128;
+    DWORD* index = (DWORD*)AllocMemory(size * sizeof(DWORD), TRUE);
+    if (index == NULL) {
+        return FALSE;
+    }
+
+    FreeMemory(g_trackIndex);
+    g_trackIndex = index;
+    g_trackIndexSize = size;
+
+    for (DWORD id = 0; id < g_recordHighWater; id++) {
+        if (RecordAt(id)->hwnd != NULL) {
+            g_trackIndex[TrackSlotFor(RecordAt(id)->hwnd)] = id + 1;
+        }
+    }
+    return TRUE;
+}
+
+/**
+ * Take a record from the free list, or carve one from the current slab,
+ * adding a slab when it is full. Caller holds g_trackLock exclusively.
+ *
+ * @return Record id, or (DWORD)-1 if out of memory or records
+ */
+static DWORD AllocRecord() {
+    if (g_freeRecords != 0) {
+        DWORD id = g_freeRecords - 1;
+        g_freeRecords = RecordAt(id)->nextFree;
+        return id;
+    }
+
+    if (g_recordHighWater == g_slabCount * SLAB_RECORDS) {
+        if (g_slabCount == MAX_SLABS) {
+            return (DWORD)-1;
+        }
+        WindowRecord* slab = (WindowRecord*)AllocMemory(SLAB_RECORDS * sizeof(WindowRecord), TRUE);
+        if (slab == NULL) {
+            return (DWORD)-1;
+        }
+        g_slabs[g_slabCount++] = slab;
+    }
+    return g_recordHighWater++;
+}
+
+/**
+ * Refresh the memory footprint counters. Caller holds g_trackLock.
+ */
+static void UpdateRecordStats() {
+    DWORD bytes = g_slabCount * SLAB_RECORDS * (DWORD)sizeof(WindowRecord) + g_trackIndexSize * (DWORD)sizeof(DWORD);
+    g_stats.trackedWindows = g_trackedCount;
+    g_stats.bytesPerTrackedWindow = g_trackedCount ? bytes / g_trackedCount : 0;
+}
+
+/**
+ * Internal: Start the verifier timer, creating it on first use.
+ * Does nothing in pumped mode; the pump runs the verifier instead.
+ * Caller holds g_trackLock.
+ */
+static void ArmVerifier() {
+    if (!UseDllThreads()) {
+        return;
+    }
+
+    if (g_verifyTimer == NULL) {
+        InitializeThreadpoolEnvironment(&g_verifyEnviron);
+        SetThreadpoolCallbackLibrary(&g_verifyEnviron, g_module);
+        g_verifyTimer = CreateThreadpoolTimer(VerifierTimerCallback, NULL, &g_verifyEnviron);
+        if (g_verifyTimer == NULL) {
+            return;
+        }
+    }
+
+    // Negative due time is relative, in 100 ns units
+    ULARGE_INTEGER due;
+    due.QuadPart = (ULONGLONG)(-(LONGLONG)VERIFY_INTERVAL_MS * 10000);
+    FILETIME dueTime;
+    dueTime.dwLowDateTime = due.LowPart;
+    dueTime.dwHighDateTime = due.HighPart;
+    SetThreadpoolTimer(g_verifyTimer, &dueTime, VERIFY_INTERVAL_MS, VERIFY_INTERVAL_MS / 4);
+}
+
+/**
+ * Internal: Stop the verifier timer so an idle DLL causes no wakeups.
+ * Caller holds g_trackLock.
+ */
+static void DisarmVerifier() {
+    if (g_verifyTimer != NULL) {
+        SetThreadpoolTimer(g_verifyTimer, NULL, 0, 0);
+    }
+}
+
+/**
+ * Internal: Start watching a window the DLL just protected.
+ * Caller holds g_applyLock.
+ *
+ * @param hwnd Window that was protected
+ * @param affinity Affinity that was applied
+ */
+static void TrackWindow(HWND hwnd, DWORD affinity, DWORD signature) {
+    AcquireSRWLockExclusive(&g_trackLock);
+
+    // Keep the index at most half full
+    if ((g_trackedCount + 1) * 2 > g_trackIndexSize && !GrowTrackIndex()) {
+        ReleaseSRWLockExclusive(&g_trackLock);
+        return;
+    }
+
+    DWORD slot = TrackSlotFor(hwnd);
+    if (g_trackIndex[slot] != 0) {
+        // Re-stamp: the handle may now belong to a new window
+        WindowRecord* record = RecordAt(g_trackIndex[slot] - 1);
+        record->stamp = WindowStamp(hwnd);
+        record->affinity = affinity;
+        record->signature = signature;
+    } else {
+        DWORD id = AllocRecord();
+        if (id != (DWORD)-1) {
+            WindowRecord* record = RecordAt(id);
+            record->hwnd = hwnd;
+            record->stamp = WindowStamp(hwnd);
+            record->affinity = affinity;
+            record->nextFree = 0;
+            record->signature = signature;
+            g_trackIndex[slot] = id + 1;
+            g_trackedCount++;
+            UpdateRecordStats();
+
+            if (g_trackedCount == 1) {
+                ArmVerifier();
+            }
+        }
+    }
+
+    ReleaseSRWLockExclusive(&g_trackLock);
+}
+
+/**
+ * Internal: Remove a tracked window at a given index slot and put its
+ * record on the free list. Uses backward-shift deletion so probe chains
+ * stay intact. Caller holds g_trackLock exclusively.
+ */
+static void UntrackSlot(DWORD slot) {
+    DWORD mask = g_trackIndexSize - 1;
+    DWORD id = g_trackIndex[slot] - 1;
+
+    // Close the gap in the index
+    DWORD hole = slot;
+    for (DWORD next = (hole + 1) & mask; g_trackIndex[next] != 0; next = (next + 1) & mask) {
+        DWORD home = HashHwnd(RecordAt(g_trackIndex[next] - 1)->hwnd, mask);
+        if (((next - home) & mask) >= ((next - hole) & mask)) {
+            g_trackIndex[hole] = g_trackIndex[next];
+            hole = next;
+        }
+    }
+    g_trackIndex[hole] = 0;
+
+    WindowRecord* record = RecordAt(id);
+    record->hwnd = NULL;
+    record->nextFree = g_freeRecords;
+    g_freeRecords = id + 1;
+
+    g_trackedCount--;
+    UpdateRecordStats();
+
+    if (g_trackedCount == 0) {
+        DisarmVerifier();
+    }
+}
+
+/**
+ * Internal: Stop watching a window, e.g. after it was shown.
+ * Caller holds g_applyLock.
+ */
+static void UntrackWindow(HWND hwnd) {
+    AcquireSRWLockExclusive(&g_trackLock);
+    if (g_trackedCount > 0) {
+        DWORD slot = TrackSlotFor(hwnd);
+        if (g_trackIndex[slot] != 0) {
+            UntrackSlot(slot);
+        }
+    }
+    ReleaseSRWLockExclusive(&g_trackLock);
+}
+
+/**
+ * Internal: One verifier pass. Walks tracked windows round-robin, checks
+ * their affinity with GetWindowDisplayAffinity and re-applies it where
+ * something else reset it. Destroyed windows, including handles that were
+ * destroyed and reused, are dropped. Stops when the deadline passes, so a
+ * pass costs at most roughly one check over budget.
+ *
+ * @param deadline QPC timestamp to stop at
+ */
+static void VerifyTick(LONGLONG deadline) {
+    LONGLONG start = QpcNow();
+    DWORD visited = 0;
+
+    for (;;) {
+        AcquireSRWLockExclusive(&g_applyLock);
+        AcquireSRWLockExclusive(&g_trackLock);
+
+        // One lap over every record ever handed out, skipping free ones
+        BOOL done = g_trackedCount == 0 || visited >= g_recordHighWater;
+        while (!done) {
+            if (g_verifyCursor >= g_recordHighWater) {
+                g_verifyCursor = 0;
+            }
+            WindowRecord* record = RecordAt(g_verifyCursor++);
+            visited++;
+            if (record->hwnd != NULL) {
+                break;
+            }
+            done = visited >= g_recordHighWater;
+        }
+
+        if (!done) {
+            WindowRecord* record = RecordAt(g_verifyCursor - 1);
+            DWORD current = WDA_NONE;
+
+            if (!IsStampCurrent(record->hwnd, record->stamp) || !IsWindow(record->hwnd)) {
+                UntrackSlot(TrackSlotFor(record->hwnd));
+            } else if (GetWindowDisplayAffinity(record->hwnd, &current) && current != record->affinity) {
+                SetWindowDisplayAffinity(record->hwnd, record->affinity);
+                StatsIncrement(&g_stats.driftEvents);
+            }
+        }
+
+        ReleaseSRWLockExclusive(&g_trackLock);
+        ReleaseSRWLockExclusive(&g_applyLock);
+
+        if (done || QpcNow() >= deadline) {
+            break;
+        }
+    }
+
+    DWORD elapsed = QpcToMicros(QpcNow() - start);
+    g_lastVerify = QpcNow();
+    StatsIncrement(&g_stats.verifierTicks);
+    StatsMax(&g_stats.maxVerifierTickMicros, elapsed);
+}
+
+/**
+ * Thread pool timer callback for the verifier.
+ */
+static VOID CALLBACK VerifierTimerCallback(PTP_CALLBACK_INSTANCE instance, PVOID context, PTP_TIMER timer) {
+    VerifyTick(QpcNow() + MicrosToQpc(VERIFY_TICK_BUDGET_MICROS));
+}
+
+/**
+ * Find a signature in the profile.
+ *
+ * @param signature ProfileSignature value
+ * @return Slot index, or (DWORD)-1 if absent
+ */
+static DWORD ProfileFind(DWORD signature) {
+    DWORD mask = PROFILE_SLOTS - 1;
+    DWORD slot = (signature * 2654435761u) & mask;
+    for (int probe = 0; probe < PROFILE_MAX_PROBES; probe++) {
+        LONG value = g_profile->slots[slot];
+        if ((DWORD)value == signature) {
+            return slot;
+        }
+        if (value == 0) {
+            break;
+        }
+        slot = (slot + 1) & mask;
+    }
+    return (DWORD)-1;
+}
+
+/**
+ * Internal: Remember a protected window in the profile. When its probe
+ * window is full the window is simply not remembered.
+ */
+static void ProfileAdd(HWND hwnd) {
+    if (!g_profileEnabled) {
+        return;
+    }
+
+    DWORD signature = ProfileSignature(hwnd);
+    if (ProfileFind(signature) != (DWORD)-1) {
+        return;
+    }
+
+    DWORD mask = PROFILE_SLOTS - 1;
+    DWORD slot = (signature * 2654435761u) & mask;
+    for (int probe = 0; probe < PROFILE_MAX_PROBES; probe++) {
+        LONG value = g_profile->slots[slot];
+        if ((value == 0 || value == PROFILE_REMOVED) &&
+            InterlockedCompareExchange(&g_profile->slots[slot], (LONG)signature, value) == value) {
+            InterlockedIncrement(&g_profile->used);
+            return;
+        }
+        slot = (slot + 1) & mask;
+    }
+}
+
+/**
+ * Internal: Forget a window that was shown again.
+ */
+static void ProfileRemove(HWND hwnd) {
+    if (!g_profileEnabled || g_profile->used == 0) {
+        return;
+    }
+
+    DWORD signature = ProfileSignature(hwnd);
+    DWORD slot = ProfileFind(signature);
+    if (slot != (DWORD)-1 &&
+        InterlockedCompareExchange(&g_profile->slots[slot], PROFILE_REMOVED, (LONG)signature) == (LONG)signature) {
+        InterlockedDecrement(&g_profile->used);
+    }
+}
+
+/**
+ * Internal: Set startupToProtectedMicros on the first protected window.
+ */
+static void RecordStartupLatency() {
+    if (g_processStart == 0) {
+        return;
+    }
+
+    FILETIME now;
+    GetSystemTimeAsFileTime(&now);
+    ULONGLONG ticks = ((ULONGLONG)now.dwHighDateTime << 32 | now.dwLowDateTime) - g_processStart;
+
+    // FILETIME ticks are 100 ns
+    ULONGLONG micros = ticks / 10;
+    DWORD value = micros == 0 ? 1 : micros > 0xFFFFFFFF ? 0xFFFFFFFF : (DWORD)micros;
+    InterlockedCompareExchange((volatile LONG*)&g_stats.startupToProtectedMicros, (LONG)value, 0);
+}
+
+/**
+ * Internal: Read the process creation time for startupToProtectedMicros.
+ * A single kernel32 call, made at DLL_PROCESS_ATTACH.
+ */
+static void ReadProcessStart() {
+    FILETIME created, exited, kernel, user;
+    if (GetProcessTimes(GetCurrentProcess(), &created, &exited, &kernel, &user)) {
+        g_processStart = (ULONGLONG)created.dwHighDateTime << 32 | created.dwLowDateTime;
+    }
+}
+
+/**
+ * Internal: Map the profile for this executable, creating it if needed.
+ * Creates a directory and a file, so it never runs from DllMain. The file
+ * is %LOCALAPPDATA%\WindowHider\<exe name>-<path hash>.profile; the only
+ * parsing is a header check, and a file with a bad header is reset.
+ * Caller holds g_profileLock exclusively.
+ */
+static void OpenProfile() {
+    WCHAR exe[MAX_PATH];
+    DWORD exeLen = GetModuleFileNameW(NULL, exe, MAX_PATH);
+    if (exeLen == 0 || exeLen >= MAX_PATH) {
+        return;
+    }
+
+    WCHAR path[MAX_PATH];
+    DWORD len = GetEnvironmentVariableW(L"LOCALAPPDATA", path, MAX_PATH);
+    const WCHAR* name = exe;
+    for (DWORD i = 0; i < exeLen; i++) {
+        if (exe[i] == L'\\' || exe[i] == L'/') {
+            name = exe + i + 1;
+        }
+    }
+    if (len == 0 || len + lstrlenW(name) + 32 >= MAX_PATH) {
+        return;
+    }
+
+    lstrcatW(path, L"\\WindowHider");
+    CreateDirectoryW(path, NULL);
+
+    // Same exe name in different folders gets different profiles
+    WCHAR suffix[16];
+    DWORD pathHash = HashText(2166136261u, exe, (int)exeLen);
+    suffix[0] = L'-';
+    for (int i = 0; i < 8; i++) {
+        suffix[1 + i] = L"0123456789abcdef"[(pathHash >> (28 - i * 4)) & 0xF];
+    }
+    suffix[9] = 0;
+    lstrcatW(path, L"\\");
+    lstrcatW(path, name);
+    lstrcatW(path, suffix);
+    lstrcatW(path, L".profile");
+
+    HANDLE file = CreateFileW(path, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+                              OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        return;
+    }
+
+    // The mapping grows a new file to full size, zero-filled
+    HANDLE mapping = CreateFileMappingW(file, NULL, PAGE_READWRITE, 0, sizeof(HideProfile), NULL);
+    CloseHandle(file);
+    if (mapping == NULL) {
+        return;
+    }
+
+    // The view keeps the section and the file open
+    HideProfile* profile = (HideProfile*)MapViewOfFile(mapping, FILE_MAP_WRITE, 0, 0, sizeof(HideProfile));
+    CloseHandle(mapping);
+    if (profile == NULL) {
+        return;
+    }
+
+    if (profile->magic != PROFILE_MAGIC || profile->version != PROFILE_VERSION ||
+        profile->slotCount != PROFILE_SLOTS) {
+        memset((void*)profile, 0, sizeof(HideProfile));
+        profile->version = PROFILE_VERSION;
+        profile->slotCount = PROFILE_SLOTS;
+        InterlockedExchange((volatile LONG*)&profile->magic, PROFILE_MAGIC);
+    }
+    g_profile = profile;
+}
+
+/**
+ * Internal: Start recording hides in the profile and applying it, opening
+ * the profile on first use.
+ *
+ * @return TRUE if the profile is mapped and in use
+ */
+static BOOL EnableProfile() {
+    AcquireSRWLockExclusive(&g_profileLock);
+    if (g_profile == NULL) {
+        OpenProfile();
+    }
+    g_profileEnabled = g_profile != NULL;
+    ReleaseSRWLockExclusive(&g_profileLock);
+    return g_profileEnabled;
+}
+
+/**
+ * Protect a window from capture and record how long the request waited.
+ *
+ * @param hwnd Window to protect
+ * @param requestedAt QPC timestamp of the hide request
+ * @return Result of SetWindowDisplayAffinity, FALSE if this system cannot hide windows
+ */
+static BOOL ApplyHide(HWND hwnd, LONGLONG requestedAt) {
+    DWORD affinity = HideAffinity();
+    if (affinity == WDA_NONE) {
+        // Known to fail; GetWindowHiderCapability reports why
+        StatsIncrement(&g_stats.hidesUnsupported);
+        SetLastError(ERROR_NOT_SUPPORTED);
+        return FALSE;
+    }
+
+    // Read now: by the time the destroy event is drained the window is gone
+    DWORD signature = WindowSignature(hwnd);
+
+    AcquireSRWLockExclusive(&g_applyLock);
+    BOOL result = SetWindowDisplayAffinity(hwnd, affinity);
+    if (!result && affinity == WDA_EXCLUDEFROMCAPTURE) {
+        // If the same window takes WDA_MONITOR, this build rejects
+        // WDA_EXCLUDEFROMCAPTURE whatever its number says
+        DWORD error = GetLastError();
+        result = SetWindowDisplayAffinity(hwnd, WDA_MONITOR);
+        if (result) {
+            affinity = WDA_MONITOR;
+            StepDownAffinity(error);
+        } else {
+            SetLastError(error);
+        }
+    }
+    if (result) {
+        TrackWindow(hwnd, affinity, signature);
+    }
+    ReleaseSRWLockExclusive(&g_applyLock);
+
+    StatsIncrement(&g_stats.hidesApplied);
+    StatsMax(&g_stats.maxHideLatencyMicros, QpcToMicros(QpcNow() - requestedAt));
+
+    if (result) {
+        ProfileAdd(hwnd);
+        if (g_stats.startupToProtectedMicros == 0) {
+            RecordStartupLatency();
+        }
+    }
+    return result;
+}
+
+/**
+ * Affinity the DLL applied to a window and is keeping, from its record.
+ *
+ * @return The tracked affinity, or WDA_NONE if the window is not tracked
+ */
+static DWORD TrackedAffinity(HWND hwnd) {
+    DWORD affinity = WDA_NONE;
+
+    AcquireSRWLockShared(&g_trackLock);
+    if (g_trackedCount > 0) {
+        DWORD slot = TrackSlotFor(hwnd);
+        if (g_trackIndex[slot] != 0) {
+            WindowRecord* record = RecordAt(g_trackIndex[slot] - 1);
+            if (record->stamp == WindowStamp(hwnd)) {
+                affinity = record->affinity;
+            }
+        }
+    }
+    ReleaseSRWLockShared(&g_trackLock);
+
+    return affinity;
+}
+
+/**
+ * Internal: Refresh the signature a tracked window will be remembered by,
+ * after its title changed.
+ */
+static void RefreshTrackedSignature(HWND hwnd) {
+    if (TrackedAffinity(hwnd) == WDA_NONE) {
+        return;
+    }
+
+    DWORD signature = WindowSignature(hwnd);
+    AcquireSRWLockExclusive(&g_trackLock);
+    if (g_trackedCount > 0) {
+        DWORD slot = TrackSlotFor(hwnd);
+        if (g_trackIndex[slot] != 0) {
+            RecordAt(g_trackIndex[slot] - 1)->signature = signature;
+        }
+    }
+    ReleaseSRWLockExclusive(&g_trackLock);
+}
+
+/**
+ * Internal: Drain a destroy event. If the DLL was keeping the window
+ * hidden, remember the signature its record holds so a recreated window
+ * can be hidden again. The window is gone by now; its record still
+ * carries the destroy stamp it had before the event moved it.
+ *
+ * @param hwnd Destroyed window
+ * @param stamp Destroy stamp before the event
+ */
+static void RememberDestroyedWindow(HWND hwnd, LONG stamp) {
+    DWORD signature = 0;
+    AcquireSRWLockShared(&g_trackLock);
+    if (g_trackedCount > 0) {
+        DWORD slot = TrackSlotFor(hwnd);
+        if (g_trackIndex[slot] != 0) {
+            WindowRecord* record = RecordAt(g_trackIndex[slot] - 1);
+            if (record->stamp == stamp) {
+                signature = record->signature;
+            }
+        }
+    }
+    ReleaseSRWLockShared(&g_trackLock);
+    if (signature == 0) {
+        return;
+    }
+
+    DWORD now = GetTickCount();
+    InterlockedExchange64(&g_recreateSlots[signature & (RECREATE_SLOTS - 1)],
+                          ((LONGLONG)signature << 32) | now);
+    InterlockedExchange(&g_lastHiddenDestroy, (LONG)now);
+}
+
+/**
+ * Internal: Called while draining a create or show event of a top-level
+ * window. One slot lookup; on a match within RECREATE_WINDOW_MS
+ * the slot is consumed and the window hidden, so one destroyed window
+ * re-hides at most one successor.
+ */
+static BOOL RehideRecreatedWindow(HWND hwnd) {
+    DWORD now = GetTickCount();
+    if (now - (DWORD)g_lastHiddenDestroy >= RECREATE_WINDOW_MS) {
+        return FALSE;
+    }
+
+    DWORD signature = WindowSignature(hwnd);
+    volatile LONGLONG* slot = &g_recreateSlots[signature & (RECREATE_SLOTS - 1)];
+    LONGLONG entry = InterlockedCompareExchange64(slot, 0, 0);  // Atomic read on x86 too
+    if ((DWORD)((ULONGLONG)entry >> 32) != signature || now - (DWORD)entry >= RECREATE_WINDOW_MS) {
+        return FALSE;
+    }
+
+    if (InterlockedCompareExchange64(slot, 0, entry) != entry) {
+        return FALSE;
+    }
+
+    LONGLONG requestedAt = QpcNow();
+    BeginHide(hwnd);
+    if (ApplyHide(hwnd, requestedAt)) {
+        StatsIncrement(&g_stats.recreatedHides);
+    }
+    return TRUE;
+}
+
+/**
+ * Internal: Called while draining a create or show event of a top-level
+ * window, and for existing windows once the profile is enabled.
+ * Hides the window if its signature is in the saved profile.
+ *
+ * @return TRUE if the window is protected
+ */
+static BOOL ProtectProfiledWindow(HWND hwnd) {
+    if (!g_profileEnabled || g_profile->used == 0) {
+        return FALSE;
+    }
+
+    // Already protected, e.g. matched on create and now being shown
+    DWORD current = WDA_NONE;
+    if (GetWindowDisplayAffinity(hwnd, &current) && current != WDA_NONE && current == HideAffinity()) {
+        return TRUE;
+    }
+
+    if (ProfileFind(ProfileSignature(hwnd)) == (DWORD)-1) {
+        return FALSE;
+    }
+
+    LONGLONG requestedAt = QpcNow();
+    BeginHide(hwnd);
+    if (ApplyHide(hwnd, requestedAt)) {
+        StatsIncrement(&g_stats.profileHides);
+    }
+    return TRUE;
+}
+
+/**
+ * Internal: Parse WINDOWHIDER_AUTOPROTECT. Runs on the startup thread, never
+ * under the loader lock. Accepted values: "titled" (the HideAllWindows
+ * filter), "all", "class:<window class>", and "0"/"off". Any other value,
+ * or one too long to read, leaves auto-protect off and sets
+ * CONFIG_ERROR_AUTOPROTECT in the stats, as a rule file that fails to load
+ * sets CONFIG_ERROR_RULES.
+ */
+static void LoadAutoProtectConfig() {
+    WCHAR value[300];
+
+    // Optional rules for the auto-protect filter
+    DWORD pathLen = GetEnvironmentVariableW(L"WINDOWHIDER_RULES", value, MAX_PATH);
+    if (pathLen >= MAX_PATH || (pathLen != 0 && !ReplaceRules(value))) {
+        g_stats.configErrors |= CONFIG_ERROR_RULES;
+    }
+
+    DWORD len = GetEnvironmentVariableW(L"WINDOWHIDER_AUTOPROTECT", value, 300);
+    if (len == 0 || (len < 300 && (lstrcmpiW(value, L"0") == 0 || lstrcmpiW(value, L"off") == 0))) {
+        return;
+    }
+
+    // A value longer than the buffer is not one of the accepted values
+    LONG mode = AUTO_PROTECT_OFF;
+    if (len < 300) {
+        if (lstrcmpiW(value, L"titled") == 0) {
+            mode = AUTO_PROTECT_TITLED;
+        } else if (lstrcmpiW(value, L"all") == 0) {
+            mode = AUTO_PROTECT_ALL;
+        } else if (len > 6 && CompareStringOrdinal(value, 6, L"class:", 6, TRUE) == CSTR_EQUAL) {
+            mode = AUTO_PROTECT_CLASS;
+        }
+    }
+
+    if (mode == AUTO_PROTECT_OFF) {
+        g_stats.configErrors |= CONFIG_ERROR_AUTOPROTECT;
+        return;
+    }
+
+    HidePolicy* policy = CopyPolicy();
+    if (policy != NULL) {
+        policy->autoProtect = mode;
+        if (mode == AUTO_PROTECT_CLASS) {
+            lstrcpynW(policy->autoProtectClass, value + 6, 256);
+        }
+        PublishPolicy(policy);
+    }
+}
+
+/**
+ * Internal: Filter flags the reconciler applies. Windows it took off the
+ * taskbar are tool windows by construction, so while the taskbar state is
+ * managed the reconciler does not skip tool windows. Only the reconciler
+ * widens the filter; HideAllWindows and auto-protect keep the policy's.
+ *
+ * @param policy Snapshot held by the caller
+ */
+static DWORD ReconcileFilterFlags(const HidePolicy* policy) {
+    if (policy->desiredTaskbar != DESIRED_UNCHANGED) {
+        return policy->filterFlags & ~FILTER_SKIP_TOOL_WINDOWS;
+    }
+    return policy->filterFlags;
+}
+
+/**
+ * The HideAllWindows filter for a window known to be a shown top-level
+ * window of this process. Unlike IsValidAppWindow it sends no message, so
+ * it is safe while draining hook events, whichever thread drains them.
+ *
+ * @param policy Snapshot held by the caller
+ * @param filterFlags FILTER_* flags to apply
+ */
+static BOOL PassesFilterInHook(const HidePolicy* policy, HWND hwnd, DWORD filterFlags) {
+    switch (PolicyRuleAction(policy, hwnd)) {
+    case RULE_HIDE:
+        return TRUE;
+    case RULE_SKIP:
+        return FALSE;
+    }
+
+    if ((filterFlags & FILTER_SKIP_TOOL_WINDOWS) && (GetWindowLongPtr(hwnd, GWL_EXSTYLE) & WS_EX_TOOLWINDOW)) {
+        return FALSE;
+    }
+
+    WCHAR title[256];
+    return !(filterFlags & FILTER_REQUIRE_TITLE) || InternalGetWindowText(hwnd, title, 256) > 0;
+}
+
+/**
+ * Check a shown top-level window against the auto-protect filter.
+ * Sends no message, as it runs while draining hook events.
+ *
+ * @param policy Snapshot held by the caller
+ */
+static BOOL MatchesAutoProtect(const HidePolicy* policy, HWND hwnd) {
+    WCHAR text[256];
+
+    switch (policy->autoProtect) {
+    case AUTO_PROTECT_ALL:
+        return TRUE;
+    case AUTO_PROTECT_CLASS:
+        return GetClassNameW(hwnd, text, 256) > 0 && lstrcmpiW(text, policy->autoProtectClass) == 0;
+    case AUTO_PROTECT_TITLED:
+        return PassesFilterInHook(policy, hwnd, policy->filterFlags);
+    default:
+        return FALSE;
+    }
+}
+
+/**
+ * Internal: Called while draining a show event of a top-level window, and
+ * for visible windows once the startup thread starts. Hides the
+ * window if the auto-protect policy selects it.
+ */
+static void AutoProtectWindow(HWND hwnd) {
+    DWORD slot;
+    const HidePolicy* policy = AcquirePolicy(&slot);
+    BOOL matches = policy->autoProtect != AUTO_PROTECT_OFF && MatchesAutoProtect(policy, hwnd);
+    ReleasePolicy(slot);
+    if (!matches) {
+        return;
+    }
+
+    DWORD current = WDA_NONE;
+    if (GetWindowDisplayAffinity(hwnd, &current) && current != WDA_NONE && current == HideAffinity()) {
+        return;
+    }
+
+    LONGLONG requestedAt = QpcNow();
+    BeginHide(hwnd);
+    if (ApplyHide(hwnd, requestedAt)) {
+        StatsIncrement(&g_stats.autoProtectHides);
+    }
+}
+
+/**
+ * EnumWindows callback for the startup thread: protect windows of this
+ * process that already existed when the hook went in.
+ */
+static BOOL CALLBACK StartupEnumCallback(HWND hwnd, LPARAM lParam) {
+    DWORD pid = 0;
+    GetWindowThreadProcessId(hwnd, &pid);
+    if (pid == (DWORD)lParam && (GetWindowLongPtr(hwnd, GWL_STYLE) & WS_CHILD) == 0 &&
+        !ProtectProfiledWindow(hwnd) && IsWindowVisible(hwnd)) {
+        AutoProtectWindow(hwnd);
+    }
+    return TRUE;
+}
+
+/**
+ * EnumWindows callback for SetWindowHiderProfile: protect windows of this
+ * process that match the profile and already exist.
+ */
+static BOOL CALLBACK ProfileEnumCallback(HWND hwnd, LPARAM lParam) {
+    DWORD pid = 0;
+    GetWindowThreadProcessId(hwnd, &pid);
+    if (pid == (DWORD)lParam && (GetWindowLongPtr(hwnd, GWL_STYLE) & WS_CHILD) == 0) {
+        ProtectProfiledWindow(hwnd);
+    }
+    return TRUE;
+}
+
+/**
+ * Internal: Parse WINDOWHIDER_PROFILE on the startup thread and opt in to
+ * the startup profile unless it is "0" or "off".
+ */
+static void LoadProfileConfig() {
+    WCHAR value[8];
+    DWORD len = GetEnvironmentVariableW(L"WINDOWHIDER_PROFILE", value, 8);
+    if (len == 0 || (len < 8 && (lstrcmpiW(value, L"0") == 0 || lstrcmpiW(value, L"off") == 0))) {
+        return;
+    }
+    EnableProfile();
+}
+
+/**
+ * Internal: Thread started at attach when WINDOWHIDER_PROFILE or
+ * WINDOWHIDER_AUTOPROTECT is set; setting either opts in to hook events.
+ * It reads both settings, opens the profile and turns events on, none of
+ * which belongs under the loader lock, and catches windows created in the
+ * meantime. The hooks belong to the hook owner, so this thread exits when
+ * done, dropping the reference on the DLL it was started with.
+ */
+static DWORD WINAPI StartupThread(LPVOID param) {
+    LoadAutoProtectConfig();
+    EnableWindowEvents();
+    LoadProfileConfig();
+
+    EnumWindows(StartupEnumCallback, (LPARAM)GetCurrentProcessId());
+    FreeLibraryAndExitThread(g_module, 0);
+    return 0;
+}
+
+/**
+ * Internal: At DLL_PROCESS_ATTACH, start the startup thread if
+ * WINDOWHIDER_PROFILE or WINDOWHIDER_AUTOPROTECT is set; only the
+ * variables' presence is checked here. Either one therefore settles on
+ * threaded mode. The thread holds a reference on the DLL until it exits,
+ * so an early FreeLibrary cannot unload its code.
+ */
+static void StartStartupProtection() {
+    if ((GetEnvironmentVariableW(L"WINDOWHIDER_PROFILE", NULL, 0) == 0 &&
+         GetEnvironmentVariableW(L"WINDOWHIDER_AUTOPROTECT", NULL, 0) == 0) || !UseDllThreads()) {
+        return;
+    }
+
+    HMODULE self = NULL;
+    if (!GetModuleHandleExW(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS, (LPCWSTR)&StartupThread, &self)) {
+        return;
+    }
+
+    // Starts running once the loader lock is released. If it cannot be
+    // created the reference is kept: FreeLibrary does not belong in DllMain.
+    HANDLE thread = CreateThread(NULL, 0, StartupThread, NULL, 0, NULL);
+    if (thread != NULL) {
+        CloseHandle(thread);
+    }
+}
+
+/**
+ * Restore a window for a queued show, unless a later hide cancelled it.
+ * The cancellation check and the affinity change happen under g_applyLock,
+ * so a concurrent hide can delay a show but never be overwritten by one.
+ *
+ * @param op Show being applied
+ * @param hwnd Window to restore
+ * @return TRUE if the window was restored
+ */
+static BOOL ApplyShow(const ShowOp* op, HWND hwnd) {
+    BOOL result = FALSE;
+    BOOL supported = HideAffinity() != WDA_NONE;
+
+    AcquireSRWLockExclusive(&g_applyLock);
+    if (!IsShowCancelled(op, hwnd)) {
+        // Nothing was hidden where hiding is disabled, and the call would fail
+        result = supported && SetWindowDisplayAffinity(hwnd, WDA_NONE);
+        UntrackWindow(hwnd);
+        StatsIncrement(&g_stats.showsApplied);
+    } else {
+        StatsIncrement(&g_stats.showsCancelled);
+    }
+    ReleaseSRWLockExclusive(&g_applyLock);
+
+    // A window the user chose to show should not be hidden on next launch
+    if (result) {
+        ProfileRemove(hwnd);
+    }
+    return result;
+}
+
+/**
+ * Score how exposed a window is if it stays capturable.
+ * The foreground window always goes first; otherwise visible area counts,
+ * weighted down with z-order depth (half weight 16 windows down) and
+ * boosted on the shared monitor.
+ *
+ * @param hwnd Window to score
+ * @param ctx Sweep context (z-order position and foreground window)
+ * @param area Receives the visible area in pixels
+ * @return Exposure score, higher is more exposed
+ */
+static ULONGLONG ExposureScore(HWND hwnd, const EnumWindowsContext* ctx, DWORD* area) {
+    *area = 0;
+    if (IsIconic(hwnd)) {
+        return 0;
+    }
+
+    RECT window;
+    HMONITOR monitor = MonitorFromWindow(hwnd, MONITOR_DEFAULTTONULL);
+    if (monitor == NULL || !GetWindowRect(hwnd, &window)) {
+        return 0;
+    }
+
+    MONITORINFO info;
+    info.cbSize = sizeof(info);
+    RECT visible;
+    if (GetMonitorInfoW(monitor, &info) && IntersectRect(&visible, &window, &info.rcMonitor)) {
+        *area = (DWORD)(visible.right - visible.left) * (DWORD)(visible.bottom - visible.top);
+    }
+
+    if (hwnd == ctx->foreground) {
+        return ~0ULL;
+    }
+
+    ULONGLONG score = (ULONGLONG)*area * 16 / (16 + ctx->zOrder);
+    if (monitor == g_sharedMonitor) {
+        score *= 4;
+    }
+    return score;
+}
+
+/**
+ * Append a window to the sweep candidates, growing the buffer if needed.
+ *
+ * @param list Candidate buffer
+ * @param hwnd Window to add
+ * @param ctx Sweep context used for scoring
+ * @return FALSE if the buffer could not grow
+ */
+static BOOL AddCandidate(CandidateList* list, HWND hwnd, const EnumWindowsContext* ctx) {
+    if (list->count == list->capacity) {
+        DWORD capacity = list->capacity ? list->capacity * 2 : 64;
+        void* items = ReallocMemory(list->items, capacity * sizeof(SweepCandidate));
+        if (items == NULL) {
+            return FALSE;
+        }
+        list->items = (SweepCandidate*)items;
+        list->capacity = capacity;
+    }
+
+    SweepCandidate* candidate = &list->items[list->count++];
+    candidate->hwnd = hwnd;
+    candidate->stamp = WindowStamp(hwnd);
+    candidate->zOrder = ctx->zOrder;
+    candidate->score = ExposureScore(hwnd, ctx, &candidate->area);
+    candidate->protectedAt = 0;
+    return TRUE;
+}
+
+/**
+ * qsort comparator: most exposed first.
+ */
+static int __cdecl CompareByExposure(const void* a, const void* b) {
+    const SweepCandidate* left = (const SweepCandidate*)a;
+    const SweepCandidate* right = (const SweepCandidate*)b;
+    if (left->score != right->score) {
+        return left->score > right->score ? -1 : 1;
+    }
+    return left->zOrder < right->zOrder ? -1 : (left->zOrder > right->zOrder ? 1 : 0);
+}
+
+/**
+ * Internal: Prepare an empty HwndList.
+ */
+static void InitHwndList(HwndList* list) {
+    list->items = list->inlineItems;
+    list->count = 0;
+    list->capacity = HWND_LIST_INLINE;
+    list->failed = FALSE;
+}
+
+/**
+ * Internal: Release an HwndList's heap buffer, if it grew one.
+ */
+static void FreeHwndList(HwndList* list) {
+    if (list->items != list->inlineItems) {
+        FreeMemory(list->items);
+    }
+}
+
+/**
+ * Internal: Append a window handle, moving the list to the heap when the
+ * inline buffer is full.
+ *
+ * @return FALSE if the list could not grow
+ */
+static BOOL AppendHwnd(HwndList* list, HWND hwnd) {
+    if (list->count == list->capacity) {
+        DWORD capacity = list->capacity * 2;
+        HWND* items;
+        if (list->items == list->inlineItems) {
+            items = (HWND*)AllocMemory(capacity * sizeof(HWND), FALSE);
+            if (items != NULL) {
+                memcpy(items, list->inlineItems, list->count * sizeof(HWND));
+            }
+        } else {
+            items = (HWND*)ReallocMemory(list->items, capacity * sizeof(HWND));
+        }
+        if (items == NULL) {
+            list->failed = TRUE;
+            return FALSE;
+        }
+        list->items = items;
+        list->capacity = capacity;
+    }
+    list->items[list->count++] = hwnd;
+    return TRUE;
+}
+
+/**
+ * EnumWindows/EnumThreadWindows callback collecting into an HwndList.
+ */
+static BOOL CALLBACK AppendHwndCallback(HWND hwnd, LPARAM lParam) {
+    return AppendHwnd((HwndList*)lParam, hwnd);
+}
+
+/**
+ * Strategy: EnumWindows. Takes its own snapshot of the z-order.
+ */
+static BOOL EnumByEnumWindows(HwndList* list) {
+    EnumWindows(AppendHwndCallback, (LPARAM)list);
+    return !list->failed;
+}
+
+/**
+ * Strategy: EnumThreadWindows for each thread of this process, found with
+ * a Toolhelp snapshot. Visits only this process's windows, thread by
+ * thread rather than in z-order.
+ */
+static BOOL EnumByThreads(HwndList* list) {
+    HANDLE snapshot = CreateToolhelp32Snapshot(TH32CS_SNAPTHREAD, 0);
+    if (snapshot == INVALID_HANDLE_VALUE) {
+        return FALSE;
+    }
+
+    DWORD pid = GetCurrentProcessId();
+    THREADENTRY32 entry;
+    entry.dwSize = sizeof(entry);
+    for (BOOL more = Thread32First(snapshot, &entry); more && !list->failed; more = Thread32Next(snapshot, &entry)) {
+        if (entry.th32OwnerProcessID == pid) {
+            EnumThreadWindows(entry.th32ThreadID, AppendHwndCallback, (LPARAM)list);
+        }
+    }
+    CloseHandle(snapshot);
+    return !list->failed;
+}
+
+/**
+ * Strategy: walk the z-order live with GetWindow(GW_HWNDNEXT). A walk cut
+ * short by the destruction of the window it stood on is incomplete.
+ */
+static BOOL EnumByZOrder(HwndList* list) {
+    HWND last = NULL;
+    for (HWND hwnd = GetTopWindow(NULL); hwnd != NULL; hwnd = GetWindow(hwnd, GW_HWNDNEXT)) {
+        if (list->count >= ENUM_WALK_LIMIT || !AppendHwnd(list, hwnd)) {
+            return FALSE;
+        }
+        last = hwnd;
+    }
+    return last == NULL || IsWindow(last);
+}
+
+/**
+ * Strategy: FindWindowExW over the desktop's children, each call resuming
+ * after the previous window. Incomplete under the same condition as the
+ * z-order walk.
+ */
+static BOOL EnumByFindWindow(HwndList* list) {
+    HWND last = NULL;
+    for (HWND hwnd = FindWindowExW(NULL, NULL, NULL, NULL); hwnd != NULL; hwnd = FindWindowExW(NULL, hwnd, NULL, NULL)) {
+        if (list->count >= ENUM_WALK_LIMIT || !AppendHwnd(list, hwnd)) {
+            return FALSE;
+        }
+        last = hwnd;
+    }
+    return last == NULL || IsWindow(last);
+}
+
+/**
+ * Strategy: copy the registry. Needs no system enumeration at all, but is
+ * only available once seeded, while it has not overflowed, and while the
+ * hooks keep it.
+ */
+static BOOL EnumByRegistry(HwndList* list) {
+    if (!g_registryActive || g_registryOverflow || !EventsActive()) {
+        return FALSE;
+    }
+
+    AcquireSRWLockShared(&g_registryLock);
+    for (DWORD i = 0; i < g_registryCount && AppendHwnd(list, g_registry[i]); i++) {
+    }
+    ReleaseSRWLockShared(&g_registryLock);
+    return !list->failed && !g_registryOverflow;
+}
+
+// Indexed by ENUM_STRATEGY_* ids
+static const EnumStrategy g_enumStrategies[ENUM_STRATEGY_COUNT] = {
+    EnumByEnumWindows, EnumByThreads, EnumByZOrder, EnumByFindWindow, EnumByRegistry,
+};
+
+/**
+ * EnumWindows callback seeding the registry with this process's
+ * top-level windows.
+ */
+static BOOL CALLBACK SeedRegistryCallback(HWND hwnd, LPARAM lParam) {
+    DWORD pid = 0;
+    GetWindowThreadProcessId(hwnd, &pid);
+    if (pid == (DWORD)lParam) {
+        RegisterWindow(hwnd);
+    }
+    return TRUE;
+}
+
+/**
+ * Internal: Start keeping the registry. Needs hook events; they are
+ * already on, so windows created during the seeding pass are not lost;
+ * RegisterWindow drops the duplicates.
+ *
+ * @return TRUE if the registry is being kept
+ */
+static BOOL ActivateRegistry() {
+    if (!EventsActive()) {
+        return FALSE;
+    }
+    if (InterlockedCompareExchange(&g_registryActive, 1, 0) == 0) {
+        EnumWindows(SeedRegistryCallback, (LPARAM)GetCurrentProcessId());
+    }
+    return TRUE;
+}
+
+/**
+ * Internal: TRUE if two screen rectangles share at least one pixel.
+ */
+static BOOL RectsOverlap(const RECT* a, const RECT* b) {
+    return a->left < b->right && b->left < a->right && a->top < b->bottom && b->top < a->bottom;
+}
+
+/**
+ * Internal: Collect the entries of one bucket that overlap rect and that
+ * this query has not examined yet. Under g_spatialLock.
+ */
+static void SpatialCollect(const SpatialBucket* bucket, const RECT* rect, DWORD mark,
+                           HwndList* list, DWORD* examined) {
+    for (DWORD i = 0; i < bucket->count; i++) {
+        SpatialEntry* entry = &g_spatial[bucket->items[i]];
+        if (entry->queryMark != mark) {
+            entry->queryMark = mark;
+            (*examined)++;
+            if (RectsOverlap(&entry->bounds, rect)) {
+                AppendHwnd(list, entry->hwnd);
+            }
+        }
+    }
+}
+
+/**
+ * Internal: Collect the indexed windows overlapping rect. Visits the
+ * buckets of the cells under rect, or every bucket once if rect covers
+ * more cells than there are buckets, plus the large list. Under g_spatialLock.
+ *
+ * @return Number of entries examined
+ */
+static DWORD SpatialQueryLocked(const RECT* rect, HwndList* list) {
+    // Mark 0 is what new entries carry
+    if (++g_spatialMark == 0) {
+        g_spatialMark = 1;
+    }
+
+    DWORD examined = 0;
+    RECT cells;
+    if (SpatialCellRange(rect, &cells) >= SPATIAL_BUCKETS) {
+        for (DWORD i = 0; i < SPATIAL_BUCKETS; i++) {
+            SpatialCollect(&g_spatialGrid[i], rect, g_spatialMark, list, &examined);
+        }
+    } else {
+        for (LONG y = cells.top; y <= cells.bottom; y++) {
+            for (LONG x = cells.left; x <= cells.right; x++) {
+                SpatialCollect(SpatialBucketFor(x, y), rect, g_spatialMark, list, &examined);
+            }
+        }
+    }
+    SpatialCollect(&g_spatialLarge, rect, g_spatialMark, list, &examined);
+    return examined;
+}
+
+/**
+ * EnumWindows callback seeding the spatial index with this process's windows.
+ */
+static BOOL CALLBACK SeedSpatialCallback(HWND hwnd, LPARAM lParam) {
+    DWORD pid = 0;
+    GetWindowThreadProcessId(hwnd, &pid);
+    if (pid == (DWORD)lParam) {
+        SpatialUpdate(hwnd);
+    }
+    return TRUE;
+}
+
+/**
+ * Internal: Start keeping the spatial index on first use, if hook events
+ * are on. Moves are only hooked from then on, since location changes are
+ * frequent. Only the thread owning the hooks can add the move hook, so
+ * the first call asks it to and does not wait: queries enumerate until
+ * the owner, or in pumped mode WindowHiderPump on the thread that turned
+ * events on, has seeded the index.
+ *
+ * @return TRUE if the index is complete and can answer queries
+ */
+static BOOL ActivateSpatialIndex() {
+    if (!EventsActive()) {
+        return FALSE;
+    }
+
+    if (InterlockedCompareExchange(&g_spatialState, SPATIAL_SEEDING, SPATIAL_OFF) == SPATIAL_OFF) {
+        InterlockedExchange(&g_locationWanted, 1);
+        if (g_eventSignal != NULL) {
+            SetEvent(g_eventSignal);
+        }
+    }
+    return g_spatialState == SPATIAL_READY;
+}
+
+/**
+ * Internal: Time every strategy on the live desktop, best of
+ * ENUM_CALIBRATION_RUNS, and keep the fastest unless the host picked a
+ * strategy meanwhile. Ties go to the lower id, so EnumWindows wins them.
+ * Runs on the thread that asked for it, outside g_sweepLock; sweeps
+ * meanwhile use EnumWindows, and so does a second caller.
+ *
+ * @return Strategy chosen
+ */
+static LONG CalibrateEnumStrategy() {
+    if (InterlockedCompareExchange(&g_enumCalibrating, 1, 0) != 0) {
+        return ENUM_STRATEGY_ENUMWINDOWS;
+    }
+
+    LONG best = ENUM_STRATEGY_ENUMWINDOWS;
+    DWORD bestNanos = ENUM_UNAVAILABLE;
+    for (LONG strategy = 0; strategy < ENUM_STRATEGY_COUNT; strategy++) {
+        DWORD nanos = ENUM_UNAVAILABLE;
+        for (DWORD run = 0; run < ENUM_CALIBRATION_RUNS; run++) {
+            HwndList list;
+            InitHwndList(&list);
+            LONGLONG start = QpcNow();
+            BOOL complete = g_enumStrategies[strategy](&list);
+            LONGLONG ticks = QpcNow() - start;
+            FreeHwndList(&list);
+            if (!complete) {
+                nanos = ENUM_UNAVAILABLE;
+                break;
+            }
+            DWORD runNanos = (DWORD)(ticks * 1000000000 / QpcFrequency());
+            if (runNanos < nanos) {
+                nanos = runNanos;
+            }
+        }
+
+        g_enumInfo.calibrationNanos[strategy] = nanos;
+        if (nanos < bestNanos) {
+            best = strategy;
+            bestNanos = nanos;
+        }
+    }
+
+    g_enumInfo.calibrated = TRUE;
+    InterlockedCompareExchange(&g_enumStrategy, best, ENUM_STRATEGY_CALIBRATE);
+    InterlockedExchange(&g_enumCalibrating, 0);
+    return best;
+}
+
+/**
+ * Internal: Call an EnumWindows-style callback for the top-level windows,
+ * found with the current strategy. A strategy that cannot complete falls
+ * back to EnumWindows, so no window is skipped because of the strategy.
+ *
+ * @param callback Called once per window until it returns FALSE
+ * @param lParam Passed to callback
+ */
+static void EnumProcessWindows(WNDENUMPROC callback, LPARAM lParam) {
+    // Calibration never runs here, where it would hold up a hide sweep
+    LONG strategy = g_enumStrategy;
+    if (strategy == ENUM_STRATEGY_CALIBRATE) {
+        strategy = ENUM_STRATEGY_ENUMWINDOWS;
+    }
+
+    if (strategy != ENUM_STRATEGY_ENUMWINDOWS) {
+        HwndList list;
+        InitHwndList(&list);
+        BOOL complete = g_enumStrategies[strategy](&list);
+        if (complete) {
+            for (DWORD i = 0; i < list.count && callback(list.items[i], lParam); i++) {
+            }
+        }
+        FreeHwndList(&list);
+        if (complete) {
+            return;
+        }
+        StatsIncrement(&g_enumInfo.fallbacks);
+    }
+
+    EnumWindows(callback, lParam);
+}
+
+/**
+ * Snapshot key of a window handle. Handles have 32 significant bits on
+ * 64-bit Windows too, so they fit the high half of an entry.
+ */
+static ULONGLONG SnapshotKey(HWND hwnd) {
+    return (ULONGLONG)(DWORD)(ULONG_PTR)hwnd << 32;
+}
+
+/**
+ * Window handle of a snapshot entry, sign-extended as Windows does.
+ */
+static HWND SnapshotHandle(ULONGLONG entry) {
+    return (HWND)(LONG_PTR)(LONG)(DWORD)(entry >> 32);
+}
+
+/**
+ * Internal: Append an entry, growing both buffers together.
+ *
+ * @return FALSE if the snapshot could not grow
+ */
+static BOOL SnapshotAppend(WindowSnapshot* snapshot, ULONGLONG entry) {
+    if (snapshot->count == snapshot->capacity) {
+        DWORD capacity = snapshot->capacity ? snapshot->capacity * 2 : 256;
+        void* items = ReallocMemory(snapshot->items, capacity * sizeof(ULONGLONG));
+        if (items == NULL) {
+            return FALSE;
+        }
+        snapshot->items = (ULONGLONG*)items;
+        void* scratch = ReallocMemory(snapshot->scratch, capacity * sizeof(ULONGLONG));
+        if (scratch == NULL) {
+            return FALSE;
+        }
+        snapshot->scratch = (ULONGLONG*)scratch;
+        snapshot->capacity = capacity;
+    }
+    snapshot->items[snapshot->count++] = entry;
+    return TRUE;
+}
+
+/**
+ * Internal: LSD radix sort on the handle half, one byte per pass. A pass
+ * whose byte is the same in every entry is skipped; handles of one
+ * process often share their top bytes.
+ */
+static void SortSnapshot(WindowSnapshot* snapshot) {
+    ULONGLONG* from = snapshot->items;
+    ULONGLONG* to = snapshot->scratch;
+    DWORD count = snapshot->count;
+
+    for (DWORD shift = 32; shift < 64; shift += 8) {
+        DWORD offsets[256] = { 0 };
+        for (DWORD i = 0; i < count; i++) {
+            offsets[(from[i] >> shift) & 0xFF]++;
+        }
+        if (count == 0 || offsets[(from[0] >> shift) & 0xFF] == count) {
+            continue;
+        }
+
+        DWORD total = 0;
+        for (DWORD digit = 0; digit < 256; digit++) {
+            DWORD n = offsets[digit];
+            offsets[digit] = total;
+            total += n;
+        }
+        for (DWORD i = 0; i < count; i++) {
+            to[offsets[(from[i] >> shift) & 0xFF]++] = from[i];
+        }
+
+        ULONGLONG* swap = from;
+        from = to;
+        to = swap;
+    }
+
+    if (from != snapshot->items) {
+        memcpy(snapshot->items, from, count * sizeof(ULONGLONG));
+    }
+}
+
+/**
+ * Internal: Merge two sorted snapshots, flagging entries of next that are
+ * also in prev with SNAPSHOT_COMMON. Successive snapshots are mostly
+ * equal, so runs of equal pairs are compared two entries at a time with
+ * SSE2 before falling back to one step of the scalar merge.
+ *
+ * @param next New snapshot, sorted; flags are set in place
+ * @param prev Previous snapshot, sorted
+ */
+static void DiffSnapshots(WindowSnapshot* next, const WindowSnapshot* prev) {
+    DWORD i = 0;
+    DWORD j = 0;
+
+    while (i < next->count && j < prev->count) {
+        if (i + 2 <= next->count && j + 2 <= prev->count) {
+            __m128i a = _mm_loadu_si128((const __m128i*)&next->items[i]);
+            __m128i b = _mm_loadu_si128((const __m128i*)&prev->items[j]);
+            // Bytes 4-7 and 12-15 are the two handle halves
+            if ((_mm_movemask_epi8(_mm_cmpeq_epi32(a, b)) & 0xF0F0) == 0xF0F0) {
+                next->items[i] |= SNAPSHOT_COMMON;
+                next->items[i + 1] |= SNAPSHOT_COMMON;
+                i += 2;
+                j += 2;
+                continue;
+            }
+        }
+
+        DWORD left = (DWORD)(next->items[i] >> 32);
+        DWORD right = (DWORD)(prev->items[j] >> 32);
+        if (left == right) {
+            next->items[i++] |= SNAPSHOT_COMMON;
+            j++;
+        } else if (left < right) {
+            i++;
+        } else {
+            j++;
+        }
+    }
+}
+
+/**
+ * Check that a window the previous sweep protected still is: tracked as
+ * hidden under its current destroy stamp, with the affinity still in place.
+ */
+static BOOL IsStillProtected(HWND hwnd) {
+    DWORD current;
+    DWORD tracked = TrackedAffinity(hwnd);
+    return tracked != WDA_NONE && GetWindowDisplayAffinity(hwnd, &current) && current == tracked;
+}
+
+static VOID CALLBACK MoveTimerCallback(PTP_CALLBACK_INSTANCE instance, PVOID context, PTP_TIMER timer);
+
+/**
+ * Internal: Make sure pending moves get applied even if no further move
+ * arrives: arm the one-shot move timer, creating it on first use. Does
+ * nothing in pumped mode; the pump applies them instead.
+ */
+static void ScheduleMoveFlush() {
+    if (!UseDllThreads() || InterlockedCompareExchange(&g_moveTimerArmed, 1, 0) != 0) {
+        return;
+    }
+
+    if (g_moveTimer == NULL) {
+        InitializeThreadpoolEnvironment(&g_moveEnviron);
+        SetThreadpoolCallbackLibrary(&g_moveEnviron, g_module);
+        g_moveTimer = CreateThreadpoolTimer(MoveTimerCallback, NULL, &g_moveEnviron);
+        if (g_moveTimer == NULL) {
+            InterlockedExchange(&g_moveTimerArmed, 0);
+            return;
+        }
+    }
+
+    // Negative due time is relative, in 100 ns units
+    ULARGE_INTEGER due;
+    due.QuadPart = (ULONGLONG)(-(LONGLONG)MOVE_FLUSH_INTERVAL_MS * 10000);
+    FILETIME dueTime;
+    dueTime.dwLowDateTime = due.LowPart;
+    dueTime.dwHighDateTime = due.HighPart;
+    SetThreadpoolTimer(g_moveTimer, &dueTime, 0, 0);
+}
+
+/**
+ * Internal: Apply pending moves to the spatial index. A window whose
+ * bounds newly overlap the region of the last HideWindowsOnMonitor /
+ * HideWindowsInRect call is hidden; moves inside or outside the region
+ * only update the index. Whatever is left at the deadline is scheduled
+ * for later. Only g_moveLock is held while hiding.
+ *
+ * @param deadline QPC time to stop at, or 0 to apply every pending move
+ */
+static void FlushMoves(LONGLONG deadline) {
+    LONGLONG start = QpcNow();
+    if (deadline == 0) {
+        AcquireSRWLockExclusive(&g_moveLock);
+    } else if (!TryAcquireSRWLockExclusive(&g_moveLock)) {
+        // The running pass may already have looked at the list
+        ScheduleMoveFlush();
+        return;
+    }
+    InterlockedExchange64(&g_lastMoveFlush, start);
+
+    for (;;) {
+        HWND hwnd = NULL;
+        AcquireSRWLockExclusive(&g_spatialLock);
+        if (g_movePendingCount > 0) {
+            SpatialEntry* entry = &g_spatial[g_movePending[--g_movePendingCount]];
+            entry->flags &= ~SPATIAL_MOVE_PENDING;
+            hwnd = entry->hwnd;
+        }
+        BOOL more = g_movePendingCount > 0;
+        ReleaseSRWLockExclusive(&g_spatialLock);
+        if (hwnd == NULL) {
+            break;
+        }
+
+        RECT bounds;
+        BOOL entered = FALSE;
+        if (GetWindowRect(hwnd, &bounds)) {
+            AcquireSRWLockExclusive(&g_spatialLock);
+            WORD id = SpatialFindLocked(hwnd);
+            if (id != SPATIAL_NONE) {
+                entered = g_scopeActive && !RectsOverlap(&g_spatial[id].bounds, &g_scopeRect) &&
+                          RectsOverlap(&bounds, &g_scopeRect);
+                SpatialMoveLocked(id, &bounds);
+            }
+            ReleaseSRWLockExclusive(&g_spatialLock);
+        }
+
+        if (entered) {
+            if (IsValidAppWindow(hwnd) && !IsStillProtected(hwnd)) {
+                LONGLONG requestedAt = QpcNow();
+                BeginHide(hwnd);
+                ApplyHide(hwnd, requestedAt);
+            }
+        }
+
+        if (!more) {
+            break;
+        }
+        if (deadline != 0 && QpcNow() >= deadline) {
+            ScheduleMoveFlush();
+            break;
+        }
+    }
+    ReleaseSRWLockExclusive(&g_moveLock);
+
+    // A region call applies every pending move at once; only budgeted
+    // passes count against MOVE_FLUSH_BUDGET_MICROS
+    if (deadline != 0) {
+        StatsMax(&g_stats.maxMoveFlushMicros, QpcToMicros(QpcNow() - start));
+    }
+}
+
+/**
+ * Thread pool timer callback applying moves left pending.
+ */
+static VOID CALLBACK MoveTimerCallback(PTP_CALLBACK_INSTANCE instance, PVOID context, PTP_TIMER timer) {
+    InterlockedExchange(&g_moveTimerArmed, 0);
+    DrainWindowEvents();
+    FlushMoves(QpcNow() + MicrosToQpc(MOVE_FLUSH_BUDGET_MICROS));
+}
+
+/**
+ * Internal: Called while draining each move of a top-level window, often
+ * hundreds of times a second during a drag. A move only
+ * marks the window pending, merging it with any move not yet applied.
+ * Pending moves are applied at most every MOVE_FLUSH_INTERVAL_MS within
+ * MOVE_FLUSH_BUDGET_MICROS: right here if the last pass is older than
+ * that, so the first move after a pause is applied at once, otherwise by
+ * the move timer. A window not yet indexed is indexed at once.
+ */
+static void TrackMove(HWND hwnd) {
+    AcquireSRWLockExclusive(&g_spatialLock);
+    WORD id = SpatialFindLocked(hwnd);
+    BOOL merged = FALSE;
+    if (id != SPATIAL_NONE) {
+        SpatialEntry* entry = &g_spatial[id];
+        merged = (entry->flags & SPATIAL_MOVE_PENDING) != 0;
+        if (!merged) {
+            entry->flags |= SPATIAL_MOVE_PENDING;
+            g_movePending[g_movePendingCount++] = id;
+        }
+    }
+    ReleaseSRWLockExclusive(&g_spatialLock);
+
+    if (id == SPATIAL_NONE) {
+        SpatialUpdate(hwnd);
+        return;
+    }
+
+    if (merged) {
+        StatsIncrement(&g_stats.movesMerged);
+    }
+
+    LONGLONG now = QpcNow();
+    LONGLONG last = InterlockedCompareExchange64(&g_lastMoveFlush, 0, 0);  // Atomic read on x86 too
+    if (now - last >= MicrosToQpc(MOVE_FLUSH_INTERVAL_MS * 1000)) {
+        FlushMoves(now + MicrosToQpc(MOVE_FLUSH_BUDGET_MICROS));
+    } else {
+        ScheduleMoveFlush();
+    }
+}
+
+/**
+ * EnumWindows callback function.
+ * Sets display affinity for windows belonging to the target process.
+ *
+ * @param hwnd Current window handle
+ * @param lParam Pointer to EnumWindowsContext
+ * @return TRUE to continue enumeration, FALSE to stop
+ */
+static BOOL CALLBACK EnumWindowsCallback(HWND hwnd, LPARAM lParam) {
+    EnumWindowsContext* ctx = (EnumWindowsContext*)lParam;
+
+    // Get the process ID of this window
+    DWORD windowPID = 0;
+    GetWindowThreadProcessId(hwnd, &windowPID);
+
+    // Only process windows belonging to our target process
+    if (windowPID == ctx->targetPID) {
+        // A hide sweep filters after diffing; out of memory, filter it now
+        BOOL collected = ctx->snapshot != NULL && SnapshotAppend(ctx->snapshot, SnapshotKey(hwnd) | ctx->zOrder);
+
+        // The foreground window is the most exposed: protect it now rather
+        // than after the whole desktop is collected and ordered
+        if (collected && hwnd == ctx->foreground && !IsStillProtected(hwnd) && IsValidAppWindow(hwnd)
+            && ApplyHide(hwnd, ctx->requestedAt)) {
+            ctx->early = hwnd;
+            ctx->earlyAt = QpcNow();
+        }
+
+        if (!collected && IsValidAppWindow(hwnd)) {
+            if (ctx->showOp != NULL) {
+                // Skip windows an earlier, interrupted drain already handled
+                if (ctx->handled++ >= ctx->showOp->progress) {
+                    ApplyShow(ctx->showOp, hwnd);
+                    if (ctx->deadline != 0 && QpcNow() >= ctx->deadline) {
+                        ctx->stopped = TRUE;
+                        return FALSE;
+                    }
+                }
+            } else if (ctx->candidates == NULL || !AddCandidate(ctx->candidates, hwnd, ctx)) {
+                // Out of memory for ordering: protect it right away instead
+                ApplyHide(hwnd, ctx->requestedAt);
+            }
+        }
+    }
+    ctx->zOrder++;
+
+    // Continue enumeration
+    return TRUE;
+}
+
+/**
+ * Internal: Record the measured exposure of a finished sweep: for each
+ * window it protected, its area times the time from the hide request to
+ * SetWindowDisplayAffinity returning, slices and gaps between them included.
+ *
+ * @param sweep Finished sweep
+ */
+static void RecordSweepExposure(HideSweep* sweep) {
+    CandidateList* list = &sweep->candidates;
+
+    ULONGLONG exposure = 0;
+    LONGLONG longest = 0;
+    for (DWORD i = 0; i < list->count; i++) {
+        LONGLONG protectedAt = list->items[i].protectedAt;
+        if (protectedAt != 0) {
+            exposure += (ULONGLONG)list->items[i].area * QpcToMicros(protectedAt - sweep->requestedAt);
+            if (protectedAt - sweep->requestedAt > longest) {
+                longest = protectedAt - sweep->requestedAt;
+            }
+        }
+    }
+
+    g_stats.lastSweepExposure = (DWORD)(exposure / 1000000);
+    g_stats.lastSweepMaxExposedMicros = QpcToMicros(longest);
+}
+
+/**
+ * Check whether a show for this window was requested after the sweep began.
+ * If more shows arrived than the ring remembers, the sweep keeps hiding:
+ * staying hidden is always the safe outcome.
+ *
+ * @param showSeq Value of g_showSeq when the sweep started
+ * @param hwnd Window the sweep is about to protect
+ * @return TRUE if the window was shown since
+ */
+static BOOL IsShownSince(LONG showSeq, HWND hwnd) {
+    BOOL shown = FALSE;
+
+    AcquireSRWLockShared(&g_queueLock);
+    LONG latest = g_showSeq;
+    if (latest - showSeq <= RECENT_SHOW_CAPACITY) {
+        for (LONG seq = showSeq + 1; seq - latest <= 0; seq++) {
+            HWND target = g_recentShows[(DWORD)seq % RECENT_SHOW_CAPACITY];
+            if (target == NULL || target == hwnd) {
+                shown = TRUE;
+                break;
+            }
+        }
+    }
+    ReleaseSRWLockShared(&g_queueLock);
+
+    return shown;
+}
+
+/**
+ * Internal: Start a hide-all sweep: cancel queued shows, collect candidate
+ * windows and order them most exposed first. The foreground window is
+ * protected as soon as enumeration reaches it. Caller holds g_sweepLock.
+ *
+ * @param sweep Sweep to (re)initialise
+ */
+static void StartSweep(HideSweep* sweep) {
+    EnumWindowsContext ctx;
+    ctx.targetPID = GetCurrentProcessId();
+    ctx.showOp = NULL;
+    ctx.requestedAt = QpcNow();
+    ctx.candidates = &sweep->candidates;
+    ctx.zOrder = 0;
+    ctx.foreground = GetForegroundWindow();
+    ctx.deadline = 0;
+    ctx.handled = 0;
+    ctx.stopped = FALSE;
+    ctx.snapshot = &g_sweepSnapshot;
+    ctx.early = NULL;
+    ctx.earlyAt = 0;
+
+    BeginHide(NULL);
+
+    sweep->requestedAt = ctx.requestedAt;
+    sweep->showSeq = g_showSeq;
+    sweep->next = 0;
+    sweep->active = TRUE;
+    sweep->candidates.count = 0;
+    sweep->kept.count = 0;
+    g_sweepSnapshot.count = 0;
+
+    // Enumerate all top-level windows and collect this process's handles
+    EnumProcessWindows(EnumWindowsCallback, (LPARAM)&ctx);
+
+    SortSnapshot(&g_sweepSnapshot);
+    DiffSnapshots(&g_sweepSnapshot, &g_protectedSnapshot);
+
+    // Only new windows and ones that lost their protection reach the filter
+    DWORD added = 0;
+    for (DWORD i = 0; i < g_sweepSnapshot.count; i++) {
+        ULONGLONG entry = g_sweepSnapshot.items[i];
+        HWND hwnd = SnapshotHandle(entry);
+        if (hwnd == ctx.early) {
+            // Already protected during enumeration; kept for its exposure
+            ctx.zOrder = (DWORD)entry & ~SNAPSHOT_COMMON;
+            if (AddCandidate(ctx.candidates, hwnd, &ctx)) {
+                ctx.candidates->items[ctx.candidates->count - 1].protectedAt = ctx.earlyAt;
+            }
+            SnapshotAppend(&sweep->kept, SnapshotKey(hwnd));
+            if (!(entry & SNAPSHOT_COMMON)) {
+                added++;
+            }
+            continue;
+        }
+        if (entry & SNAPSHOT_COMMON) {
+            if (IsStillProtected(hwnd)) {
+                SnapshotAppend(&sweep->kept, SnapshotKey(hwnd));
+                StatsIncrement(&g_stats.hidesSkipped);
+                continue;
+            }
+        } else {
+            added++;
+        }
+
+        if (IsValidAppWindow(hwnd)) {
+            ctx.zOrder = (DWORD)entry & ~SNAPSHOT_COMMON;
+            if (!AddCandidate(ctx.candidates, hwnd, &ctx) && ApplyHide(hwnd, ctx.requestedAt)) {
+                SnapshotAppend(&sweep->kept, SnapshotKey(hwnd));
+            }
+        }
+    }
+    g_stats.snapshotAdded = added;
+
+    qsort(sweep->candidates.items, sweep->candidates.count, sizeof(SweepCandidate), CompareByExposure);
+}
+
+/**
+ * Internal: Protect the sweep's remaining windows, most exposed first.
+ * With a deadline, stops before the next window would likely overrun it,
+ * judged by the average cost so far; at least one window is always
+ * protected per call so the sweep makes progress. Caller holds g_sweepLock.
+ *
+ * @param sweep Started sweep
+ * @param deadline QPC timestamp to stop at, or 0 for no limit
+ * @return TRUE if the sweep finished
+ */
+static BOOL RunSweep(HideSweep* sweep, LONGLONG deadline) {
+    CandidateList* list = &sweep->candidates;
+    LONGLONG spent = 0;
+    DWORD done = 0;
+    LONGLONG last = QpcNow();
+
+    while (sweep->next < list->count) {
+        if (deadline != 0 && done > 0 && last + spent / (LONGLONG)done > deadline) {
+            return FALSE;
+        }
+
+        SweepCandidate* candidate = &list->items[sweep->next++];
+        if (candidate->protectedAt != 0) {
+            continue;
+        }
+        if (!IsStampCurrent(candidate->hwnd, candidate->stamp) || IsShownSince(sweep->showSeq, candidate->hwnd)) {
+            // Destroyed or explicitly shown since the sweep started
+            continue;
+        }
+
+        if (ApplyHide(candidate->hwnd, sweep->requestedAt)) {
+            SnapshotAppend(&sweep->kept, SnapshotKey(candidate->hwnd));
+        }
+        LONGLONG now = QpcNow();
+        candidate->protectedAt = now;
+        spent += now - last;
+        done++;
+        last = now;
+    }
+
+    RecordSweepExposure(sweep);
+
+    // The next sweep diffs against what this one left protected; swap
+    // buffers rather than copy
+    SortSnapshot(&sweep->kept);
+    WindowSnapshot previous = g_protectedSnapshot;
+    g_protectedSnapshot = sweep->kept;
+    sweep->kept = previous;
+
+    sweep->active = FALSE;
+    return TRUE;
+}
+
+/**
+ * Internal: Hide all windows in current process immediately.
+ * Enumerates with the current strategy (EnumWindows by default), then protects
+ * the collected windows most exposed first. The sweep always finishes
+ * before returning, in host-pumped mode too; only shows, verification and
+ * moves are left to WindowHiderPump.
+ */
+static void HideAllWindowsInternal() {
+    AcquireSRWLockExclusive(&g_sweepLock);
+    StartSweep(&g_fullSweep);
+    RunSweep(&g_fullSweep, 0);
+    ReleaseSRWLockExclusive(&g_sweepLock);
+}
+
+/**
+ * Internal: Encode a sweep slot as a continuation token.
+ */
+static HANDLE SweepToken(DWORD slot) {
+    return (HANDLE)(ULONG_PTR)(((DWORD)g_sweepSlots[slot].generation << 8) | (slot + 1));
+}
+
+/**
+ * Internal: Resolve a continuation token to its active sweep.
+ *
+ * @return The sweep, or NULL if the token is unknown, finished or recycled
+ */
+static HideSweep* SweepFromToken(HANDLE token) {
+    ULONG_PTR value = (ULONG_PTR)token;
+    DWORD slot = (DWORD)(value & 0xFF) - 1;
+    if (slot >= SWEEP_SLOT_COUNT) {
+        return NULL;
+    }
+
+    HideSweep* sweep = &g_sweepSlots[slot];
+    if (!sweep->active || (WORD)(value >> 8) != sweep->generation) {
+        return NULL;
+    }
+    return sweep;
+}
+
+/**
+ * Internal: Pick a slot for a new sliced sweep, recycling the oldest if all
+ * are busy. The generation bump invalidates the previous owner's token.
+ */
+static DWORD AcquireSweepSlot() {
+    DWORD chosen = 0;
+    for (DWORD i = 0; i < SWEEP_SLOT_COUNT; i++) {
+        if (!g_sweepSlots[i].active) {
+            chosen = i;
+            break;
+        }
+        if (g_sweepSlots[i].requestedAt < g_sweepSlots[chosen].requestedAt) {
+            chosen = i;
+        }
+    }
+
+    g_sweepSlots[chosen].generation++;
+    return chosen;
+}
+
+/**
+ * Internal: Apply a single queued show.
+ *
+ * @param op Show to apply; progress is updated if it runs out of time
+ * @param deadline QPC timestamp to stop at, or 0 for no limit
+ * @return TRUE if the show finished
+ */
+static BOOL ApplyShowOp(ShowOp* op, LONGLONG deadline) {
+    if (op->hwnd != NULL) {
+        // A handle destroyed and reused since the request names another window
+        if (IsStampCurrent(op->hwnd, op->stamp)) {
+            ApplyShow(op, op->hwnd);
+        }
+        return TRUE;
+    }
+
+    EnumWindowsContext ctx;
+    ctx.targetPID = GetCurrentProcessId();
+    ctx.showOp = op;
+    ctx.requestedAt = 0;
+    ctx.candidates = NULL;
+    ctx.zOrder = 0;
+    ctx.foreground = NULL;
+    ctx.deadline = deadline;
+    ctx.handled = 0;
+    ctx.stopped = FALSE;
+    ctx.snapshot = NULL;
+    ctx.early = NULL;
+    ctx.earlyAt = 0;
+
+    EnumProcessWindows(EnumWindowsCallback, (LPARAM)&ctx);
+
+    op->progress = ctx.handled;
+    return !ctx.stopped;
+}
+
+/**
+ * Internal: Put an interrupted show back at the head of the queue, unless a
+ * hide of all windows has cancelled it meanwhile. If the queue filled up in
+ * the meantime the rest of the show is applied now.
+ *
+ * @param op Show that ran out of time
+ */
+static void RequeueShow(ShowOp* op) {
+    BOOL queued = TRUE;
+
+    AcquireSRWLockExclusive(&g_queueLock);
+    if (IsShowCancelledLocked(op, NULL)) {
+        StatsIncrement(&g_stats.showsCancelled);
+    } else if (g_showCount < SHOW_QUEUE_CAPACITY) {
+        memmove(&g_showQueue[1], &g_showQueue[0], g_showCount * sizeof(ShowOp));
+        g_showQueue[0] = *op;
+        g_showCount++;
+    } else {
+        queued = FALSE;
+    }
+    ReleaseSRWLockExclusive(&g_queueLock);
+
+    if (!queued) {
+        ApplyShowOp(op, 0);
+    }
+}
+
+/**
+ * Internal: Apply queued shows until the queue is empty or the deadline
+ * passes. Only one thread drains at a time; others leave their shows for it.
+ *
+ * @param deadline QPC timestamp to stop at, or 0 for no limit
+ * @return TRUE if the queue was emptied
+ */
+static BOOL DrainShowQueue(LONGLONG deadline) {
+    while (InterlockedCompareExchange(&g_drainActive, 1, 0) == 0) {
+        BOOL outOfTime = FALSE;
+        for (;;) {
+            if (deadline != 0 && QpcNow() >= deadline) {
+                outOfTime = TRUE;
+                break;
+            }
+
+            ShowOp op;
+            BOOL found = FALSE;
+
+            AcquireSRWLockExclusive(&g_queueLock);
+            if (g_showCount > 0) {
+                op = g_showQueue[0];
+                g_showCount--;
+                memmove(&g_showQueue[0], &g_showQueue[1], g_showCount * sizeof(ShowOp));
+                found = TRUE;
+            }
+            ReleaseSRWLockExclusive(&g_queueLock);
+
+            if (!found) {
+                break;
+            }
+            if (!ApplyShowOp(&op, deadline)) {
+                RequeueShow(&op);
+                outOfTime = TRUE;
+                break;
+            }
+        }
+
+        InterlockedExchange(&g_drainActive, 0);
+        if (outOfTime) {
+            return FALSE;
+        }
+
+        // A show queued between the last check and releasing the drain flag
+        // would otherwise wait for the next caller.
+        AcquireSRWLockShared(&g_queueLock);
+        BOOL pending = g_showCount > 0;
+        ReleaseSRWLockShared(&g_queueLock);
+        if (!pending) {
+            return TRUE;
+        }
+    }
+
+    // Another thread is draining
+    return FALSE;
+}
+
+/**
+ * Internal: Queue a show without draining. The op keeps the hide sequence it
+ * was issued under, so hides issued since then still cancel it.
+ * Identical queued shows are merged. If the queue is full the show is
+ * applied directly.
+ *
+ * @param op Show to queue
+ */
+static void EnqueueShow(ShowOp* op) {
+    BOOL queued = TRUE;
+
+    AcquireSRWLockExclusive(&g_queueLock);
+    LONG seq = InterlockedIncrement(&g_showSeq);
+    g_recentShows[(DWORD)seq % RECENT_SHOW_CAPACITY] = op->hwnd;
+
+    BOOL duplicate = FALSE;
+    for (int i = 0; i < g_showCount; i++) {
+        if (g_showQueue[i].hwnd == op->hwnd) {
+            duplicate = TRUE;
+            break;
+        }
+    }
+    if (!duplicate) {
+        if (g_showCount < SHOW_QUEUE_CAPACITY) {
+            g_showQueue[g_showCount++] = *op;
+            StatsIncrement(&g_stats.showsQueued);
+        } else {
+            queued = FALSE;
+        }
+    }
+    ReleaseSRWLockExclusive(&g_queueLock);
+
+    if (!queued) {
+        ApplyShowOp(op, 0);
+    }
+}
+
+/**
+ * Internal: Queue a show and drain the queue on the calling thread, unless
+ * in pumped mode, where WindowHiderPump applies it later.
+ *
+ * @param hwnd Window to show, or NULL for all windows of the process
+ * @return TRUE if the queue was drained here, so the show has been applied
+ *         or cancelled; FALSE if it is left for the pump or another thread
+ */
+static BOOL QueueShow(HWND hwnd) {
+    ShowOp op;
+    op.hwnd = hwnd;
+    op.stamp = hwnd != NULL ? WindowStamp(hwnd) : 0;
+    op.hideSeq = g_hideSeq;
+    op.progress = 0;
+
+    EnqueueShow(&op);
+    if (HostPumped()) {
+        return FALSE;
+    }
+    return DrainShowQueue(0);
+}
+
+/**
+ * Internal: Swap WS_EX_APPWINDOW and WS_EX_TOOLWINDOW without refreshing
+ * the frame. The taskbar only notices the new style once the frame is
+ * refreshed with SWP_FRAMECHANGED.
+ *
+ * @param hwnd Window handle to modify
+ * @param hide TRUE to hide from taskbar, FALSE to show in taskbar
+ * @param changed Receives TRUE if the style was changed, FALSE if it already matched
+ * @return TRUE on success, FALSE on failure
+ */
+static BOOL SetTaskbarStyle(HWND hwnd, BOOL hide, BOOL* changed) {
+    *changed = FALSE;
+    LONG_PTR oldStyle = GetWindowLongPtr(hwnd, GWL_EXSTYLE);
+    if (oldStyle == 0) {
+        return FALSE;
+    }
+
+    LONG_PTR style = oldStyle;
+    if (hide) {
+        // Hide from taskbar: add TOOLWINDOW style, remove APPWINDOW style
+        style |= WS_EX_TOOLWINDOW;
+        style &= ~WS_EX_APPWINDOW;
+    } else {
+        // Show in taskbar: add APPWINDOW style, remove TOOLWINDOW style
+        style |= WS_EX_APPWINDOW;
+        style &= ~WS_EX_TOOLWINDOW;
+    }
+
+    if (style == oldStyle) {
+        StatsIncrement(&g_stats.taskbarUnchanged);
+        return TRUE;
+    }
+
+    SetWindowLongPtr(hwnd, GWL_EXSTYLE, style);
+    *changed = TRUE;
+    return TRUE;
+}
+
+/**
+ * Internal: Refresh a window's frame so the taskbar picks up a style change.
+ */
+static void RefreshFrame(HWND hwnd) {
+    SetWindowPos(hwnd, NULL, 0, 0, 0, 0, FRAME_CHANGE_FLAGS);
+    StatsIncrement(&g_stats.frameChanges);
+}
+
+/**
+ * Internal: Add or remove a window's taskbar button by swapping
+ * WS_EX_APPWINDOW and WS_EX_TOOLWINDOW, then refreshing its frame.
+ * Windows already in the requested state are not repainted.
+ *
+ * @param hwnd Window handle to modify
+ * @param hide TRUE to hide from taskbar, FALSE to show in taskbar
+ * @return TRUE on success, FALSE on failure
+ */
+static BOOL ApplyTaskbarStyle(HWND hwnd, BOOL hide) {
+    BOOL changed;
+    if (!SetTaskbarStyle(hwnd, hide, &changed)) {
+        return FALSE;
+    }
+
+    if (changed) {
+        RefreshFrame(hwnd);
+    }
+    return TRUE;
+}
+
+/**
+ * Internal: ApplyTaskbarStyle for several windows. Every style is swapped
+ * first, then all changed frames are refreshed in one DeferWindowPos batch,
+ * so the windows repaint and the taskbar updates together. If the batch
+ * cannot be built, the frames are refreshed one by one instead. Sends
+ * messages, so no DLL lock may be held.
+ *
+ * @param windows Windows to modify
+ * @param count Number of windows
+ * @param hide TRUE to hide from taskbar, FALSE to show in taskbar
+ * @return TRUE on success, FALSE if any window failed
+ */
+static BOOL ApplyTaskbarStyles(const HWND* windows, DWORD count, BOOL hide) {
+    BOOL result = TRUE;
+    HwndList changed;
+    InitHwndList(&changed);
+
+    for (DWORD i = 0; i < count; i++) {
+        BOOL styleChanged;
+        if (!SetTaskbarStyle(windows[i], hide, &styleChanged)) {
+            result = FALSE;
+        } else if (styleChanged && !AppendHwnd(&changed, windows[i])) {
+            // Out of memory for the batch: refresh this one right away
+            RefreshFrame(windows[i]);
+        }
+    }
+
+    if (changed.count > 0) {
+        HDWP batch = BeginDeferWindowPos((int)changed.count);
+        for (DWORD i = 0; i < changed.count && batch != NULL; i++) {
+            // A failed DeferWindowPos frees the batch and drops what it held
+            batch = DeferWindowPos(batch, changed.items[i], NULL, 0, 0, 0, 0, FRAME_CHANGE_FLAGS);
+        }
+
+        if (batch != NULL && EndDeferWindowPos(batch)) {
+            InterlockedExchangeAdd((volatile LONG*)&g_stats.frameChanges, (LONG)changed.count);
+        } else {
+            // Child windows or low resources: fall back to one call each
+            for (DWORD i = 0; i < changed.count; i++) {
+                RefreshFrame(changed.items[i]);
+            }
+        }
+    }
+
+    FreeHwndList(&changed);
+    return result;
+}
+
+/**
+ * Internal: Add or remove taskbar buttons through ITaskbarList instead of
+ * window styles, leaving styles and frames untouched. The shell may add a
+ * deleted tab back when the window is re-activated or re-shown. On a thread
+ * already in the multithreaded apartment the window styles are changed
+ * instead, and taskbarListFallbacks counts it.
+ *
+ * @param windows Windows to modify
+ * @param count Number of windows
+ * @param hide TRUE to delete the tabs, FALSE to add them back
+ * @return TRUE on success, FALSE if the taskbar is unavailable or any window failed
+ */
+static BOOL ApplyTaskbarTabs(const HWND* windows, DWORD count, BOOL hide) {
+    // S_FALSE: this thread already is in a single-threaded apartment
+    HRESULT init = CoInitializeEx(NULL, COINIT_APARTMENTTHREADED);
+    if (init == RPC_E_CHANGED_MODE) {
+        // The taskbar object is apartment-threaded; do not use it from the MTA
+        StatsIncrement(&g_stats.taskbarListFallbacks);
+        return ApplyTaskbarStyles(windows, count, hide);
+    }
+
+    ITaskbarList* taskbar = NULL;
+    BOOL result = SUCCEEDED(CoCreateInstance(CLSID_TaskbarList, NULL, CLSCTX_INPROC_SERVER,
+                                             IID_ITaskbarList, (void**)&taskbar)) &&
+                  SUCCEEDED(taskbar->HrInit());
+    for (DWORD i = 0; i < count && result; i++) {
+        HRESULT hr = hide ? taskbar->DeleteTab(windows[i]) : taskbar->AddTab(windows[i]);
+        result = SUCCEEDED(hr);
+    }
+
+    if (taskbar != NULL) {
+        taskbar->Release();
+    }
+    if (SUCCEEDED(init)) {
+        CoUninitialize();
+    }
+    return result;
+}
+
+/**
+ * Internal: Bring one window to the desired state. The observed state is
+ * read, not remembered separately: the window's record says whether the
+ * DLL keeps it hidden from capture, and its extended style whether it has
+ * a taskbar button. Only differences are applied.
+ *
+ * @param hwnd Window passing the HideAllWindows filter
+ * @param capture DESIRED_* for capture
+ * @param taskbar DESIRED_* for the taskbar
+ */
+static void ReconcileWindow(HWND hwnd, LONG capture, LONG taskbar) {
+    BOOL changed = FALSE;
+
+    if (capture != DESIRED_UNCHANGED) {
+        BOOL hidden = TrackedAffinity(hwnd) != WDA_NONE;
+        if (capture == DESIRED_HIDDEN && !hidden) {
+            LONGLONG requestedAt = QpcNow();
+            BeginHide(hwnd);
+            ApplyHide(hwnd, requestedAt);
+            changed = TRUE;
+        } else if (capture == DESIRED_VISIBLE && hidden) {
+            QueueShow(hwnd);
+            changed = TRUE;
+        }
+    }
+
+    if (taskbar != DESIRED_UNCHANGED) {
+        LONG_PTR exStyle = GetWindowLongPtr(hwnd, GWL_EXSTYLE);
+        BOOL offTaskbar = (exStyle & WS_EX_TOOLWINDOW) != 0 && (exStyle & WS_EX_APPWINDOW) == 0;
+        if ((taskbar == DESIRED_HIDDEN) != offTaskbar) {
+            ApplyTaskbarStyle(hwnd, taskbar == DESIRED_HIDDEN);
+            changed = TRUE;
+        }
+    }
+
+    if (changed) {
+        StatsIncrement(&g_stats.reconcileChanges);
+    }
+}
+
+/**
+ * Internal: Record how long a change event took to converge.
+ */
+static void RecordReconcileLag(LONGLONG eventAt) {
+    DWORD lag = QpcToMicros(QpcNow() - eventAt);
+    StatsIncrement(&g_stats.reconcilePasses);
+    g_stats.lastReconcileLagMicros = lag;
+    StatsMax(&g_stats.maxReconcileLagMicros, lag);
+}
+
+/**
+ * Internal: IsValidAppWindow with the reconciler's filter flags. When
+ * those are wider than the policy's, the check bypasses the rejection
+ * cache, which holds answers for the HideAllWindows filter.
+ */
+static BOOL IsReconcileTarget(HWND hwnd) {
+    DWORD slot;
+    const HidePolicy* policy = AcquirePolicy(&slot);
+    DWORD filterFlags = ReconcileFilterFlags(policy);
+    BOOL widened = filterFlags != policy->filterFlags;
+    BOOL target = widened && FilterWindow(policy, hwnd, filterFlags) == PREDICATE_PASSED;
+    ReleasePolicy(slot);
+    return widened ? target : IsValidAppWindow(hwnd);
+}
+
+/**
+ * EnumWindows callback for a full reconcile pass. lParam points to the
+ * desired state as two LONGs, capture then taskbar.
+ */
+static BOOL CALLBACK ReconcileEnumCallback(HWND hwnd, LPARAM lParam) {
+    const LONG* desired = (const LONG*)lParam;
+
+    DWORD pid = 0;
+    GetWindowThreadProcessId(hwnd, &pid);
+    if (pid == GetCurrentProcessId() && IsReconcileTarget(hwnd)) {
+        ReconcileWindow(hwnd, desired[0], desired[1]);
+    }
+    return TRUE;
+}
+
+static VOID CALLBACK ReconcileTimerCallback(PTP_CALLBACK_INSTANCE instance, PVOID context, PTP_TIMER timer);
+
+/**
+ * Internal: Make sure queued windows get reconciled: arm the one-shot
+ * reconcile timer, creating it on first use. Does nothing in pumped
+ * mode; the pump reconciles them instead.
+ */
+static void ScheduleReconcile() {
+    if (!UseDllThreads() || InterlockedCompareExchange(&g_reconcileTimerArmed, 1, 0) != 0) {
+        return;
+    }
+
+    if (g_reconcileTimer == NULL) {
+        InitializeThreadpoolEnvironment(&g_reconcileEnviron);
+        SetThreadpoolCallbackLibrary(&g_reconcileEnviron, g_module);
+        g_reconcileTimer = CreateThreadpoolTimer(ReconcileTimerCallback, NULL, &g_reconcileEnviron);
+        if (g_reconcileTimer == NULL) {
+            InterlockedExchange(&g_reconcileTimerArmed, 0);
+            return;
+        }
+    }
+
+    // A due time of zero is in the past, so the timer fires at once
+    FILETIME dueTime;
+    dueTime.dwLowDateTime = 0;
+    dueTime.dwHighDateTime = 0;
+    SetThreadpoolTimer(g_reconcileTimer, &dueTime, 0, 0);
+}
+
+/**
+ * Internal: Queue a shown window for the reconciler. Called while
+ * draining hook events; takes g_reconcileLock only briefly. When the queue is
+ * full the next drain reconciles every window instead.
+ */
+static void QueueReconcile(HWND hwnd, LONGLONG eventAt) {
+    AcquireSRWLockExclusive(&g_reconcileLock);
+    if (g_reconcileCount < RECONCILE_QUEUE_CAPACITY) {
+        ReconcileOp* op = &g_reconcileQueue[(g_reconcileHead + g_reconcileCount) % RECONCILE_QUEUE_CAPACITY];
+        op->hwnd = hwnd;
+        op->stamp = WindowStamp(hwnd);
+        op->eventAt = eventAt;
+        g_reconcileCount++;
+    } else {
+        InterlockedExchange(&g_reconcileOverflow, 1);
+    }
+    ReleaseSRWLockExclusive(&g_reconcileLock);
+    ScheduleReconcile();
+}
+
+/**
+ * Internal: Reconcile the shown windows queued by the event drain, oldest
+ * first, against the current desired state. After an overflow, one full
+ * pass replaces the queue and runs to completion. Never called while
+ * draining hook events.
+ *
+ * @param deadline QPC time to stop at, or 0 to drain the whole queue
+ * @return TRUE if the queue is empty
+ */
+static BOOL DrainReconcileQueue(LONGLONG deadline) {
+    if (InterlockedExchange(&g_reconcileOverflow, 0) != 0) {
+        LONGLONG eventAt = QpcNow();
+        AcquireSRWLockExclusive(&g_reconcileLock);
+        g_reconcileCount = 0;
+        ReleaseSRWLockExclusive(&g_reconcileLock);
+
+        DWORD slot;
+        const HidePolicy* policy = AcquirePolicy(&slot);
+        LONG desired[2] = { policy->desiredCapture, policy->desiredTaskbar };
+        ReleasePolicy(slot);
+        if (desired[0] != DESIRED_UNCHANGED || desired[1] != DESIRED_UNCHANGED) {
+            EnumProcessWindows(ReconcileEnumCallback, (LPARAM)desired);
+            RecordReconcileLag(eventAt);
+        }
+        return TRUE;
+    }
+
+    for (;;) {
+        ReconcileOp op;
+        AcquireSRWLockExclusive(&g_reconcileLock);
+        BOOL found = g_reconcileCount > 0;
+        if (found) {
+            op = g_reconcileQueue[g_reconcileHead];
+            g_reconcileHead = (g_reconcileHead + 1) % RECONCILE_QUEUE_CAPACITY;
+            g_reconcileCount--;
+        }
+        BOOL more = g_reconcileCount > 0;
+        ReleaseSRWLockExclusive(&g_reconcileLock);
+        if (!found) {
+            return TRUE;
+        }
+
+        if (IsStampCurrent(op.hwnd, op.stamp)) {
+            DWORD slot;
+            const HidePolicy* policy = AcquirePolicy(&slot);
+            LONG capture = policy->desiredCapture;
+            LONG taskbar = policy->desiredTaskbar;
+            ReleasePolicy(slot);
+            if ((capture != DESIRED_UNCHANGED || taskbar != DESIRED_UNCHANGED) && IsReconcileTarget(op.hwnd)) {
+                ReconcileWindow(op.hwnd, capture, taskbar);
+                RecordReconcileLag(op.eventAt);
+            }
+        }
+
+        if (!more) {
+            return TRUE;
+        }
+        if (deadline != 0 && QpcNow() >= deadline) {
+            return FALSE;
+        }
+    }
+}
+
+/**
+ * Thread pool timer callback reconciling the queued shown windows.
+ */
+static VOID CALLBACK ReconcileTimerCallback(PTP_CALLBACK_INSTANCE instance, PVOID context, PTP_TIMER timer) {
+    InterlockedExchange(&g_reconcileTimerArmed, 0);
+    DrainWindowEvents();
+    DrainReconcileQueue(0);
+}
+
+/**
+ * Internal: Called while draining a show event of a top-level window. A
+ * capture hide is applied at once, as auto-protect does, since it sends
+ * no message. Taskbar changes and shows can re-enter the host's window
+ * procedures, so the window is queued for the reconcile timer or
+ * WindowHiderPump instead. Either way a new window costs O(1).
+ *
+ * @param eventAt QPC time of the show event
+ */
+static void ReconcileShownWindow(HWND hwnd, LONGLONG eventAt) {
+    DWORD slot;
+    const HidePolicy* policy = AcquirePolicy(&slot);
+    LONG capture = policy->desiredCapture;
+    LONG taskbar = policy->desiredTaskbar;
+    BOOL target = (capture != DESIRED_UNCHANGED || taskbar != DESIRED_UNCHANGED) &&
+                  PassesFilterInHook(policy, hwnd, ReconcileFilterFlags(policy));
+    ReleasePolicy(slot);
+    if (!target) {
+        return;
+    }
+
+    if (capture == DESIRED_HIDDEN) {
+        ReconcileWindow(hwnd, capture, DESIRED_UNCHANGED);
+    }
+    if (capture == DESIRED_VISIBLE || taskbar != DESIRED_UNCHANGED) {
+        QueueReconcile(hwnd, eventAt);
+    } else {
+        RecordReconcileLag(eventAt);
+    }
+}
+
+/**
+ * Internal: Apply one drained hook event to the caches, the registry and
+ * the spatial index, then give the recreate, profile, auto-protect and
+ * reconcile paths their look at shown windows. Runs under g_eventLock,
+ * in event order, on whichever thread drains.
+ */
+static void ProcessWindowEvent(const WindowEvent* e) {
+    HWND hwnd = e->hwnd;
+    DWORD event = e->event;
+
+    if (event == EVENT_OBJECT_DESTROY) {
+        RememberDestroyedWindow(hwnd, e->stamp);
+        if (g_registryActive) {
+            UnregisterWindow(hwnd);
+        }
+        if (g_tokenHighWater > 0) {
+            InvalidateWindowToken(hwnd);
+        }
+        if (SpatialKept()) {
+            SpatialRemove(hwnd);
+        }
+    } else if (event == EVENT_OBJECT_LOCATIONCHANGE) {
+        if (SpatialKept()) {
+            TrackMove(hwnd);
+        }
+    } else if (event == EVENT_OBJECT_NAMECHANGE || event == EVENT_OBJECT_PARENTCHANGE) {
+        if (event == EVENT_OBJECT_NAMECHANGE) {
+            RefreshTitle(hwnd);
+            RefreshTrackedSignature(hwnd);
+        } else {
+            // Reparented to the desktop: now a top-level window
+            if (g_registryActive) {
+                RegisterWindow(hwnd);
+            }
+            if (SpatialKept()) {
+                SpatialUpdate(hwnd);
+            }
+        }
+        ForgetRejection(hwnd);
+    } else if (event == EVENT_OBJECT_CREATE || event == EVENT_OBJECT_SHOW) {
+        RefreshTitle(hwnd);
+        if (event == EVENT_OBJECT_CREATE && g_registryActive) {
+            RegisterWindow(hwnd);
+        }
+        if (SpatialKept()) {
+            SpatialUpdate(hwnd);
+        }
+        if (event == EVENT_OBJECT_SHOW) {
+            ForgetRejection(hwnd);
+        }
+
+        // Titles are often set after creation, so look again when shown
+        BOOL protectedNow = RehideRecreatedWindow(hwnd) || ProtectProfiledWindow(hwnd);
+        if (event == EVENT_OBJECT_SHOW) {
+            if (!protectedNow) {
+                AutoProtectWindow(hwnd);
+            }
+            ReconcileShownWindow(hwnd, e->eventAt);
+        }
+    }
+}
+
+/**
+ * Internal: Rebuild what the hook events keep after the queue overflowed
+ * and events were dropped. Destroy stamps are exact regardless, since the
+ * hook moves them itself. Runs under g_eventLock once the queue is empty.
+ */
+static void ResyncWindowEvents() {
+    // A dropped name change may have left a stale rejection or title
+    InterlockedIncrement(&g_rejectGeneration);
+    AcquireSRWLockExclusive(&g_titleLock);
+    for (DWORD i = 0; i < TITLE_CACHE_SLOTS; i++) {
+        g_titleCache[i].version = (g_titleCache[i].version + 1) & MAXLONG;
+        g_titleCache[i].hwnd = NULL;
+    }
+    ReleaseSRWLockExclusive(&g_titleLock);
+
+    // Dropped destroys: retire the dead windows' tokens
+    for (LONG i = 0; i < g_tokenHighWater; i++) {
+        HWND hwnd = g_tokens[i].hwnd;
+        if (hwnd != NULL && !IsWindow(hwnd)) {
+            InvalidateWindowToken(hwnd);
+        }
+    }
+
+    // Dropped creates and destroys: the seeding pass merges duplicates
+    if (g_registryActive) {
+        AcquireSRWLockExclusive(&g_registryLock);
+        for (DWORD i = 0; i < g_registryCount;) {
+            if (!IsWindow(g_registry[i])) {
+                g_registry[i] = g_registry[--g_registryCount];
+            } else {
+                i++;
+            }
+        }
+        ReleaseSRWLockExclusive(&g_registryLock);
+        EnumWindows(SeedRegistryCallback, (LPARAM)GetCurrentProcessId());
+    }
+
+    if (SpatialKept()) {
+        // Dead windows out, then every live one re-checked as if it had
+        // moved, so a window that entered the last region is still hidden
+        for (DWORD i = 0; i < g_spatialHighWater; i++) {
+            HWND hwnd = g_spatial[i].hwnd;
+            if (hwnd != NULL && !IsWindow(hwnd)) {
+                SpatialRemove(hwnd);
+            } else if (hwnd != NULL) {
+                TrackMove(hwnd);
+            }
+        }
+        EnumWindows(SeedSpatialCallback, (LPARAM)GetCurrentProcessId());
+        FlushMoves(0);
+    }
+
+    // Dropped shows: one full reconcile pass, then the startup pass
+    InterlockedExchange(&g_reconcileOverflow, 1);
+    ScheduleReconcile();
+    EnumWindows(StartupEnumCallback, (LPARAM)GetCurrentProcessId());
+}
+
+/**
+ * Internal: Apply every hook event queued so far, oldest first. Called by
+ * the hook owner when woken, at the top of each export that reads what
+ * the events keep, and by the timer callbacks, so the caches reflect
+ * every event raised before the call. Never called with a lock held. An
+ * empty queue costs two reads and no lock.
+ */
+static void DrainWindowEvents() {
+    if (!EventsActive()) {
+        return;
+    }
+    LONG head = g_eventHead;
+    if (g_events[(DWORD)head & (EVENT_QUEUE_CAPACITY - 1)].sequence != head + 1 && !g_eventOverflow) {
+        return;
+    }
+
+    AcquireSRWLockExclusive(&g_eventLock);
+    for (;;) {
+        head = g_eventHead;
+        WindowEvent* cell = &g_events[(DWORD)head & (EVENT_QUEUE_CAPACITY - 1)];
+        if (cell->sequence != head + 1) {
+            break;
+        }
+
+        // The cell stays claimed until the event is applied, so a drain
+        // that finds the queue empty never overtakes this one
+        WindowEvent e = *cell;
+        ProcessWindowEvent(&e);
+        InterlockedExchange(&cell->sequence, head + EVENT_QUEUE_CAPACITY);
+        g_eventHead = head + 1;
+    }
+    if (InterlockedExchange(&g_eventOverflow, 0) != 0) {
+        ResyncWindowEvents();
+    }
+    ReleaseSRWLockExclusive(&g_eventLock);
+}
+
+/**
+ * Internal: Add the move hook and seed the spatial index, when a region
+ * query asked for it. Runs on the thread owning the hooks.
+ */
+static void ServiceLocationRequest() {
+    if (InterlockedExchange(&g_locationWanted, 0) == 0 || g_locationHook != NULL) {
+        return;
+    }
+
+    g_locationHook = SetWinEventHook(EVENT_OBJECT_LOCATIONCHANGE, EVENT_OBJECT_LOCATIONCHANGE, g_module,
+                                     WinEventCallback, GetCurrentProcessId(), 0, WINEVENT_INCONTEXT);
+    if (g_locationHook == NULL) {
+        // Bounds would go stale
+        InterlockedExchange(&g_spatialState, SPATIAL_UNUSABLE);
+        return;
+    }
+
+    // The hooks are live before the seeding pass, so no window is lost;
+    // SpatialUpdate merges the duplicates
+    EnumWindows(SeedSpatialCallback, (LPARAM)GetCurrentProcessId());
+    InterlockedCompareExchange(&g_spatialState, SPATIAL_READY, SPATIAL_SEEDING);
+}
+
+/**
+ * Internal: Remove every hook. Called on the thread that installed them,
+ * since no other thread can. Events stop first, so from here on stamps
+ * fall back to IsWindow and the caches, registry and spatial index are
+ * bypassed.
+ */
+static void RemoveEventHooks() {
+    InterlockedExchange(&g_eventsState, EVENTS_STOPPED);
+    HWINEVENTHOOK hooks[3] = { g_eventHook, g_changeHook, g_locationHook };
+    g_eventHook = NULL;
+    g_changeHook = NULL;
+    g_locationHook = NULL;
+    for (DWORD i = 0; i < 3; i++) {
+        if (hooks[i] != NULL) {
+            UnhookWinEvent(hooks[i]);
+        }
+    }
+}
+
+/**
+ * Internal: Install the create/show and change hooks on the calling
+ * thread, which from then on owns them, and mark events active.
+ *
+ * @return TRUE if both hooks are in
+ */
+static BOOL InstallEventHooks() {
+    // EVENT_OBJECT_CREATE, EVENT_OBJECT_DESTROY and EVENT_OBJECT_SHOW are consecutive
+    g_eventHook = SetWinEventHook(EVENT_OBJECT_CREATE, EVENT_OBJECT_SHOW, g_module,
+                                  WinEventCallback, GetCurrentProcessId(), 0, WINEVENT_INCONTEXT);
+    if (g_eventHook != NULL) {
+        // Name through parent changes; the description and value changes in
+        // between come from controls and are dropped by the WS_CHILD check
+        g_changeHook = SetWinEventHook(EVENT_OBJECT_NAMECHANGE, EVENT_OBJECT_PARENTCHANGE, g_module,
+                                       WinEventCallback, GetCurrentProcessId(), 0, WINEVENT_INCONTEXT);
+    }
+    if (g_changeHook == NULL) {
+        return FALSE;
+    }
+    InterlockedCompareExchange(&g_eventsState, EVENTS_ACTIVE, EVENTS_STARTING);
+    return TRUE;
+}
+
+/**
+ * Internal: Thread pool callback owning the WinEvent hooks in threaded
+ * mode. A hook dies with the thread that installed it and can only be
+ * removed from that thread, so the owner installs them, sleeps until a
+ * hook or a request wakes it, drains the queue, and removes them when
+ * events are turned off. It holds no reference on the DLL: DllMain stops
+ * it at unload and waits for g_hooksGone, which the pool sets once this
+ * callback has returned.
+ *
+ * @param context Event set once the first hooks are installed or have failed
+ */
+static VOID CALLBACK HookOwnerCallback(PTP_CALLBACK_INSTANCE instance, PVOID context) {
+    CallbackMayRunLong(instance);
+    SetEventWhenCallbackReturns(instance, g_hooksGone);
+
+    InstallEventHooks();
+    SetEvent((HANDLE)context);
+
+    while (EventsActive()) {
+        WaitForSingleObject(g_eventSignal, INFINITE);
+        InterlockedExchange(&g_eventWake, 0);
+        ServiceLocationRequest();
+        DrainWindowEvents();
+    }
+    RemoveEventHooks();
+}
+
+/**
+ * Internal: Opt in to hook events: start the hook owner and wait until
+ * its hooks are in. In pumped mode the calling thread owns the hooks
+ * instead, and WindowHiderPump drains the queue. Events are turned on at
+ * most once. Never called from DllMain, where the owner could not start.
+ *
+ * @return TRUE if events are on
+ */
+static BOOL EnableWindowEvents() {
+    if (InterlockedCompareExchange(&g_eventsState, EVENTS_STARTING, EVENTS_OFF) != EVENTS_OFF) {
+        // Another caller may still be starting them
+        while (g_eventsState == EVENTS_STARTING) {
+            Sleep(1);
+        }
+        return EventsActive();
+    }
+
+    for (LONG i = 0; i < EVENT_QUEUE_CAPACITY; i++) {
+        g_events[i].sequence = i;
+    }
+
+    if (!UseDllThreads()) {
+        g_eventThreadId = GetCurrentThreadId();
+        if (!InstallEventHooks()) {
+            RemoveEventHooks();
+            return FALSE;
+        }
+        return TRUE;
+    }
+
+    g_eventSignal = CreateEventW(NULL, FALSE, FALSE, NULL);
+    g_hooksGone = CreateEventW(NULL, TRUE, FALSE, NULL);
+    HANDLE ready = CreateEventW(NULL, TRUE, FALSE, NULL);
+    if (g_eventSignal == NULL || g_hooksGone == NULL || ready == NULL ||
+        !TrySubmitThreadpoolCallback(HookOwnerCallback, ready, NULL)) {
+        HANDLE handles[3] = { g_eventSignal, g_hooksGone, ready };
+        g_eventSignal = NULL;
+        g_hooksGone = NULL;
+        for (DWORD i = 0; i < 3; i++) {
+            if (handles[i] != NULL) {
+                CloseHandle(handles[i]);
+            }
+        }
+        InterlockedExchange(&g_eventsState, EVENTS_STOPPED);
+        return FALSE;
+    }
+
+    WaitForSingleObject(ready, INFINITE);
+    CloseHandle(ready);
+    return EventsActive();
+}
+
+/**
+ * Internal: Turn hook events off for good and wait until the hook owner
+ * has removed its hooks and returned. In pumped mode only the thread that
+ * turned events on can remove the hooks.
+ *
+ * @return TRUE if hooks were removed, FALSE if none were installed or
+ *         this thread cannot remove them
+ */
+static BOOL StopWindowEvents() {
+    if (g_eventThreadId != 0) {
+        if (GetCurrentThreadId() != g_eventThreadId || !EventsActive()) {
+            return FALSE;
+        }
+        RemoveEventHooks();
+        return TRUE;
+    }
+
+    if (InterlockedCompareExchange(&g_eventsState, EVENTS_STOPPED, EVENTS_ACTIVE) != EVENTS_ACTIVE) {
+        return FALSE;
+    }
+
+    SetEvent(g_eventSignal);
+    WaitForSingleObject(g_hooksGone, INFINITE);
+    return TRUE;
+}
+
+/**
+ * Internal: Find or create the batch entry for a window.
+ *
+ * @param batch Open batch of the calling thread
+ * @param hwnd Window the change is for
+ * @return Entry for hwnd, or NULL if the arena is full
+ */
+static BatchEntry* BatchEntryFor(UpdateBatch* batch, HWND hwnd) {
+    DWORD slot = HashHwnd(hwnd, BATCH_CAPACITY - 1);
+    for (DWORD probe = 0; probe < BATCH_CAPACITY; probe++) {
+        BatchEntry* entry = &batch->entries[(slot + probe) & (BATCH_CAPACITY - 1)];
+        if (entry->hwnd == hwnd) {
+            if (!IsStampCurrent(hwnd, entry->stamp)) {
+                // Handle reused by a new window: drop the old window's changes
+                memset(entry, 0, sizeof(BatchEntry));
+                entry->hwnd = hwnd;
+                entry->stamp = WindowStamp(hwnd);
+            }
+            return entry;
+        }
+        if (entry->hwnd == NULL) {
+            // Keep the table at most 3/4 full so probes stay short
+            if (batch->count >= BATCH_CAPACITY * 3 / 4) {
+                return NULL;
+            }
+            batch->count++;
+            entry->hwnd = hwnd;
+            entry->stamp = WindowStamp(hwnd);
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Internal: Record a capture change in the calling thread's open batch.
+ *
+ * @return TRUE if recorded, FALSE if there is no open batch or it is full
+ */
+static BOOL BatchCapture(HWND hwnd, BOOL hide) {
+    if (t_batch == NULL) {
+        return FALSE;
+    }
+
+    BatchEntry* entry = BatchEntryFor(t_batch, hwnd);
+    if (entry == NULL) {
+        return FALSE;
+    }
+
+    entry->captureSet = TRUE;
+    entry->captureHide = hide ? TRUE : FALSE;
+    entry->hideSeq = g_hideSeq;
+    return TRUE;
+}
+
+/**
+ * Internal: Record a taskbar change in the calling thread's open batch.
+ *
+ * @return TRUE if recorded, FALSE if there is no open batch or it is full
+ */
+static BOOL BatchTaskbar(HWND hwnd, BOOL hide) {
+    if (t_batch == NULL) {
+        return FALSE;
+    }
+
+    BatchEntry* entry = BatchEntryFor(t_batch, hwnd);
+    if (entry == NULL) {
+        return FALSE;
+    }
+
+    entry->taskbarSet = TRUE;
+    entry->taskbarHide = hide ? TRUE : FALSE;
+    return TRUE;
+}
+
+/**
+ * Internal: Return a batch arena to the pool.
+ *
+ * @param batch Arena previously handed out by BeginWindowHiderUpdate
+ */
+static void ReleaseBatch(UpdateBatch* batch) {
+    memset(batch->entries, 0, sizeof(batch->entries));
+    batch->count = 0;
+    batch->depth = 0;
+    InterlockedExchange(&batch->inUse, 0);
+}
+
+/**
+ * Internal: SetWindowVisibility for a window already validated.
+ *
+ * @return TRUE, FALSE or VISIBILITY_PENDING, as SetWindowVisibility
+ */
+static BOOL SetWindowVisibilityInternal(HWND hwnd, BOOL hide) {
+    if (BatchCapture(hwnd, hide)) {
+        return VISIBILITY_PENDING;
+    }
+
+    if (hide) {
+        LONGLONG requestedAt = QpcNow();
+        BeginHide(hwnd);
+        return ApplyHide(hwnd, requestedAt);
+    }
+
+    // Left for the pump or another draining thread
+    if (!QueueShow(hwnd)) {
+        return VISIBILITY_PENDING;
+    }
+
+    // Applied here: report whether the window is capturable again, as the
+    // plain SetWindowDisplayAffinity call used to
+    DWORD current;
+    return GetWindowDisplayAffinity(hwnd, &current) && current == WDA_NONE;
+}
+
+/**
+ * Internal: HideFromTaskbar for a window already validated.
+ */
+static BOOL HideFromTaskbarInternal(HWND hwnd, BOOL hide) {
+    if (BatchTaskbar(hwnd, hide)) {
+        return TRUE;
+    }
+
+    return ApplyTaskbarStyle(hwnd, hide);
+}
+
+/**
+ * Set window display affinity to hide from screen capture.
+ * The window remains visible to the user but is excluded from screenshots and screen sharing.
+ *
+ * Hides are applied before returning. Shows are queued and may be dropped if
+ * a hide for the same window follows. Outside pumped mode the queue is
+ * drained before returning and TRUE means the window is capturable again.
+ * In pumped mode, or while another thread drains the queue, the show is
+ * left queued and VISIBILITY_PENDING is returned. Inside
+ * BeginWindowHiderUpdate/CommitWindowHiderUpdate the change is only
+ * recorded, applied on commit, and VISIBILITY_PENDING is returned too.
+ *
+ * @param hwnd Window handle to modify
+ * @param hide TRUE to hide from capture, FALSE to show normally
+ * @return TRUE once applied, VISIBILITY_PENDING if accepted but not applied
+ *         yet, FALSE on failure or if hwnd is not a window
+ */
+extern "C" __declspec(dllexport) BOOL __stdcall SetWindowVisibility(HWND hwnd, BOOL hide) {
+    // Validate window handle
+    if (hwnd == NULL || !IsWindow(hwnd)) {
+        return FALSE;
+    }
+
+    DrainWindowEvents();
+    return SetWindowVisibilityInternal(hwnd, hide);
+}
+
+/**
+ * Hide all windows of the current process from screen capture.
+ * Windows remain visible to the user but are excluded from screenshots and screen sharing.
+ * Only processes valid application windows (visible, top-level, with title).
+ */
+extern "C" __declspec(dllexport) void __stdcall HideAllWindows() {
+    DrainWindowEvents();
+    HideAllWindowsInternal();
+}
+
+/**
+ * Hide all windows of the current process, spending at most roughly
+ * budgetMicros per call. Windows are protected most exposed first; when the
+ * budget runs out the sweep stops and *continuation receives a token that
+ * resumes it on the next call. Pass *continuation = NULL to start a sweep.
+ * An unknown or recycled token starts a fresh sweep, which is always safe.
+ *
+ * The first slice also pays for enumerating the windows. Each slice always
+ * protects at least one window, so a sweep cannot stall on a tiny budget.
+ *
+ * @param budgetMicros Time budget for this call in microseconds
+ * @param continuation In: NULL or a token from a previous call. Out: token to
+ *        resume with, or NULL when the sweep finished
+ * @return TRUE when every window is protected, FALSE if more work remains
+ */
+extern "C" __declspec(dllexport) BOOL __stdcall HideAllWindowsWithin(DWORD budgetMicros, HANDLE* continuation) {
+    if (continuation == NULL) {
+        return FALSE;
+    }
+
+    DrainWindowEvents();
+    LONGLONG start = QpcNow();
+
+    AcquireSRWLockExclusive(&g_sweepLock);
+
+    DWORD slot;
+    HideSweep* sweep = *continuation != NULL ? SweepFromToken(*continuation) : NULL;
+    if (sweep == NULL) {
+        slot = AcquireSweepSlot();
+        sweep = &g_sweepSlots[slot];
+        StartSweep(sweep);
+    } else {
+        slot = (DWORD)(sweep - g_sweepSlots);
+    }
+
+    BOOL finished = RunSweep(sweep, start + MicrosToQpc(budgetMicros));
+    *continuation = finished ? NULL : SweepToken(slot);
+
+    ReleaseSRWLockExclusive(&g_sweepLock);
+
+    DWORD elapsed = QpcToMicros(QpcNow() - start);
+    DWORD overshoot = elapsed > budgetMicros ? elapsed - budgetMicros : 0;
+    StatsIncrement(&g_stats.sweepSlices);
+    g_stats.lastSliceOvershootMicros = overshoot;
+    StatsMax(&g_stats.maxSliceOvershootMicros, overshoot);
+
+    return finished;
+}
+
+/**
+ * Switch to host-pumped mode, for hosts that cannot tolerate extra DLL
+ * threads. The DLL then never starts a thread, timer or thread pool
+ * callback: shows are applied by WindowHiderPump instead of inside
+ * ShowAllWindows/SetWindowVisibility, and the verifier, the reconciler's
+ * queue, moves left pending after a drag and hook events all run there.
+ *
+ * The mode is chosen once. Call this before the first hide, before
+ * SetWindowHiderEvents, and without WINDOWHIDER_PROFILE or
+ * WINDOWHIDER_AUTOPROTECT set; each of those may start a thread or timer,
+ * which settles on threaded mode.
+ *
+ * @return TRUE if pumped mode is on, FALSE if the DLL already runs threads or timers
+ */
+extern "C" __declspec(dllexport) BOOL __stdcall EnableWindowHiderPump() {
+    InterlockedCompareExchange(&g_pumpMode, PUMP_ON, PUMP_UNDECIDED);
+    return HostPumped();
+}
+
+/**
+ * Run deferred work inside the host's idle time, in pumped mode (see
+ * EnableWindowHiderPump). Queued hook events go first, then pending
+ * window moves, then shown windows waiting for the reconciler, then
+ * queued shows, then drift verification. Nothing starts once
+ * budgetMicros is spent. Hides never wait for the pump. Called on the
+ * thread that turned hook events on, it also adds the move hook a region
+ * call asked for.
+ *
+ * @param budgetMicros Time budget for this call in microseconds
+ * @return TRUE if deferred work remains, FALSE if everything is done or
+ *         the DLL is not in pumped mode
+ */
+extern "C" __declspec(dllexport) BOOL __stdcall WindowHiderPump(DWORD budgetMicros) {
+    LONGLONG start = QpcNow();
+    LONGLONG deadline = start + MicrosToQpc(budgetMicros);
+    LONGLONG now;
+    BOOL pending = FALSE;
+
+    if (!HostPumped()) {
+        return FALSE;
+    }
+
+    // Events can hide windows and feed every later step
+    if (g_eventThreadId == GetCurrentThreadId()) {
+        ServiceLocationRequest();
+    }
+    DrainWindowEvents();
+
+    // Moves can hide windows, so they go before shows
+    now = QpcNow();
+    if (g_movePendingCount > 0 && now < deadline &&
+        now - InterlockedCompareExchange64(&g_lastMoveFlush, 0, 0) >= MicrosToQpc(MOVE_FLUSH_INTERVAL_MS * 1000)) {
+        LONGLONG moveDeadline = now + MicrosToQpc(MOVE_FLUSH_BUDGET_MICROS);
+        FlushMoves(moveDeadline < deadline ? moveDeadline : deadline);
+    }
+    pending = g_movePendingCount > 0;
+
+    // Reconciles can queue shows, so they go before the show drain
+    if (QpcNow() < deadline) {
+        pending = !DrainReconcileQueue(deadline) || pending;
+    } else {
+        pending = pending || g_reconcileCount > 0 || g_reconcileOverflow;
+    }
+
+    if (!pending && QpcNow() < deadline) {
+        pending = !DrainShowQueue(deadline);
+    } else {
+        AcquireSRWLockShared(&g_queueLock);
+        pending = pending || g_showCount > 0;
+        ReleaseSRWLockShared(&g_queueLock);
+    }
+
+    // Verification keeps the timer's cadence and budget
+    now = QpcNow();
+    if (g_trackedCount > 0 && now < deadline && now - g_lastVerify >= MicrosToQpc(VERIFY_INTERVAL_MS * 1000)) {
+        LONGLONG verifyDeadline = now + MicrosToQpc(VERIFY_TICK_BUDGET_MICROS);
+        VerifyTick(verifyDeadline < deadline ? verifyDeadline : deadline);
+    }
+
+    DWORD elapsed = QpcToMicros(QpcNow() - start);
+    StatsIncrement(&g_stats.pumpCalls);
+    StatsMax(&g_stats.maxPumpOvershootMicros, elapsed > budgetMicros ? elapsed - budgetMicros : 0);
+
+    return pending;
+}
+
+/**
+ * Show all windows of the current process normally.
+ * Restores windows to be visible in screenshots and screen sharing.
+ * The show is queued behind any pending work and cancelled by a later hide.
+ */
+extern "C" __declspec(dllexport) void __stdcall ShowAllWindows() {
+    DrainWindowEvents();
+
+    // Sharing stopped: windows moving into the last region stay visible
+    AcquireSRWLockExclusive(&g_spatialLock);
+    g_scopeActive = FALSE;
+    ReleaseSRWLockExclusive(&g_spatialLock);
+
+    QueueShow(NULL);
+}
+
+/**
+ * Hide or show a window from the taskbar.
+ * Note: This completely hides/shows the taskbar icon, not just from capture.
+ * Inside BeginWindowHiderUpdate/CommitWindowHiderUpdate the change is only
+ * recorded and applied on commit.
+ *
+ * @param hwnd Window handle to modify
+ * @param hide TRUE to hide from taskbar, FALSE to show in taskbar
+ * @return TRUE on success, FALSE on failure
+ */
+extern "C" __declspec(dllexport) BOOL __stdcall HideFromTaskbar(HWND hwnd, BOOL hide) {
+    // Validate window handle
+    if (hwnd == NULL || !IsWindow(hwnd)) {
+        return FALSE;
+    }
+
+    DrainWindowEvents();
+    return HideFromTaskbarInternal(hwnd, hide);
+}
+
+/**
+ * EnumWindows callback collecting the windows CloakWindows changes when
+ * given no list: those of this process passing the HideAllWindows filter.
+ */
+static BOOL CALLBACK CloakEnumCallback(HWND hwnd, LPARAM lParam) {
+    DWORD pid = 0;
+    GetWindowThreadProcessId(hwnd, &pid);
+    if (pid == GetCurrentProcessId() && IsValidAppWindow(hwnd)) {
+        return AppendHwnd((HwndList*)lParam, hwnd);
+    }
+    return TRUE;
+}
+
+/**
+ * Hide windows from screen capture and the taskbar in one call, or with
+ * CLOAK_REVEAL show them again. Capture changes behave as with
+ * SetWindowVisibility. Taskbar changes swap every window's style first
+ * and then refresh all the frames in one DeferWindowPos batch, so the
+ * taskbar updates at once and each window repaints once; windows already
+ * in the requested state are not touched. With CLOAK_TASKBAR_LIST the
+ * taskbar buttons are removed through ITaskbarList instead, with no style
+ * change or repaint. Inside BeginWindowHiderUpdate/CommitWindowHiderUpdate
+ * both changes are recorded and applied on commit (CLOAK_TASKBAR_LIST
+ * excepted, which applies at once).
+ *
+ * @param windows Windows to change, or NULL for every window passing the
+ *        HideAllWindows filter, found in a single enumeration
+ * @param count Number of windows, ignored when windows is NULL
+ * @param flags CLOAK_* flags; at least one of CLOAK_CAPTURE and CLOAK_TASKBAR
+ * @return TRUE on success, FALSE if flags select nothing, a window is invalid, or a change failed
+ */
+extern "C" __declspec(dllexport) BOOL __stdcall CloakWindows(const HWND* windows, DWORD count, DWORD flags) {
+    if ((flags & (CLOAK_CAPTURE | CLOAK_TASKBAR)) == 0) {
+        return FALSE;
+    }
+
+    DrainWindowEvents();
+    BOOL hide = (flags & CLOAK_REVEAL) == 0;
+    BOOL result = TRUE;
+    HwndList targets;
+    InitHwndList(&targets);
+
+    if (windows == NULL) {
+        EnumProcessWindows(CloakEnumCallback, (LPARAM)&targets);
+    } else {
+        for (DWORD i = 0; i < count; i++) {
+            if (windows[i] == NULL || !IsWindow(windows[i])) {
+                result = FALSE;
+            } else {
+                AppendHwnd(&targets, windows[i]);
+            }
+        }
+    }
+    if (targets.failed) {
+        result = FALSE;
+    }
+
+    // Capture first: when hiding, the window leaves the capture before the taskbar repaint
+    if (flags & CLOAK_CAPTURE) {
+        for (DWORD i = 0; i < targets.count; i++) {
+            result &= SetWindowVisibilityInternal(targets.items[i], hide) != FALSE;
+        }
+    }
+
+    if (flags & CLOAK_TASKBAR) {
+        if (flags & CLOAK_TASKBAR_LIST) {
+            result &= ApplyTaskbarTabs(targets.items, targets.count, hide);
+        } else if (t_batch != NULL) {
+            for (DWORD i = 0; i < targets.count; i++) {
+                result &= HideFromTaskbarInternal(targets.items[i], hide);
+            }
+        } else {
+            result &= ApplyTaskbarStyles(targets.items, targets.count, hide);
+        }
+    }
+
+    StatsIncrement(&g_stats.cloakCalls);
+    FreeHwndList(&targets);
+    return result;
+}
+
+/**
+ * Register a top-level window and get a compact token for it. Token
+ * calls index a slot array instead of validating the HWND with IsWindow;
+ * the token is retired when the window is destroyed. Registering a
+ * window twice returns the same token.
+ *
+ * @param hwnd Top-level window handle
+ * @return Token, or 0 if hwnd is invalid, a child window, or all slots are in use
+ */
+extern "C" __declspec(dllexport) DWORD __stdcall RegisterWindowHiderWindow(HWND hwnd) {
+    // Destroy notifications only cover top-level windows
+    if (hwnd == NULL || !IsWindow(hwnd) || (GetWindowLongPtr(hwnd, GWL_STYLE) & WS_CHILD)) {
+        return 0;
+    }
+
+    DrainWindowEvents();
+
+    DWORD token = 0;
+    AcquireSRWLockExclusive(&g_tokenLock);
+    WORD* link = TokenLinkLocked(hwnd);
+    if (*link != 0) {
+        DWORD index = *link - 1;
+        token = ((DWORD)g_tokens[index].generation << 16) | (index + 1);
+    } else {
+        DWORD index = TOKEN_CAPACITY;
+        if (g_tokenFree != 0) {
+            index = g_tokenFree - 1;
+            g_tokenFree = g_tokens[index].nextHash;
+        } else if (g_tokenHighWater < TOKEN_CAPACITY) {
+            index = (DWORD)g_tokenHighWater;
+            InterlockedIncrement(&g_tokenHighWater);
+        }
+
+        if (index < TOKEN_CAPACITY) {
+            // link points at the end of the window's chain
+            g_tokens[index].hwnd = hwnd;
+            g_tokens[index].nextHash = 0;
+            *link = (WORD)(index + 1);
+            token = ((DWORD)g_tokens[index].generation << 16) | (index + 1);
+            StatsIncrement(&g_stats.tokenCount);
+        }
+    }
+    ReleaseSRWLockExclusive(&g_tokenLock);
+
+    return token;
+}
+
+/**
+ * Release a window token. Tokens of destroyed windows are already
+ * released.
+ *
+ * @param token Token from RegisterWindowHiderWindow
+ * @return TRUE if the token was released, FALSE if it was unknown or already retired
+ */
+extern "C" __declspec(dllexport) BOOL __stdcall UnregisterWindowHiderWindow(DWORD token) {
+    DWORD index = (token & 0xFFFF) - 1;
+    if (index >= TOKEN_CAPACITY) {
+        return FALSE;
+    }
+
+    BOOL released = FALSE;
+    AcquireSRWLockExclusive(&g_tokenLock);
+    if (g_tokens[index].hwnd != NULL && g_tokens[index].generation == (WORD)(token >> 16)) {
+        FreeTokenSlotLocked(TokenLinkLocked(g_tokens[index].hwnd));
+        released = TRUE;
+    }
+    ReleaseSRWLockExclusive(&g_tokenLock);
+
+    return released;
+}
+
+/**
+ * SetWindowVisibility for a registered window.
+ *
+ * @param token Token from RegisterWindowHiderWindow
+ * @param hide TRUE to hide from capture, FALSE to show normally
+ * @return As SetWindowVisibility; FALSE also if the token is retired
+ */
+extern "C" __declspec(dllexport) BOOL __stdcall SetWindowVisibilityByToken(DWORD token, BOOL hide) {
+    HWND hwnd = TokenWindow(token);
+    if (hwnd == NULL) {
+        return FALSE;
+    }
+    return SetWindowVisibilityInternal(hwnd, hide);
+}
 
 /**
- * Check if window is a valid application window that should be processed.
- * Filters out child windows, tool windows, and windows without titles.
+ * HideFromTaskbar for a registered window.
  *
- * @param hwnd Window handle to check
- * @return TRUE if window should be processed, FALSE otherwise
+ * @param token Token from RegisterWindowHiderWindow
+ * @param hide TRUE to hide from taskbar, FALSE to show in taskbar
+ * @return TRUE on success, FALSE if the token is retired or on failure
  */
-static BOOL IsValidAppWindow(HWND hwnd) {
-    // Check if window handle is valid
-    if (!IsWindow(hwnd)) {
+extern "C" __declspec(dllexport) BOOL __stdcall HideFromTaskbarByToken(DWORD token, BOOL hide) {
+    HWND hwnd = TokenWindow(token);
+    if (hwnd == NULL) {
         return FALSE;
     }
+    return HideFromTaskbarInternal(hwnd, hide);
+}
 
-    // Must be visible
-    if (!IsWindowVisible(hwnd)) {
+/**
+ * Internal: Resolve a group id. Caller holds g_groupLock.
+ *
+ * @return The group, or NULL if the id is unknown or deleted
+ */
+static WindowGroup* GroupFromIdLocked(DWORD group) {
+    DWORD index = (group & 0xFFFF) - 1;
+    if (index >= GROUP_CAPACITY || g_groups[index].name[0] == L'\0' ||
+        g_groups[index].generation != (WORD)(group >> 16)) {
+        return NULL;
+    }
+    return &g_groups[index];
+}
+
+/**
+ * Internal: Drop destroyed members, keeping the array dense. Caller holds
+ * g_groupLock exclusively.
+ */
+static void CompactGroupLocked(WindowGroup* group) {
+    DWORD kept = 0;
+    for (DWORD i = 0; i < group->count; i++) {
+        if (!IsStampCurrent(group->members[i].hwnd, group->members[i].stamp)) {
+            StatsIncrement(&g_stats.groupMembersPruned);
+            continue;
+        }
+        group->members[kept++] = group->members[i];
+    }
+    group->count = kept;
+}
+
+/**
+ * Create a named window group, or return the existing group of that name.
+ *
+ * @param name Group name, 1 to 63 characters
+ * @return Group id, or 0 if name is invalid or all group slots are in use
+ */
+extern "C" __declspec(dllexport) DWORD __stdcall CreateWindowHiderGroup(LPCWSTR name) {
+    if (name == NULL || name[0] == L'\0' || lstrlenW(name) >= GROUP_NAME_CHARS) {
+        return 0;
+    }
+
+    DWORD id = 0;
+    AcquireSRWLockExclusive(&g_groupLock);
+    DWORD freeSlot = GROUP_CAPACITY;
+    for (DWORD i = 0; i < GROUP_CAPACITY && id == 0; i++) {
+        if (g_groups[i].name[0] == L'\0') {
+            if (freeSlot == GROUP_CAPACITY) {
+                freeSlot = i;
+            }
+        } else if (lstrcmpW(g_groups[i].name, name) == 0) {
+            id = ((DWORD)g_groups[i].generation << 16) | (i + 1);
+        }
+    }
+
+    if (id == 0 && freeSlot < GROUP_CAPACITY) {
+        lstrcpynW(g_groups[freeSlot].name, name, GROUP_NAME_CHARS);
+        g_groups[freeSlot].count = 0;
+        id = ((DWORD)g_groups[freeSlot].generation << 16) | (freeSlot + 1);
+    }
+    ReleaseSRWLockExclusive(&g_groupLock);
+
+    return id;
+}
+
+/**
+ * Delete a window group. Its members keep their current state.
+ *
+ * @param group Group id from CreateWindowHiderGroup
+ * @return TRUE on success, FALSE if the group is unknown
+ */
+extern "C" __declspec(dllexport) BOOL __stdcall DeleteWindowHiderGroup(DWORD group) {
+    AcquireSRWLockExclusive(&g_groupLock);
+    WindowGroup* target = GroupFromIdLocked(group);
+    if (target != NULL) {
+        // The member array stays allocated for the slot's next group
+        target->name[0] = L'\0';
+        target->generation++;
+        target->count = 0;
+    }
+    ReleaseSRWLockExclusive(&g_groupLock);
+
+    return target != NULL;
+}
+
+/**
+ * Add a window to a group. Adding a member twice has no effect. Dead
+ * members are left for the next toggle to compact, so building a large
+ * group stays linear per add.
+ *
+ * @param group Group id from CreateWindowHiderGroup
+ * @param hwnd Window handle
+ * @return TRUE on success, FALSE if the group or window is invalid or out of memory
+ */
+extern "C" __declspec(dllexport) BOOL __stdcall AddWindowHiderGroupMember(DWORD group, HWND hwnd) {
+    if (hwnd == NULL || !IsWindow(hwnd)) {
         return FALSE;
     }
 
-    // Must be a top-level window (no parent, or parent is desktop)
-    HWND parent = GetParent(hwnd);
-    if (parent != NULL && parent != GetDesktopWindow()) {
+    DrainWindowEvents();
+
+    BOOL added = FALSE;
+    AcquireSRWLockExclusive(&g_groupLock);
+    WindowGroup* target = GroupFromIdLocked(group);
+    if (target != NULL) {
+        DWORD existing = 0;
+        while (existing < target->count && target->members[existing].hwnd != hwnd) {
+            existing++;
+        }
+
+        added = TRUE;
+        if (existing < target->count) {
+            // A dead member whose handle was reused names this window now
+            target->members[existing].stamp = WindowStamp(hwnd);
+        } else if (target->count == target->capacity) {
+            DWORD capacity = target->capacity ? target->capacity * 2 : 16;
+            void* members = ReallocMemory(target->members, capacity * sizeof(GroupMember));
+            if (members == NULL) {
+                added = FALSE;
+            } else {
+                target->members = (GroupMember*)members;
+                target->capacity = capacity;
+            }
+        }
+        if (added && existing == target->count) {
+            target->members[target->count].hwnd = hwnd;
+            target->members[target->count].stamp = WindowStamp(hwnd);
+            target->count++;
+        }
+    }
+    ReleaseSRWLockExclusive(&g_groupLock);
+
+    return added;
+}
+
+/**
+ * Remove a window from a group. Its current state is kept.
+ *
+ * @param group Group id from CreateWindowHiderGroup
+ * @param hwnd Member to remove
+ * @return TRUE if it was a member, FALSE otherwise
+ */
+extern "C" __declspec(dllexport) BOOL __stdcall RemoveWindowHiderGroupMember(DWORD group, HWND hwnd) {
+    BOOL removed = FALSE;
+    AcquireSRWLockExclusive(&g_groupLock);
+    WindowGroup* target = GroupFromIdLocked(group);
+    if (target != NULL) {
+        for (DWORD i = 0; i < target->count; i++) {
+            if (target->members[i].hwnd == hwnd) {
+                target->members[i] = target->members[--target->count];
+                removed = TRUE;
+                break;
+            }
+        }
+    }
+    ReleaseSRWLockExclusive(&g_groupLock);
+
+    return removed;
+}
+
+/**
+ * Hide or show every live member of a group, as SetWindowVisibility would
+ * for each: hides are applied before returning, shows are queued, and
+ * inside BeginWindowHiderUpdate/CommitWindowHiderUpdate the changes are
+ * recorded for the commit. Only the group's members are touched; the
+ * desktop is not enumerated. The members are copied out first, so no
+ * lock is held while they are changed.
+ *
+ * @param group Group id from CreateWindowHiderGroup
+ * @param hide TRUE to hide from capture, FALSE to show normally
+ * @return TRUE on success, FALSE if the group is unknown, out of memory, or a member failed
+ */
+extern "C" __declspec(dllexport) BOOL __stdcall SetWindowHiderGroupVisibility(DWORD group, BOOL hide) {
+    HwndList members;
+    InitHwndList(&members);
+
+    AcquireSRWLockExclusive(&g_groupLock);
+    WindowGroup* target = GroupFromIdLocked(group);
+    if (target != NULL) {
+        CompactGroupLocked(target);
+        for (DWORD i = 0; i < target->count && AppendHwnd(&members, target->members[i].hwnd); i++) {
+        }
+    }
+    ReleaseSRWLockExclusive(&g_groupLock);
+
+    BOOL result = target != NULL && !members.failed;
+    if (result) {
+        for (DWORD i = 0; i < members.count; i++) {
+            result &= SetWindowVisibilityInternal(members.items[i], hide) != FALSE;
+        }
+    }
+    FreeHwndList(&members);
+
+    return result;
+}
+
+/**
+ * Start buffering SetWindowVisibility and HideFromTaskbar calls made on the
+ * calling thread. Calls may nest; the batch is applied by the outermost
+ * CommitWindowHiderUpdate. HideAllWindows and ShowAllWindows are not buffered.
+ *
+ * @return TRUE on success, FALSE if every batch arena is in use
+ */
+extern "C" __declspec(dllexport) BOOL __stdcall BeginWindowHiderUpdate() {
+    DrainWindowEvents();
+    if (t_batch != NULL) {
+        t_batch->depth++;
+        return TRUE;
+    }
+
+    for (int i = 0; i < BATCH_ARENA_COUNT; i++) {
+        if (InterlockedCompareExchange(&g_batchArenas[i].inUse, 1, 0) == 0) {
+            t_batch = &g_batchArenas[i];
+            t_batch->depth = 1;
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+/**
+ * Apply the calling thread's batch in one pass: hides first, then taskbar
+ * changes, then shows. Each window gets only its final requested state.
+ * Shows still go through the show queue, so a HideAllWindows issued while
+ * the batch was open cancels them.
+ *
+ * @return TRUE on success, FALSE if no batch is open
+ */
+extern "C" __declspec(dllexport) BOOL __stdcall CommitWindowHiderUpdate() {
+    UpdateBatch* batch = t_batch;
+    if (batch == NULL) {
         return FALSE;
     }
+    if (--batch->depth > 0) {
+        return TRUE;
+    }
 
-    // Must not be a child window
-    LONG_PTR style = GetWindowLongPtr(hwnd, GWL_STYLE);
-    if (style & WS_CHILD) {
+    // Detach first so the apply calls below do not record into the batch
+    t_batch = NULL;
+
+    LONGLONG requestedAt = QpcNow();
+    for (DWORD i = 0; i < BATCH_CAPACITY; i++) {
+        BatchEntry* entry = &batch->entries[i];
+        if (entry->hwnd != NULL && entry->captureSet && entry->captureHide && IsStampCurrent(entry->hwnd, entry->stamp)) {
+            BeginHide(entry->hwnd);
+            ApplyHide(entry->hwnd, requestedAt);
+        }
+    }
+
+    // Taskbar changes are grouped so each direction refreshes its frames in one batch
+    HwndList taskbarHides;
+    HwndList taskbarShows;
+    InitHwndList(&taskbarHides);
+    InitHwndList(&taskbarShows);
+    for (DWORD i = 0; i < BATCH_CAPACITY; i++) {
+        BatchEntry* entry = &batch->entries[i];
+        if (entry->hwnd != NULL && entry->taskbarSet && IsStampCurrent(entry->hwnd, entry->stamp) &&
+            !AppendHwnd(entry->taskbarHide ? &taskbarHides : &taskbarShows, entry->hwnd)) {
+            ApplyTaskbarStyle(entry->hwnd, entry->taskbarHide);
+        }
+    }
+    ApplyTaskbarStyles(taskbarHides.items, taskbarHides.count, TRUE);
+    ApplyTaskbarStyles(taskbarShows.items, taskbarShows.count, FALSE);
+    FreeHwndList(&taskbarHides);
+    FreeHwndList(&taskbarShows);
+
+    for (DWORD i = 0; i < BATCH_CAPACITY; i++) {
+        BatchEntry* entry = &batch->entries[i];
+        if (entry->hwnd != NULL && entry->captureSet && !entry->captureHide) {
+            ShowOp op;
+            op.hwnd = entry->hwnd;
+            op.stamp = entry->stamp;
+            op.hideSeq = entry->hideSeq;
+            op.progress = 0;
+            EnqueueShow(&op);
+        }
+    }
+
+    ReleaseBatch(batch);
+    if (!HostPumped()) {
+        DrainShowQueue(0);
+    }
+    return TRUE;
+}
+
+/**
+ * Discard the calling thread's batch, including any nested levels.
+ */
+extern "C" __declspec(dllexport) void __stdcall AbortWindowHiderUpdate() {
+    UpdateBatch* batch = t_batch;
+    if (batch != NULL) {
+        t_batch = NULL;
+        ReleaseBatch(batch);
+    }
+}
+
+/**
+ * Tell the DLL which monitor is being shared, so windows on it are protected
+ * first during a hide sweep. Pass NULL when unknown or when sharing stops.
+ *
+ * @param monitor Monitor being shared, or NULL
+ */
+extern "C" __declspec(dllexport) void __stdcall SetWindowHiderSharedMonitor(HMONITOR monitor) {
+    g_sharedMonitor = monitor;
+}
+
+/**
+ * Region query passed to RectEnumCallback.
+ */
+typedef struct {
+    const RECT* rect;
+    HwndList* list;
+    DWORD examined;
+} RectQuery;
+
+/**
+ * EnumWindows callback for region queries without the spatial index.
+ */
+static BOOL CALLBACK RectEnumCallback(HWND hwnd, LPARAM lParam) {
+    RectQuery* query = (RectQuery*)lParam;
+
+    DWORD pid = 0;
+    RECT bounds;
+    GetWindowThreadProcessId(hwnd, &pid);
+    if (pid == GetCurrentProcessId()) {
+        query->examined++;
+        if (GetWindowRect(hwnd, &bounds) && RectsOverlap(&bounds, query->rect)) {
+            return AppendHwnd(query->list, hwnd);
+        }
+    }
+    return TRUE;
+}
+
+/**
+ * Internal: Hide the windows passing the HideAllWindows filter that
+ * overlap rect. The lookup uses the spatial index when it can, and an
+ * enumeration otherwise. Windows still protected are skipped. rect
+ * becomes the region that windows moving in are hidden for.
+ */
+static BOOL HideWindowsInRectInternal(const RECT* rect) {
+    HwndList found;
+    InitHwndList(&found);
+
+    RectQuery query;
+    query.rect = rect;
+    query.list = &found;
+    query.examined = 0;
+
+    BOOL indexed = ActivateSpatialIndex();
+    if (indexed) {
+        // Bring the bounds up to date; moves applied from now on see the new region
+        FlushMoves(0);
+    }
+
+    AcquireSRWLockExclusive(&g_spatialLock);
+    g_scopeRect = *rect;
+    g_scopeActive = TRUE;
+    indexed = indexed && g_spatialState == SPATIAL_READY;
+    if (indexed) {
+        query.examined = SpatialQueryLocked(rect, &found);
+    }
+    ReleaseSRWLockExclusive(&g_spatialLock);
+    if (!indexed) {
+        EnumProcessWindows(RectEnumCallback, (LPARAM)&query);
+    }
+
+    g_stats.lastSpatialExamined = query.examined;
+
+    BOOL result = !found.failed;
+    LONGLONG requestedAt = QpcNow();
+    for (DWORD i = 0; i < found.count; i++) {
+        HWND hwnd = found.items[i];
+        if (IsValidAppWindow(hwnd) && !IsStillProtected(hwnd)) {
+            BeginHide(hwnd);
+            result &= ApplyHide(hwnd, requestedAt);
+        }
+    }
+    FreeHwndList(&found);
+
+    return result;
+}
+
+/**
+ * Hide the windows of the current process that overlap a monitor, for
+ * when only that monitor is shared; windows elsewhere are left alone.
+ * Uses the same filter as HideAllWindows. Hides are applied before
+ * returning and are not buffered by BeginWindowHiderUpdate. With
+ * SetWindowHiderEvents on, windows moved onto the monitor are hidden too
+ * until ShowAllWindows or the next region call.
+ *
+ * @param monitor Monitor being shared
+ * @return TRUE on success, FALSE if monitor is invalid or a hide failed
+ */
+extern "C" __declspec(dllexport) BOOL __stdcall HideWindowsOnMonitor(HMONITOR monitor) {
+    MONITORINFO info;
+    info.cbSize = sizeof(info);
+    if (monitor == NULL || !GetMonitorInfoW(monitor, &info)) {
         return FALSE;
     }
 
-    // Must not be a tool window (floating toolbars, etc.)
-    LONG_PTR exStyle = GetWindowLongPtr(hwnd, GWL_EXSTYLE);
-    if (exStyle & WS_EX_TOOLWINDOW) {
+    DrainWindowEvents();
+    return HideWindowsInRectInternal(&info.rcMonitor);
+}
+
+/**
+ * Hide the windows of the current process that overlap a screen
+ * rectangle, for when only a region is shared. Otherwise behaves like
+ * HideWindowsOnMonitor.
+ *
+ * @param rect Shared region in screen coordinates
+ * @return TRUE on success, FALSE if rect is NULL or a hide failed
+ */
+extern "C" __declspec(dllexport) BOOL __stdcall HideWindowsInRect(const RECT* rect) {
+    if (rect == NULL) {
         return FALSE;
     }
 
-    // Must have a title (filters out internal/helper windows)
-    WCHAR title[256];
-    int len = GetWindowTextW(hwnd, title, 256);
-    if (len == 0) {
+    DrainWindowEvents();
+    return HideWindowsInRectInternal(rect);
+}
+
+/**
+ * Replace the window filter and auto-protect settings. The new settings
+ * are published as one snapshot: a check already in progress finishes
+ * with the old settings, and later checks see the new ones. Never blocks
+ * threads that are reading the policy. Auto-protect acts on windows as
+ * they are shown, so it needs SetWindowHiderEvents.
+ *
+ * @param policy New settings; policy->cbSize must be set by the caller
+ * @return TRUE on success, FALSE if policy is invalid or out of memory
+ */
+extern "C" __declspec(dllexport) BOOL __stdcall SetWindowHiderPolicy(const WindowHiderPolicy* policy) {
+    if (policy == NULL || policy->cbSize < sizeof(WindowHiderPolicy) || policy->autoProtect > AUTO_PROTECT_CLASS ||
+        (policy->autoProtect == AUTO_PROTECT_CLASS && policy->autoProtectClass == NULL)) {
+        return FALSE;
+    }
+
+    DrainWindowEvents();
+
+    // Keeps the loaded rule set
+    HidePolicy* next = CopyPolicy();
+    if (next == NULL) {
         return FALSE;
     }
+    next->filterFlags = policy->filterFlags;
+    next->autoProtect = (LONG)policy->autoProtect;
+    next->autoProtectClass[0] = 0;
+    if (policy->autoProtectClass != NULL) {
+        lstrcpynW(next->autoProtectClass, policy->autoProtectClass, 256);
+    }
 
+    PublishPolicy(next);
     return TRUE;
 }
 
 /**
- * EnumWindows callback function.
- * Sets display affinity for windows belonging to the target process.
+ * Load a rule file built by compile_policy.py, replacing the current
+ * rules. The file is mapped and used in place; only its header is checked
+ * here. Rules apply wherever the HideAllWindows filter does. Windows
+ * already being filtered finish with the old rules.
  *
- * @param hwnd Current window handle
- * @param lParam Pointer to EnumWindowsContext
- * @return TRUE to continue enumeration, FALSE to stop
+ * @param path Compiled rule file, or NULL to remove the rules
+ * @return TRUE on success, FALSE if the file is missing, invalid, or memory runs out
  */
-static BOOL CALLBACK EnumWindowsCallback(HWND hwnd, LPARAM lParam) {
-    EnumWindowsContext* ctx = (EnumWindowsContext*)lParam;
+extern "C" __declspec(dllexport) BOOL __stdcall LoadWindowHiderRules(LPCWSTR path) {
+    return ReplaceRules(path);
+}
 
-    // Get the process ID of this window
-    DWORD windowPID = 0;
-    GetWindowThreadProcessId(hwnd, &windowPID);
+/**
+ * Declare the capture and taskbar state every window passing the
+ * HideAllWindows filter should have. Existing windows are compared with
+ * it and only the differences applied; after that, each window is
+ * reconciled as it is shown, at O(1) per window, while
+ * SetWindowHiderEvents is on. DESIRED_UNCHANGED (0)
+ * leaves a dimension to the imperative calls. A later imperative call
+ * on an existing window holds until the desired state is set again.
+ *
+ * @param state Desired state; state->cbSize must be set by the caller
+ * @return TRUE on success, FALSE if state is invalid or out of memory
+ */
+extern "C" __declspec(dllexport) BOOL __stdcall SetWindowHiderDesiredState(const WindowHiderDesiredState* state) {
+    if (state == NULL || state->cbSize < sizeof(WindowHiderDesiredState) ||
+        state->capture > DESIRED_VISIBLE || state->taskbar > DESIRED_VISIBLE) {
+        return FALSE;
+    }
 
-    // Only process windows belonging to our target process
-    if (windowPID == ctx->targetPID) {
-        // Check if this is a valid app window we should process
-        if (IsValidAppWindow(hwnd)) {
-            // Set the display affinity
-            SetWindowDisplayAffinity(hwnd, ctx->affinity);
-        }
+    LONGLONG eventAt = QpcNow();
+    DrainWindowEvents();
+
+    HidePolicy* next = CopyPolicy();
+    if (next == NULL) {
+        return FALSE;
     }
+    next->desiredCapture = (LONG)state->capture;
+    next->desiredTaskbar = (LONG)state->taskbar;
+    PublishPolicy(next);
 
-    // Continue enumeration
+    // Full pass: every window's desired state may have changed
+    LONG desired[2] = { (LONG)state->capture, (LONG)state->taskbar };
+    if (desired[0] != DESIRED_UNCHANGED || desired[1] != DESIRED_UNCHANGED) {
+        EnumProcessWindows(ReconcileEnumCallback, (LPARAM)desired);
+        RecordReconcileLag(eventAt);
+    }
     return TRUE;
 }
 
 /**
- * Internal: Set visibility for all windows in current process.
- * Uses EnumWindows for safe and reliable window enumeration.
+ * Choose how HideAllWindows, ShowAllWindows and the desired-state pass
+ * find windows. ENUM_STRATEGY_CALIBRATE times every strategy on the live
+ * desktop before returning and keeps the fastest; sweeps running
+ * meanwhile use EnumWindows. The registry (also used by calibration)
+ * needs SetWindowHiderEvents and is seeded with one EnumWindows pass.
  *
- * @param hide TRUE to hide from capture, FALSE to show normally
+ * @param strategy ENUM_STRATEGY_* id, or ENUM_STRATEGY_CALIBRATE
+ * @return TRUE on success, FALSE if strategy is unknown or the registry
+ *         cannot be kept, e.g. because hook events are off
  */
-static void SetAllWindowsVisibilityInternal(BOOL hide) {
-    EnumWindowsContext ctx;
-    ctx.targetPID = GetCurrentProcessId();
-    ctx.affinity = hide ? WDA_EXCLUDEFROMCAPTURE : WDA_NONE;
+extern "C" __declspec(dllexport) BOOL __stdcall SetWindowHiderEnumStrategy(DWORD strategy) {
+    if (strategy > ENUM_STRATEGY_CALIBRATE) {
+        return FALSE;
+    }
 
-    // Enumerate all top-level windows and apply affinity
-    EnumWindows(EnumWindowsCallback, (LPARAM)&ctx);
+    if (strategy == ENUM_STRATEGY_REGISTRY || strategy == ENUM_STRATEGY_CALIBRATE) {
+        DrainWindowEvents();
+        if (!ActivateRegistry() && strategy == ENUM_STRATEGY_REGISTRY) {
+            return FALSE;
+        }
+    }
+    InterlockedExchange(&g_enumStrategy, (LONG)strategy);
+    if (strategy == ENUM_STRATEGY_CALIBRATE) {
+        CalibrateEnumStrategy();
+    }
+    return TRUE;
 }
 
 /**
- * Set window display affinity to hide from screen capture.
- * The window remains visible to the user but is excluded from screenshots and screen sharing.
+ * Read the enumeration strategy in use and the last calibration timings.
+ * Copies min(info->cbSize, sizeof(WindowHiderEnumInfo)) bytes.
  *
- * @param hwnd Window handle to modify
- * @param hide TRUE to hide from capture, FALSE to show normally
- * @return TRUE on success, FALSE on failure
+ * @param info Receives the information; info->cbSize must be set by the caller
+ * @return TRUE on success, FALSE if info is NULL or too small
  */
-extern "C" __declspec(dllexport) BOOL __stdcall SetWindowVisibility(HWND hwnd, BOOL hide) {
-    // Validate window handle
-    if (hwnd == NULL || !IsWindow(hwnd)) {
+extern "C" __declspec(dllexport) BOOL __stdcall GetWindowHiderEnumInfo(WindowHiderEnumInfo* info) {
+    if (info == NULL || info->cbSize < sizeof(DWORD) * 2) {
         return FALSE;
     }
 
-    DWORD dwAffinity = hide ? WDA_EXCLUDEFROMCAPTURE : WDA_NONE;
-    return SetWindowDisplayAffinity(hwnd, dwAffinity);
+    g_enumInfo.strategy = (DWORD)g_enumStrategy;
+    DWORD size = info->cbSize < sizeof(WindowHiderEnumInfo) ? info->cbSize : (DWORD)sizeof(WindowHiderEnumInfo);
+    memcpy((BYTE*)info + sizeof(DWORD), (const BYTE*)&g_enumInfo + sizeof(DWORD), size - sizeof(DWORD));
+    return TRUE;
 }
 
 /**
- * Hide all windows of the current process from screen capture.
- * Windows remain visible to the user but are excluded from screenshots and screen sharing.
- * Only processes valid application windows (visible, top-level, with title).
+ * Read how this system supports hiding, detecting it first if no call has
+ * yet. Copies min(info->cbSize, sizeof(WindowHiderCapability)) bytes.
+ *
+ * @param info Receives the information; info->cbSize must be set by the caller
+ * @return TRUE on success, FALSE if info is NULL or too small
  */
-extern "C" __declspec(dllexport) void __stdcall HideAllWindows() {
-    SetAllWindowsVisibilityInternal(TRUE);
+extern "C" __declspec(dllexport) BOOL __stdcall GetWindowHiderCapability(WindowHiderCapability* info) {
+    if (info == NULL || info->cbSize < sizeof(DWORD) * 2) {
+        return FALSE;
+    }
+
+    HideAffinity();
+    AcquireSRWLockShared(&g_capabilityLock);
+    WindowHiderCapability capability = g_capability;
+    ReleaseSRWLockShared(&g_capabilityLock);
+    DWORD size = info->cbSize < sizeof(WindowHiderCapability) ? info->cbSize : (DWORD)sizeof(WindowHiderCapability);
+    memcpy((BYTE*)info + sizeof(DWORD), (const BYTE*)&capability + sizeof(DWORD), size - sizeof(DWORD));
+    return TRUE;
 }
 
 /**
- * Show all windows of the current process normally.
- * Restores windows to be visible in screenshots and screen sharing.
+ * Turn WinEvent hooks for this process's windows on or off. Off by
+ * default. While on, destroy stamps, cached titles and rejections, the
+ * registry and the spatial index are kept current, and shown windows are
+ * checked against the profile, auto-protect and the desired state. The
+ * hooks only queue events; a thread pool thread applies them, and every
+ * call into the DLL applies what is queued first. Turning them off
+ * removes the hooks for good. Unloading the DLL removes them too, so no
+ * call is needed before FreeLibrary.
+ *
+ * @param enable TRUE to install the hooks, FALSE to remove them
+ * @return TRUE if the hooks are now in (enable) or were removed (disable);
+ *         FALSE if they could not be installed, were already removed, or
+ *         were never installed
  */
-extern "C" __declspec(dllexport) void __stdcall ShowAllWindows() {
-    SetAllWindowsVisibilityInternal(FALSE);
+extern "C" __declspec(dllexport) BOOL __stdcall SetWindowHiderEvents(BOOL enable) {
+    if (enable) {
+        return EnableWindowEvents();
+    }
+    return StopWindowEvents();
 }
 
 /**
- * Hide or show a window from the taskbar.
- * Note: This completely hides/shows the taskbar icon, not just from capture.
+ * Opt in to or out of the startup profile. Off by default, and nothing is
+ * written until a host opts in. While on, every window the DLL hides is
+ * recorded in a memory-mapped profile and removed again when shown, and
+ * windows matching the profile are hidden as they are created or shown
+ * while SetWindowHiderEvents is on; matching windows that already exist
+ * are hidden by this call. The first
+ * call that enables it opens or creates the profile.
  *
- * @param hwnd Window handle to modify
- * @param hide TRUE to hide from taskbar, FALSE to show in taskbar
- * @return TRUE on success, FALSE on failure
+ * @param enable TRUE to record and apply the profile, FALSE to stop
+ * @return TRUE on success, FALSE if the profile could not be opened
  */
-extern "C" __declspec(dllexport) BOOL __stdcall HideFromTaskbar(HWND hwnd, BOOL hide) {
-    // Validate window handle
-    if (hwnd == NULL || !IsWindow(hwnd)) {
+extern "C" __declspec(dllexport) BOOL __stdcall SetWindowHiderProfile(BOOL enable) {
+    if (!enable) {
+        g_profileEnabled = FALSE;
+        return TRUE;
+    }
+
+    DrainWindowEvents();
+    if (!EnableProfile()) {
         return FALSE;
     }
+    EnumProcessWindows(ProfileEnumCallback, (LPARAM)GetCurrentProcessId());
+    return TRUE;
+}
 
-    LONG_PTR style = GetWindowLongPtr(hwnd, GWL_EXSTYLE);
-    if (style == 0) {
+/**
+ * Copy internal counters to the caller.
+ *
+ * @param stats Receives the counters; stats->cbSize must be set by the caller
+ * @return TRUE on success, FALSE if stats is NULL or cbSize is too small
+ */
+extern "C" __declspec(dllexport) BOOL __stdcall GetWindowHiderStats(WindowHiderStats* stats) {
+    if (stats == NULL || stats->cbSize < sizeof(DWORD) * 2) {
         return FALSE;
     }
 
-    if (hide) {
-        // Hide from taskbar: add TOOLWINDOW style, remove APPWINDOW style
-        style |= WS_EX_TOOLWINDOW;
-        style &= ~WS_EX_APPWINDOW;
-    } else {
-        // Show in taskbar: add APPWINDOW style, remove TOOLWINDOW style
-        style |= WS_EX_APPWINDOW;
-        style &= ~WS_EX_TOOLWINDOW;
+    // Derived from the predicate profile on demand
+    g_stats.predicateOrder = (DWORD)g_predicateOrder;
+    for (DWORD i = 0; i < PREDICATE_COUNT; i++) {
+        LONG samples = g_predicateProfile[i].samples;
+        g_stats.predicateSamples[i] = (DWORD)samples;
+        g_stats.predicateRejections[i] = (DWORD)g_predicateProfile[i].rejections;
+        g_stats.predicateNanos[i] = samples ? (DWORD)(g_predicateProfile[i].ticks * 1000000000 / QpcFrequency() / samples) : 0;
     }
 
-    SetWindowLongPtr(hwnd, GWL_EXSTYLE, style);
+    DWORD size = stats->cbSize < sizeof(WindowHiderStats) ? stats->cbSize : (DWORD)sizeof(WindowHiderStats);
+    memcpy((BYTE*)stats + sizeof(DWORD), (const BYTE*)&g_stats + sizeof(DWORD), size - sizeof(DWORD));
     return TRUE;
 }
 
@@ -187,11 +6206,49 @@ extern "C" __declspec(dllexport) BOOL __stdcall HideFromTaskbar(HWND hwnd, BOOL
 BOOL APIENTRY DllMain(HMODULE hModule, DWORD ul_reason_for_call, LPVOID lpReserved) {
     switch (ul_reason_for_call) {
     case DLL_PROCESS_ATTACH:
+    {
+        LONGLONG attachStart = QpcNow();
+        g_module = hModule;
         DisableThreadLibraryCalls(hModule);
+        ReadProcessStart();
+        StartStartupProtection();
+        g_stats.attachMicros = QpcToMicros(QpcNow() - attachStart);
         break;
+    }
     case DLL_THREAD_ATTACH:
     case DLL_THREAD_DETACH:
+        break;
     case DLL_PROCESS_DETACH:
+        // On FreeLibrary remove the hooks, then stop the timers; at process
+        // exit the pool is gone. The hook owner takes no lock the loader
+        // holds, and the pool sets g_hooksGone after its callback returns.
+        if (lpReserved == NULL && g_hooksGone != NULL) {
+            StopWindowEvents();
+            WaitForSingleObject(g_hooksGone, INFINITE);
+        } else if (lpReserved == NULL && g_eventThreadId != 0 && !StopWindowEvents()) {
+            // Pumped, unloading on another thread: the hooks cannot be
+            // removed here, so at least make them return at once
+            InterlockedExchange(&g_eventsState, EVENTS_STOPPED);
+        }
+        if (lpReserved == NULL && g_verifyTimer != NULL) {
+            SetThreadpoolTimer(g_verifyTimer, NULL, 0, 0);
+            CloseThreadpoolTimer(g_verifyTimer);
+            g_verifyTimer = NULL;
+        }
+        if (lpReserved == NULL && g_moveTimer != NULL) {
+            SetThreadpoolTimer(g_moveTimer, NULL, 0, 0);
+            CloseThreadpoolTimer(g_moveTimer);
+            g_moveTimer = NULL;
+        }
+        if (lpReserved == NULL && g_reconcileTimer != NULL) {
+            SetThreadpoolTimer(g_reconcileTimer, NULL, 0, 0);
+            CloseThreadpoolTimer(g_reconcileTimer);
+            g_reconcileTimer = NULL;
+        }
+        if (lpReserved == NULL && g_profile != NULL) {
+            UnmapViewOfFile(g_profile);
+            g_profile = NULL;
+        }
         break;
     }
     return TRUE;
@@ -0,0 +1,143 @@
+"""
+WindowHider rule compiler - builds the binary rule file read by LoadWindowHiderRules
+
+Text format, one rule per line (# starts a comment):
+
+    hide class=Chrome_WidgetWin_1 title^="Secret - "
+    skip class=tooltips_class32
+    hide title*=Password
+
+    class=NAME     window class, ASCII case-insensitive
+    title=TEXT     whole title
+    title^=TEXT    title prefix
+    title*=TEXT    title contains TEXT
+
+The first matching rule wins. A window no rule matches falls back to the
+filter flags set with SetWindowHiderPolicy.
+
+Usage: python compile_policy.py rules.txt rules.whp
+"""
+
+import shlex
+import struct
+import sys
+import time
+
+RULES_MAGIC = 0x4C504857  # "WHPL"
+RULES_VERSION = 1
+HEADER_FORMAT = "<IHHIIIIII"  # Must match RulesHeader in dllmain.cpp
+RULE_FORMAT = "<BBHIII"       # Must match RuleEntry in dllmain.cpp
+
+ACTIONS = {"hide": 1, "skip": 2}
+TITLE_MATCHES = {"title=": 1, "title^=": 2, "title*=": 3}
+MAX_TEXT = 255  # The DLL reads at most 255 characters of a class name or title
+
+
+def fold_hash(text):
+    """FNV-1a over ASCII-upper-cased UTF-16 units, as EvaluateRules computes it."""
+    encoded = text.encode("utf-16-le")
+    value = 2166136261
+    for unit in struct.unpack("<%dH" % (len(encoded) // 2), encoded):
+        if ord("a") <= unit <= ord("z"):
+            unit -= 32
+        value = ((value ^ unit) * 16777619) & 0xFFFFFFFF
+    return value
+
+
+def parse_rules(lines):
+    """Parse the text format into (action, class or None, title match, title) tuples."""
+    rules = []
+    for number, line in enumerate(lines, 1):
+        tokens = shlex.split(line, comments=True)
+        if not tokens:
+            continue
+        if tokens[0] not in ACTIONS:
+            raise ValueError("line %d: expected 'hide' or 'skip'" % number)
+
+        class_name, title_match, title = None, 0, None
+        for token in tokens[1:]:
+            if token.startswith("class="):
+                class_name = token[len("class="):]
+                continue
+            for prefix, match in TITLE_MATCHES.items():
+                if token.startswith(prefix):
+                    title_match, title = match, token[len(prefix):]
+                    break
+            else:
+                raise ValueError("line %d: unknown field %r" % (number, token))
+
+        for text in (class_name, title):
+            if text is not None and len(text.encode("utf-16-le")) // 2 > MAX_TEXT:
+                raise ValueError("line %d: text longer than %d characters" % (number, MAX_TEXT))
+        rules.append((ACTIONS[tokens[0]], class_name, title_match, title))
+    return rules
+
+
+def compile_rules(rules):
+    """Lay out the binary file: header, buckets, rules, strings."""
+    class_rules = sum(1 for rule in rules if rule[1] is not None)
+    bucket_count = 1
+    while bucket_count < class_rules * 2:
+        bucket_count *= 2
+
+    header_size = struct.calcsize(HEADER_FORMAT)
+    buckets_offset = header_size
+    rules_offset = buckets_offset + (bucket_count + 1) * 4
+    strings_offset = rules_offset + len(rules) * struct.calcsize(RULE_FORMAT)
+
+    strings = bytearray()
+    string_offsets = {}
+
+    def add_string(text):
+        if text is None:
+            return 0
+        if text not in string_offsets:
+            encoded = text.encode("utf-16-le")
+            string_offsets[text] = strings_offset + len(strings)
+            strings.extend(struct.pack("<H", len(encoded) // 2) + encoded)
+        return string_offsets[text]
+
+    # Chains stay in ascending rule order, so the first match is the lowest index
+    heads = [0] * (bucket_count + 1)
+    tails = [None] * (bucket_count + 1)
+    entries = []
+    for index, (action, class_name, title_match, title) in enumerate(rules):
+        bucket = bucket_count if class_name is None else fold_hash(class_name) & (bucket_count - 1)
+        entries.append([action, title_match, add_string(class_name), add_string(title), 0])
+        if tails[bucket] is None:
+            heads[bucket] = index + 1
+        else:
+            entries[tails[bucket]][4] = index + 1
+        tails[bucket] = index
+
+    body = struct.pack("<%dI" % len(heads), *heads)
+    for action, title_match, class_offset, title_offset, next_rule in entries:
+        body += struct.pack(RULE_FORMAT, action, title_match, 0, class_offset, title_offset, next_rule)
+    body += bytes(strings)
+
+    file_size = header_size + len(body)
+    header = struct.pack(HEADER_FORMAT, RULES_MAGIC, RULES_VERSION, header_size, file_size, len(rules),
+                         bucket_count, buckets_offset, rules_offset, strings_offset)
+    return header + body
+
+
+def main():
+    if len(sys.argv) != 3:
+        print("Usage: python compile_policy.py rules.txt rules.whp")
+        return 1
+
+    start = time.perf_counter()
+    with open(sys.argv[1], encoding="utf-8") as source:
+        rules = parse_rules(source)
+    parsed = time.perf_counter()
+    data = compile_rules(rules)
+    with open(sys.argv[2], "wb") as output:
+        output.write(data)
+
+    print("%d rules, %d bytes" % (len(rules), len(data)))
+    print("Text parse: %.1f ms, compile: %.1f ms" % ((parsed - start) * 1000, (time.perf_counter() - parsed) * 1000))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
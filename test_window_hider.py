@@ -7,6 +7,9 @@ from tkinter import messagebox
 import ctypes
 from ctypes import wintypes
 import os
+import sys
+import threading
+import time
 
 # Windows API
 user32 = ctypes.windll.user32
@@ -17,15 +20,166 @@ WDA_NONE = 0x00000000
 WDA_MONITOR = 0x00000001
 WDA_EXCLUDEFROMCAPTURE = 0x00000011
 
+GA_ROOT = 2
+
+# 与 Payload/dllmain.cpp 中的 FILTER_* 一致，默认策略为前两项
+FILTER_REQUIRE_TITLE = 0x1
+FILTER_SKIP_TOOL_WINDOWS = 0x2
+FILTER_ADAPTIVE_ORDER = 0x4
+DEFAULT_FILTER = FILTER_REQUIRE_TITLE | FILTER_SKIP_TOOL_WINDOWS
+
+# 遍历暴露检查新建的窗口数
+SWEEP_WINDOWS = 6
+
+# 句柄复用检查新建并销毁的窗口数
+CHURN_WINDOWS = 300
+
+# 记录内存检查新建的窗口数，正好填满两块 SLAB_RECORDS 记录
+RECORD_WINDOWS = 1024
+# 每条记录最多 32 字节，索引最多是被跟踪窗口数的四倍，每项 4 字节
+MAX_BYTES_PER_WINDOW = 32 + 16
+
+# 策略切换检查：被过滤掉的隐藏窗口数、每秒切换次数、持续时间
+POLICY_WINDOWS = 200
+POLICY_SWAPS_PER_SECOND = 1000
+POLICY_SWAP_SECONDS = 2.0
+
+# 与 Payload/dllmain.cpp 中的 PREDICATE_* 一致
+PREDICATE_NAMES = ["句柄", "可见", "父窗口", "样式", "扩展样式", "标题"]
+PREDICATE_EXSTYLE = 4
+
+# 过滤顺序检查：被扩展样式拒绝的工具窗口数、每种顺序的遍历次数
+FILTER_WINDOWS = 200
+FILTER_SWEEPS = 40
+
+# 拒绝缓存检查：隐藏（被拒绝）的窗口数和可见窗口数，95% 为拒绝
+REJECT_WINDOWS = 190
+ACCEPT_WINDOWS = 10
+REJECT_SWEEPS = 20
+
+# 枚举策略检查新建的窗口数
+ENUM_WINDOWS = 50
+
+# 快照比较检查：已保护的窗口数、两次遍历之间新建和销毁的窗口数
+SNAPSHOT_WINDOWS = 300
+SNAPSHOT_CHANGED = 10
+
+# 窗口组检查的组大小
+GROUP_SIZES = [1, 10, 100, 1000]
+
+# 区域查询检查：屏幕按 SPATIAL_GRID x SPATIAL_GRID 排满窗口
+SPATIAL_GRID = 10
+
+# 与 Payload/dllmain.cpp 中的 MOVE_FLUSH_BUDGET_MICROS 一致
+MOVE_FLUSH_BUDGET_MICROS = 500
+# 拖动检查：每步移动的像素、两步之间的间隔、进入区域后到受保护的最长时间
+DRAG_STEP = 8
+DRAG_INTERVAL = 0.002
+DRAG_MAX_LATENCY = 0.1
+
+SWP_NOSIZE = 0x0001
+SWP_NOZORDER = 0x0004
+SWP_NOACTIVATE = 0x0010
+
+# 与 Payload/dllmain.cpp 中的 VERIFY_INTERVAL_MS / VERIFY_TICK_BUDGET_MICROS 一致
+VERIFY_INTERVAL = 1.0
+VERIFY_TICK_BUDGET_MICROS = 250
+
+# 与 Payload/dllmain.cpp 中的 WindowHiderStats 一致
+class WindowHiderStats(ctypes.Structure):
+    _fields_ = [
+        ("cbSize", wintypes.DWORD),
+        ("hidesApplied", wintypes.DWORD),
+        ("showsQueued", wintypes.DWORD),
+        ("showsApplied", wintypes.DWORD),
+        ("showsCancelled", wintypes.DWORD),
+        ("maxHideLatencyMicros", wintypes.DWORD),
+        ("lastSweepExposure", wintypes.DWORD),
+        ("lastSweepMaxExposedMicros", wintypes.DWORD),
+        ("sweepSlices", wintypes.DWORD),
+        ("lastSliceOvershootMicros", wintypes.DWORD),
+        ("maxSliceOvershootMicros", wintypes.DWORD),
+        ("pumpCalls", wintypes.DWORD),
+        ("maxPumpOvershootMicros", wintypes.DWORD),
+        ("trackedWindows", wintypes.DWORD),
+        ("verifierTicks", wintypes.DWORD),
+        ("driftEvents", wintypes.DWORD),
+        ("maxVerifierTickMicros", wintypes.DWORD),
+        ("heapAllocations", wintypes.DWORD),
+        ("bytesPerTrackedWindow", wintypes.DWORD),
+        ("recreatedHides", wintypes.DWORD),
+        ("profileHides", wintypes.DWORD),
+        ("startupToProtectedMicros", wintypes.DWORD),
+        ("attachMicros", wintypes.DWORD),
+        ("autoProtectHides", wintypes.DWORD),
+        ("policiesPending", wintypes.DWORD),
+        ("policyReaderFallbacks", wintypes.DWORD),
+        ("ruleCount", wintypes.DWORD),
+        ("rulesLoadMicros", wintypes.DWORD),
+        ("rulesFirstEvalMicros", wintypes.DWORD),
+        ("reconcilePasses", wintypes.DWORD),
+        ("reconcileChanges", wintypes.DWORD),
+        ("lastReconcileLagMicros", wintypes.DWORD),
+        ("maxReconcileLagMicros", wintypes.DWORD),
+        ("predicateOrder", wintypes.DWORD),
+        ("predicateSamples", wintypes.DWORD * 6),
+        ("predicateRejections", wintypes.DWORD * 6),
+        ("predicateNanos", wintypes.DWORD * 6),
+        ("rejectCacheHits", wintypes.DWORD),
+        ("rejectCacheMisses", wintypes.DWORD),
+        ("titleFetches", wintypes.DWORD),
+        ("titleCacheHits", wintypes.DWORD),
+        ("snapshotAdded", wintypes.DWORD),
+        ("hidesSkipped", wintypes.DWORD),
+        ("tokenCount", wintypes.DWORD),
+        ("tokensInvalidated", wintypes.DWORD),
+        ("groupMembersPruned", wintypes.DWORD),
+        ("cloakCalls", wintypes.DWORD),
+        ("frameChanges", wintypes.DWORD),
+        ("taskbarUnchanged", wintypes.DWORD),
+        ("hidesUnsupported", wintypes.DWORD),
+        ("spatialWindows", wintypes.DWORD),
+        ("lastSpatialExamined", wintypes.DWORD),
+        ("movesMerged", wintypes.DWORD),
+        ("maxMoveFlushMicros", wintypes.DWORD),
+        ("taskbarListFallbacks", wintypes.DWORD),
+        ("configErrors", wintypes.DWORD),
+    ]
+
+# 与 Payload/dllmain.cpp 中的 WindowHiderPolicy 一致
+class WindowHiderPolicy(ctypes.Structure):
+    _fields_ = [
+        ("cbSize", wintypes.DWORD),
+        ("filterFlags", wintypes.DWORD),
+        ("autoProtect", wintypes.DWORD),
+        ("autoProtectClass", wintypes.LPCWSTR),
+    ]
+
+# 与 Payload/dllmain.cpp 中的 ENUM_STRATEGY_* / WindowHiderEnumInfo 一致
+ENUM_STRATEGY_NAMES = ["EnumWindows", "EnumThreadWindows", "Z 序遍历", "FindWindowExW", "注册表"]
+ENUM_STRATEGY_CALIBRATE = len(ENUM_STRATEGY_NAMES)
+ENUM_UNAVAILABLE = 0xFFFFFFFF
+
+class WindowHiderEnumInfo(ctypes.Structure):
+    _fields_ = [
+        ("cbSize", wintypes.DWORD),
+        ("strategy", wintypes.DWORD),
+        ("calibrated", wintypes.DWORD),
+        ("fallbacks", wintypes.DWORD),
+        ("calibrationNanos", wintypes.DWORD * len(ENUM_STRATEGY_NAMES)),
+    ]
+
 class WindowHiderTest:
-    def __init__(self):
+    def __init__(self, dll_path=None):
         self.root = tk.Tk()
         self.root.title("WindowHider 测试程序")
-        self.root.geometry("450x400")
+        self.root.geometry("450x520")
 
         self.is_hidden = False
         self.dll = None
         self.hwnd = None
+        self.events_enabled = False
+        self.dll_path = dll_path
 
         self.setup_ui()
         self.load_dll()
@@ -38,7 +192,6 @@ class WindowHiderTest:
         self.root.update_idletasks()
 
         # 方法1: 使用 GetAncestor 获取根窗口
-        GA_ROOT = 2
         child_hwnd = self.root.winfo_id()
         self.hwnd = user32.GetAncestor(child_hwnd, GA_ROOT)
 
@@ -86,6 +239,34 @@ class WindowHiderTest:
         )
         self.toggle_btn.pack(pady=15)
 
+        # 检查项：每项返回 (是否通过, 说明)
+        self.checks = [
+            ("稳态分配检查", self.check_steady_allocations),
+            ("记录内存检查", self.check_record_memory),
+            ("遍历暴露检查", self.check_sweep_exposure),
+            ("漂移校验检查", self.check_drift_verifier),
+            ("句柄复用检查", self.check_handle_churn),
+            ("策略切换检查", self.check_policy_swaps),
+            ("过滤顺序检查", self.check_filter_order),
+            ("拒绝缓存检查", self.check_reject_cache),
+            ("枚举策略检查", self.check_enum_strategies),
+            ("快照比较检查", self.check_snapshot_diff),
+            ("窗口组检查", self.check_groups),
+            ("区域查询检查", self.check_spatial_query),
+            ("拖动检查", self.check_drag_into_region),
+        ]
+        self.check_btns = []
+        for name, check in self.checks:
+            btn = tk.Button(
+                self.root,
+                text=name,
+                font=("Arial", 10),
+                width=25,
+                command=lambda name=name, check=check: self.run_check(name, check)
+            )
+            btn.pack(pady=5)
+            self.check_btns.append(btn)
+
         # 结果显示
         self.result_var = tk.StringVar(value="")
         result_label = tk.Label(self.root, textvariable=self.result_var, font=("Arial", 10))
@@ -98,7 +279,7 @@ class WindowHiderTest:
 
     def load_dll(self):
         """加载 WindowHider.dll"""
-        dll_paths = [
+        dll_paths = [self.dll_path] if self.dll_path else [
             "WindowHider.dll",
             "Build/bin/Release/WindowHider.dll",
             os.path.join(os.path.dirname(os.path.abspath(__file__)), "WindowHider.dll"),
@@ -112,6 +293,26 @@ class WindowHiderTest:
                     # 设置函数签名 - 使用 SetWindowVisibility 直接操作指定窗口
                     self.dll.SetWindowVisibility.argtypes = [wintypes.HWND, wintypes.BOOL]
                     self.dll.SetWindowVisibility.restype = wintypes.BOOL
+                    self.dll.GetWindowHiderStats.argtypes = [ctypes.POINTER(WindowHiderStats)]
+                    self.dll.GetWindowHiderStats.restype = wintypes.BOOL
+                    self.dll.SetWindowHiderEvents.argtypes = [wintypes.BOOL]
+                    self.dll.SetWindowHiderEvents.restype = wintypes.BOOL
+                    self.dll.SetWindowHiderPolicy.argtypes = [ctypes.POINTER(WindowHiderPolicy)]
+                    self.dll.SetWindowHiderPolicy.restype = wintypes.BOOL
+                    self.dll.SetWindowHiderEnumStrategy.argtypes = [wintypes.DWORD]
+                    self.dll.SetWindowHiderEnumStrategy.restype = wintypes.BOOL
+                    self.dll.GetWindowHiderEnumInfo.argtypes = [ctypes.POINTER(WindowHiderEnumInfo)]
+                    self.dll.GetWindowHiderEnumInfo.restype = wintypes.BOOL
+                    self.dll.CreateWindowHiderGroup.argtypes = [wintypes.LPCWSTR]
+                    self.dll.CreateWindowHiderGroup.restype = wintypes.DWORD
+                    self.dll.DeleteWindowHiderGroup.argtypes = [wintypes.DWORD]
+                    self.dll.DeleteWindowHiderGroup.restype = wintypes.BOOL
+                    self.dll.AddWindowHiderGroupMember.argtypes = [wintypes.DWORD, wintypes.HWND]
+                    self.dll.AddWindowHiderGroupMember.restype = wintypes.BOOL
+                    self.dll.SetWindowHiderGroupVisibility.argtypes = [wintypes.DWORD, wintypes.BOOL]
+                    self.dll.SetWindowHiderGroupVisibility.restype = wintypes.BOOL
+                    self.dll.HideWindowsInRect.argtypes = [ctypes.POINTER(wintypes.RECT)]
+                    self.dll.HideWindowsInRect.restype = wintypes.BOOL
 
                     self.dll_status_var.set(f"DLL: 已加载")
                     print(f"DLL 加载成功: {path}")
@@ -121,6 +322,8 @@ class WindowHiderTest:
 
         self.dll_status_var.set("DLL: 未找到")
         self.toggle_btn.config(state="disabled")
+        for btn in self.check_btns:
+            btn.config(state="disabled")
         print("DLL 未找到")
 
     def toggle_visibility(self):
@@ -150,12 +353,736 @@ class WindowHiderTest:
             print(f"操作失败: {e}")
             messagebox.showerror("错误", f"操作失败: {e}")
 
+    def stats(self):
+        """读取 WindowHiderStats"""
+        stats = WindowHiderStats()
+        stats.cbSize = ctypes.sizeof(stats)
+        if not self.dll.GetWindowHiderStats(ctypes.byref(stats)):
+            raise RuntimeError("GetWindowHiderStats 失败")
+        return stats
+
+    def heap_allocations(self):
+        """读取 WindowHiderStats.heapAllocations"""
+        return self.stats().heapAllocations
+
+    def run_check(self, name, check):
+        """运行一项检查，结果显示在界面上并打印"""
+        if not self.dll:
+            messagebox.showerror("错误", "DLL 未加载")
+            return False
+
+        try:
+            ok, detail = check()
+        except Exception as e:
+            ok, detail = False, f"操作失败: {e}"
+
+        self.result_var.set(f"{name}{'通过' if ok else '失败'}：{detail}")
+        print(f"{name}{'通过' if ok else '失败'}: {detail}")
+        return ok
+
+    def top_level(self, widget):
+        """Tk 控件所在的顶层窗口句柄"""
+        return user32.GetAncestor(widget.winfo_id(), GA_ROOT)
+
+    def open_windows(self, count, name, geometry=None):
+        """新建 count 个顶层窗口，返回 (窗口, 句柄) 列表"""
+        windows = []
+        for i in range(count):
+            window = tk.Toplevel(self.root)
+            window.title(f"{name} {i}")
+            window.geometry(geometry(i) if geometry else f"160x120+{20 * (i % 20)}+{20 * (i % 20)}")
+            windows.append(window)
+        self.root.update()
+        return [(window, self.top_level(window)) for window in windows]
+
+    def close_windows(self, windows):
+        """关闭 open_windows 新建的窗口"""
+        for window, _ in windows:
+            window.destroy()
+        self.root.update()
+
+    def affinity(self, hwnd):
+        """窗口当前的显示亲和性，读取失败时返回 None"""
+        value = wintypes.DWORD()
+        if not user32.GetWindowDisplayAffinity(hwnd, ctypes.byref(value)):
+            return None
+        return value.value
+
+    def wait_for(self, condition, timeout):
+        """保持界面响应，等待 condition() 为真，超时返回 False"""
+        deadline = time.perf_counter() + timeout
+        while not condition():
+            if time.perf_counter() >= deadline:
+                return False
+            self.root.update()
+            time.sleep(0.02)
+        return True
+
+    def enable_events(self):
+        """打开 WinEvent 钩子；关闭后无法再打开，所以检查结束后保持打开"""
+        if not self.events_enabled:
+            if not self.dll.SetWindowHiderEvents(True):
+                raise RuntimeError("SetWindowHiderEvents 失败")
+            self.events_enabled = True
+
+    def set_filter(self, flags):
+        """用 SetWindowHiderPolicy 设置过滤标志，自动保护保持关闭"""
+        policy = WindowHiderPolicy(ctypes.sizeof(WindowHiderPolicy), flags, 0, None)
+        if not self.dll.SetWindowHiderPolicy(ctypes.byref(policy)):
+            raise RuntimeError("SetWindowHiderPolicy 失败")
+
+    def window_rect(self, hwnd):
+        """窗口的屏幕矩形"""
+        rect = wintypes.RECT()
+        user32.GetWindowRect(hwnd, ctypes.byref(rect))
+        return rect
+
+    def grid_windows(self, name):
+        """按 SPATIAL_GRID x SPATIAL_GRID 在屏幕上排满窗口，返回窗口和单元格大小"""
+        cell_w = self.root.winfo_screenwidth() // SPATIAL_GRID
+        cell_h = self.root.winfo_screenheight() // SPATIAL_GRID
+        windows = self.open_windows(
+            SPATIAL_GRID * SPATIAL_GRID, name,
+            lambda i: f"{cell_w - 24}x{cell_h - 40}+{i % SPATIAL_GRID * cell_w}+{i // SPATIAL_GRID * cell_h}")
+        return windows, cell_w, cell_h
+
+    def pause(self, seconds):
+        """保持界面响应，等待 seconds 秒"""
+        self.wait_for(lambda: False, seconds)
+
+    def check_steady_allocations(self):
+        """预热后反复 HideAllWindows/ShowAllWindows，heapAllocations 必须保持不变"""
+        warmup, cycles = 3, 50
+        for _ in range(warmup):
+            self.dll.HideAllWindows()
+            self.dll.ShowAllWindows()
+        before = self.heap_allocations()
+        for _ in range(cycles):
+            self.dll.HideAllWindows()
+            self.dll.ShowAllWindows()
+        after = self.heap_allocations()
+        if self.is_hidden:
+            self.dll.HideAllWindows()
+
+        return after == before, f"{cycles} 轮 {after - before} 次分配（heapAllocations {before} -> {after}）"
+
+    def check_record_memory(self):
+        """
+        隐藏 RECORD_WINDOWS 个窗口，每个被跟踪窗口占用的记录和索引内存不得
+        超过 MAX_BYTES_PER_WINDOW。销毁这些窗口后再隐藏同样多的新窗口：
+        记录必须从已释放的槽位复用，heapAllocations 保持不变。
+        """
+        def hide_batch(name):
+            windows = self.open_windows(RECORD_WINDOWS, name)
+            try:
+                for _, hwnd in windows:
+                    self.dll.SetWindowVisibility(hwnd, True)
+                return self.stats()
+            finally:
+                self.close_windows(windows)
+
+        tracked_before = self.stats().trackedWindows
+        first = hide_batch("记录窗口")
+        if first.trackedWindows < RECORD_WINDOWS:
+            return False, f"只跟踪了 {first.trackedWindows} 个窗口"
+        if first.bytesPerTrackedWindow > MAX_BYTES_PER_WINDOW:
+            return False, f"每个窗口 {first.bytesPerTrackedWindow} 字节，超过 {MAX_BYTES_PER_WINDOW}"
+
+        # 已销毁的窗口由校验器移除，每轮受预算限制，要等几轮
+        if not self.wait_for(lambda: self.stats().trackedWindows <= tracked_before, 30 * VERIFY_INTERVAL):
+            return False, "销毁的窗口没有被移除"
+        before = self.heap_allocations()
+        second = hide_batch("复用窗口")
+        if second.heapAllocations != before:
+            return False, f"复用时发生 {second.heapAllocations - before} 次分配"
+        return True, f"{first.trackedWindows} 个窗口，每个 {first.bytesPerTrackedWindow} 字节，复用时 0 次分配"
+
+    def check_sweep_exposure(self):
+        """
+        新建几个大小不同的窗口并让最后一个成为前台窗口，然后 HideAllWindows。
+        调用期间另一线程轮询各窗口的显示亲和性，实测每个窗口从调用开始到
+        受保护的时间；所有窗口都必须受保护，前台窗口必须最先受保护（误差为
+        一轮轮询的时间）。
+        """
+        windows = self.open_windows(SWEEP_WINDOWS, "遍历窗口",
+                                    lambda i: f"{200 + 60 * i}x{150 + 40 * i}+{30 * i}+{30 * i}")
+        windows[-1][0].focus_force()
+        self.root.update()
+
+        try:
+            hwnds = [hwnd for _, hwnd in windows]
+            foreground = user32.GetForegroundWindow()
+            protected_at = {}
+            longest_pass = [0.0]
+            done = threading.Event()
+
+            def poll():
+                affinity = wintypes.DWORD()
+                while len(protected_at) < len(hwnds) and not done.is_set():
+                    pass_start = time.perf_counter()
+                    for hwnd in hwnds:
+                        if (hwnd not in protected_at
+                                and user32.GetWindowDisplayAffinity(hwnd, ctypes.byref(affinity))
+                                and affinity.value != WDA_NONE):
+                            protected_at[hwnd] = time.perf_counter()
+                    longest_pass[0] = max(longest_pass[0], time.perf_counter() - pass_start)
+
+            poller = threading.Thread(target=poll)
+            poller.start()
+            start = time.perf_counter()
+            self.dll.HideAllWindows()
+            poller.join(1.0)
+            done.set()
+            poller.join()
+            stats = self.stats()
+        finally:
+            self.close_windows(windows)
+            if not self.is_hidden:
+                self.dll.ShowAllWindows()
+
+        missing = [hwnd for hwnd in hwnds if hwnd not in protected_at]
+        if missing:
+            return False, f"{len(missing)} 个窗口未受保护"
+
+        exposed = {hwnd: int((protected_at[hwnd] - start) * 1000000) for hwnd in hwnds}
+        detail = (f"实测最长暴露 {max(exposed.values())} 微秒，"
+                  f"DLL 记录 {stats.lastSweepMaxExposedMicros} 微秒")
+        if foreground not in exposed:
+            return True, detail + "（前台窗口不是新建窗口，未检查顺序）"
+        first = exposed[foreground] <= min(exposed.values()) + int(longest_pass[0] * 1000000)
+        return first, detail + f"，前台窗口 {exposed[foreground]} 微秒"
+
+    def check_drift_verifier(self):
+        """
+        隐藏一个窗口后在 DLL 之外清掉它的亲和性，校验器必须在几个周期内重新
+        隐藏它并记一次漂移，单次校验最多超出预算一次检查的时间。之后显示全部
+        窗口：没有被跟踪的窗口时，校验器不得再唤醒。
+        """
+        windows = self.open_windows(1, "漂移窗口")
+        hwnd = windows[0][1]
+        try:
+            if not self.dll.SetWindowVisibility(hwnd, True):
+                return False, "SetWindowVisibility 失败"
+            drift_before = self.stats().driftEvents
+            reset_start = time.perf_counter()
+            user32.SetWindowDisplayAffinity(hwnd, WDA_NONE)
+            reset_micros = int((time.perf_counter() - reset_start) * 1000000)
+            restored = self.wait_for(lambda: self.affinity(hwnd) not in (None, WDA_NONE), 3 * VERIFY_INTERVAL)
+            stats = self.stats()
+        finally:
+            self.close_windows(windows)
+
+        if not restored:
+            return False, "校验器没有重新隐藏窗口"
+        if stats.driftEvents == drift_before:
+            return False, "driftEvents 没有增加"
+        # 超出预算的部分是最后一次检查，包括一次 SetWindowDisplayAffinity
+        limit = VERIFY_TICK_BUDGET_MICROS + 2 * reset_micros
+        if stats.maxVerifierTickMicros > limit:
+            return False, f"单次校验 {stats.maxVerifierTickMicros} 微秒，超过 {limit} 微秒"
+
+        # 已销毁的窗口由校验器在下一轮移除
+        self.dll.ShowAllWindows()
+        idle = self.wait_for(lambda: self.stats().trackedWindows == 0, 3 * VERIFY_INTERVAL)
+        ticks = self.stats().verifierTicks
+        self.pause(2.5 * VERIFY_INTERVAL)
+        idle_ticks = self.stats().verifierTicks - ticks
+        if self.is_hidden:
+            self.dll.HideAllWindows()
+
+        if not idle:
+            return False, "显示全部窗口后仍有被跟踪的窗口"
+        if idle_ticks != 0:
+            return False, f"没有被跟踪的窗口时校验器唤醒了 {idle_ticks} 次"
+        return True, f"窗口已重新隐藏，单次校验最长 {stats.maxVerifierTickMicros} 微秒，空闲时 0 次唤醒"
+
+    def check_handle_churn(self):
+        """
+        打开钩子后反复新建、隐藏、销毁窗口。每个新窗口创建时都必须可被捕获
+        （没有沿用旧窗口的状态），SetWindowVisibility 之后都必须真的受保护
+        （没有被旧记录误判为已隐藏而跳过）；全部销毁后，销毁通知必须让被
+        跟踪的窗口数回到开始时的值。
+        """
+        self.enable_events()
+        tracked_before = self.stats().trackedWindows
+        seen_handles, seen_slots = set(), set()
+        reused_handles = reused_slots = 0
+
+        for i in range(CHURN_WINDOWS):
+            windows = self.open_windows(1, f"句柄窗口 {i}")
+            hwnd = windows[0][1]
+            try:
+                reused_handles += hwnd in seen_handles
+                reused_slots += (hwnd & 0xFFFF) in seen_slots
+                seen_handles.add(hwnd)
+                seen_slots.add(hwnd & 0xFFFF)
+                if self.affinity(hwnd) != WDA_NONE:
+                    return False, f"第 {i} 个新窗口创建时已带有亲和性"
+                if not self.dll.SetWindowVisibility(hwnd, True) or self.affinity(hwnd) == WDA_NONE:
+                    return False, f"第 {i} 个新窗口没有被隐藏"
+            finally:
+                self.close_windows(windows)
+
+        retired = self.wait_for(lambda: self.stats().trackedWindows <= tracked_before, 3 * VERIFY_INTERVAL)
+        if not retired:
+            return False, f"销毁后仍跟踪 {self.stats().trackedWindows - tracked_before} 个窗口"
+        return True, f"{CHURN_WINDOWS} 个窗口，句柄值复用 {reused_handles} 次，槽位复用 {reused_slots} 次"
+
+    def check_policy_swaps(self):
+        """
+        另一线程以每秒 POLICY_SWAPS_PER_SECOND 次切换策略，同时反复
+        HideAllWindows；隐藏的窗口每次遍历都要读取策略。读者不得退回到锁
+        （policyReaderFallbacks 不变），切换停止后旧快照必须全部释放
+        （policiesPending 为 0）。报告有无切换时每次遍历的耗时和写者最长耗时。
+        """
+        windows = self.open_windows(POLICY_WINDOWS, "策略窗口")
+        for window, _ in windows:
+            window.withdraw()
+        self.root.update()
+
+        def sweeps(seconds):
+            count, end = 0, time.perf_counter() + seconds
+            start = time.perf_counter()
+            while time.perf_counter() < end:
+                self.dll.HideAllWindows()
+                count += 1
+            return (time.perf_counter() - start) / count * 1000000
+
+        writer = {"swaps": 0, "longest": 0.0, "failed": False}
+        stop = threading.Event()
+
+        def swap():
+            interval = 1.0 / POLICY_SWAPS_PER_SECOND
+            next_at = time.perf_counter()
+            while not stop.is_set():
+                call_start = time.perf_counter()
+                try:
+                    self.set_filter(DEFAULT_FILTER)
+                except RuntimeError:
+                    writer["failed"] = True
+                    return
+                writer["longest"] = max(writer["longest"], time.perf_counter() - call_start)
+                writer["swaps"] += 1
+                next_at += interval
+                while time.perf_counter() < next_at and not stop.is_set():
+                    time.sleep(0)
+
+        try:
+            quiet = sweeps(POLICY_SWAP_SECONDS / 2)
+            fallbacks = self.stats().policyReaderFallbacks
+            swapper = threading.Thread(target=swap)
+            swapper.start()
+            try:
+                busy = sweeps(POLICY_SWAP_SECONDS)
+            finally:
+                stop.set()
+                swapper.join()
+            # 没有读者时的下一次发布会释放所有旧快照
+            self.set_filter(DEFAULT_FILTER)
+            stats = self.stats()
+        finally:
+            self.close_windows(windows)
+            if not self.is_hidden:
+                self.dll.ShowAllWindows()
+
+        rate = writer["swaps"] / POLICY_SWAP_SECONDS
+        detail = (f"每秒切换 {rate:.0f} 次，遍历 {quiet:.0f} -> {busy:.0f} 微秒，"
+                  f"写者最长 {writer['longest'] * 1000000:.0f} 微秒")
+        if writer["failed"]:
+            return False, "SetWindowHiderPolicy 失败"
+        if rate < POLICY_SWAPS_PER_SECOND / 2:
+            return False, detail + "，切换频率不足"
+        if stats.policyReaderFallbacks != fallbacks:
+            return False, detail + f"，{stats.policyReaderFallbacks - fallbacks} 次读取退回到锁"
+        if stats.policiesPending != 0:
+            return False, detail + f"，{stats.policiesPending} 个旧快照未释放"
+        return True, detail
+
+    def check_filter_order(self):
+        """
+        新建 FILTER_WINDOWS 个工具窗口，它们全部被扩展样式检查拒绝。先按默认
+        顺序、再按自适应顺序各遍历 FILTER_SWEEPS 次；每次遍历前重新发布策略，
+        让拒绝缓存失效，过滤检查真正执行。自适应顺序必须把扩展样式检查排在
+        所有从未拒绝过窗口的检查之前。报告两种顺序下每次遍历的耗时。
+        """
+        windows = self.open_windows(FILTER_WINDOWS, "过滤窗口")
+        for window, _ in windows:
+            window.attributes("-toolwindow", True)
+        self.root.update()
+
+        def sweeps(flags):
+            elapsed = 0.0
+            for _ in range(FILTER_SWEEPS):
+                self.set_filter(flags)
+                start = time.perf_counter()
+                self.dll.HideAllWindows()
+                elapsed += time.perf_counter() - start
+            return elapsed / FILTER_SWEEPS * 1000000
+
+        try:
+            fixed = sweeps(DEFAULT_FILTER)
+            adaptive = sweeps(DEFAULT_FILTER | FILTER_ADAPTIVE_ORDER)
+            stats = self.stats()
+        finally:
+            self.set_filter(DEFAULT_FILTER)
+            self.close_windows(windows)
+            if not self.is_hidden:
+                self.dll.ShowAllWindows()
+
+        order = [(stats.predicateOrder >> (4 * i)) & 0xF for i in range(len(PREDICATE_NAMES))]
+        never = [id for id in order if stats.predicateRejections[id] == 0]
+        detail = (f"顺序 {' > '.join(PREDICATE_NAMES[id] for id in order)}，"
+                  f"遍历 {fixed:.0f} -> {adaptive:.0f} 微秒")
+        if stats.predicateRejections[PREDICATE_EXSTYLE] == 0:
+            return False, detail + "，扩展样式检查没有拒绝任何窗口"
+        if any(order.index(id) < order.index(PREDICATE_EXSTYLE) for id in never):
+            return False, detail + "，扩展样式检查排在从未拒绝的检查之后"
+        return True, detail
+
+    def check_reject_cache(self):
+        """
+        打开钩子，新建 REJECT_WINDOWS 个隐藏窗口和 ACCEPT_WINDOWS 个可见窗口。
+        第一次遍历后，之后的遍历必须由拒绝缓存回答被拒绝的窗口；缓存按句柄
+        直接映射，冲突的窗口会互相挤出，所以要求至少四分之三命中。
+        然后显示一个被拒绝的窗口、给一个无标题窗口设置标题：对应的变化通知
+        必须让缓存失效，下一次遍历就保护这两个窗口。报告冷、热遍历的耗时。
+        """
+        self.enable_events()
+        rejected = self.open_windows(REJECT_WINDOWS, "拒绝窗口")
+        accepted = self.open_windows(ACCEPT_WINDOWS, "接受窗口")
+        for window, _ in rejected:
+            window.withdraw()
+        untitled, untitled_hwnd = accepted[0]
+        untitled.title("")
+        self.root.update()
+
+        def sweep():
+            start = time.perf_counter()
+            self.dll.HideAllWindows()
+            return (time.perf_counter() - start) * 1000000
+
+        try:
+            cold = sweep()
+            hits = self.stats().rejectCacheHits
+            warm = sum(sweep() for _ in range(REJECT_SWEEPS)) / REJECT_SWEEPS
+            hits = self.stats().rejectCacheHits - hits
+
+            shown, shown_hwnd = rejected[0]
+            shown.deiconify()
+            untitled.title("接受窗口 有标题")
+            self.root.update()
+            changed = self.wait_for(
+                lambda: (sweep(), self.affinity(shown_hwnd) not in (None, WDA_NONE)
+                         and self.affinity(untitled_hwnd) not in (None, WDA_NONE))[1], 2)
+        finally:
+            self.close_windows(rejected + accepted)
+            if not self.is_hidden:
+                self.dll.ShowAllWindows()
+
+        # 无标题窗口在变化前同样被拒绝
+        expected = (REJECT_WINDOWS + 1) * REJECT_SWEEPS
+        detail = f"热遍历命中 {hits}/{expected} 次，遍历 {cold:.0f} -> {warm:.0f} 微秒"
+        if hits * 4 < expected * 3:
+            return False, detail
+        if not changed:
+            return False, detail + "，显示或改名后的窗口没有被保护"
+        return True, detail
+
+    def check_enum_strategies(self):
+        """
+        打开钩子（注册表策略需要），新建 ENUM_WINDOWS 个窗口。每种策略下
+        ShowAllWindows 必须恢复全部窗口，HideAllWindows 必须保护全部窗口。
+        然后校准：每种策略都要有计时，选中的必须是其中最快的。
+        """
+        self.enable_events()
+        windows = self.open_windows(ENUM_WINDOWS, "枚举窗口")
+        hwnds = [hwnd for _, hwnd in windows]
+        info = WindowHiderEnumInfo()
+        info.cbSize = ctypes.sizeof(info)
+        try:
+            for strategy, name in enumerate(ENUM_STRATEGY_NAMES):
+                if not self.dll.SetWindowHiderEnumStrategy(strategy):
+                    return False, f"无法切换到 {name}"
+                self.dll.ShowAllWindows()
+                if any(self.affinity(hwnd) != WDA_NONE for hwnd in hwnds):
+                    return False, f"{name}: ShowAllWindows 漏掉了窗口"
+                self.dll.HideAllWindows()
+                if any(self.affinity(hwnd) in (None, WDA_NONE) for hwnd in hwnds):
+                    return False, f"{name}: HideAllWindows 漏掉了窗口"
+
+            if not self.dll.SetWindowHiderEnumStrategy(ENUM_STRATEGY_CALIBRATE):
+                return False, "校准失败"
+            if not self.dll.GetWindowHiderEnumInfo(ctypes.byref(info)):
+                return False, "GetWindowHiderEnumInfo 失败"
+        finally:
+            self.dll.SetWindowHiderEnumStrategy(0)
+            self.close_windows(windows)
+            if not self.is_hidden:
+                self.dll.ShowAllWindows()
+
+        timings = list(info.calibrationNanos)
+        detail = "，".join(f"{name} {nanos // 1000} 微秒" if nanos != ENUM_UNAVAILABLE else f"{name} 不可用"
+                          for name, nanos in zip(ENUM_STRATEGY_NAMES, timings))
+        if not info.calibrated or info.strategy >= len(ENUM_STRATEGY_NAMES):
+            return False, "校准没有选出策略"
+        if ENUM_UNAVAILABLE in timings:
+            return False, detail
+        if timings[info.strategy] != min(timings):
+            return False, detail + f"，选中的 {ENUM_STRATEGY_NAMES[info.strategy]} 不是最快的"
+        return True, detail + f"，选中 {ENUM_STRATEGY_NAMES[info.strategy]}，回退 {info.fallbacks} 次"
+
+    def check_snapshot_diff(self):
+        """
+        新建 SNAPSHOT_WINDOWS 个窗口，第一次遍历从零开始全部保护。没有变化的
+        第二次遍历必须跳过全部窗口。之后新建、销毁各 SNAPSHOT_CHANGED 个窗口，
+        并在 DLL 之外清掉一个旧窗口的亲和性：与上一次相比，下一次遍历只能多出
+        这些新窗口作为新增（被过滤掉的窗口每次都算新增），并且新窗口和失去
+        保护的旧窗口都必须受保护。报告从零遍历和比较遍历的耗时。
+        """
+        def sweep():
+            start = time.perf_counter()
+            self.dll.HideAllWindows()
+            return (time.perf_counter() - start) * 1000000
+
+        windows = self.open_windows(SNAPSHOT_WINDOWS, "快照窗口")
+        added = []
+        try:
+            # 先让之前的窗口从快照里消失，第一次遍历只面对这批新窗口
+            self.dll.ShowAllWindows()
+            full = sweep()
+            skipped = self.stats().hidesSkipped
+            diff = sweep()
+            stats = self.stats()
+            unchanged = stats.hidesSkipped - skipped >= SNAPSHOT_WINDOWS
+            background = stats.snapshotAdded
+
+            self.close_windows(windows[:SNAPSHOT_CHANGED])
+            windows = windows[SNAPSHOT_CHANGED:]
+            added = self.open_windows(SNAPSHOT_CHANGED, "新增窗口")
+            reset = windows[0][1]
+            user32.SetWindowDisplayAffinity(reset, WDA_NONE)
+            sweep()
+            stats = self.stats()
+            protected = all(self.affinity(hwnd) not in (None, WDA_NONE) for _, hwnd in added + windows[:1])
+        finally:
+            self.close_windows(windows + added)
+            if not self.is_hidden:
+                self.dll.ShowAllWindows()
+
+        detail = f"从零遍历 {full:.0f} 微秒，比较遍历 {diff:.0f} 微秒"
+        if not unchanged:
+            return False, detail + "，没有变化时仍重新处理了窗口"
+        if stats.snapshotAdded - background != SNAPSHOT_CHANGED:
+            return False, detail + f"，新增 {stats.snapshotAdded - background} 个，应为 {SNAPSHOT_CHANGED} 个"
+        if not protected:
+            return False, detail + "，新窗口或失去保护的窗口没有被保护"
+        return True, detail
+
+    def check_groups(self):
+        """
+        对 GROUP_SIZES 中的每种大小建一个组，另有一个不在组里的窗口。隐藏组
+        必须保护全部成员且不碰组外窗口，显示组必须恢复全部成员。然后销毁一半
+        成员：再次隐藏组必须成功，并把销毁的成员从组里清理掉。报告每种大小
+        下隐藏和显示组的耗时。
+        """
+        timings = []
+        for size in GROUP_SIZES:
+            members = self.open_windows(size, f"组成员 {size}")
+            outsider = self.open_windows(1, f"组外 {size}")
+            group = self.dll.CreateWindowHiderGroup(f"检查组 {size}")
+            try:
+                if group == 0:
+                    return False, "CreateWindowHiderGroup 失败"
+                if not all(self.dll.AddWindowHiderGroupMember(group, hwnd) for _, hwnd in members):
+                    return False, f"{size} 个成员：AddWindowHiderGroupMember 失败"
+
+                start = time.perf_counter()
+                hidden = self.dll.SetWindowHiderGroupVisibility(group, True)
+                hide_micros = (time.perf_counter() - start) * 1000000
+                if not hidden or any(self.affinity(hwnd) in (None, WDA_NONE) for _, hwnd in members):
+                    return False, f"{size} 个成员：隐藏组后有成员未受保护"
+                if self.affinity(outsider[0][1]) != WDA_NONE:
+                    return False, f"{size} 个成员：隐藏组碰到了组外窗口"
+
+                start = time.perf_counter()
+                shown = self.dll.SetWindowHiderGroupVisibility(group, False)
+                show_micros = (time.perf_counter() - start) * 1000000
+                if not shown or any(self.affinity(hwnd) != WDA_NONE for _, hwnd in members):
+                    return False, f"{size} 个成员：显示组后有成员仍受保护"
+                timings.append(f"{size} 个 {hide_micros:.0f}/{show_micros:.0f}")
+
+                destroyed = size // 2
+                self.close_windows(members[:destroyed])
+                members = members[destroyed:]
+                pruned = self.stats().groupMembersPruned
+                if not self.dll.SetWindowHiderGroupVisibility(group, True):
+                    return False, f"{size} 个成员：销毁部分成员后隐藏组失败"
+                # 钩子打开时，销毁通知到达后成员才算销毁
+                if not self.wait_for(lambda: self.dll.SetWindowHiderGroupVisibility(group, True)
+                                     and self.stats().groupMembersPruned - pruned == destroyed, 2):
+                    return False, f"{size} 个成员：销毁的 {destroyed} 个成员没有被清理"
+            finally:
+                if group != 0:
+                    self.dll.DeleteWindowHiderGroup(group)
+                self.close_windows(members + outsider)
+
+        return True, "隐藏/显示组耗时（微秒）：" + "，".join(timings)
+
+    def check_spatial_query(self):
+        """
+        打开钩子，在屏幕上排满窗口，等空间索引录入全部窗口。然后对左上角
+        2 x 2 个窗口的区域调用 HideWindowsInRect：与区域重叠的窗口必须全部
+        受保护，其他窗口必须保持可被捕获；查询检查的窗口数必须远少于全部
+        窗口（不超过四分之一）。报告查询耗时。
+        """
+        def overlaps(a, b):
+            return a.left < b.right and b.left < a.right and a.top < b.bottom and b.top < a.bottom
+
+        self.enable_events()
+        windows, cell_w, cell_h = self.grid_windows("区域窗口")
+        total = len(windows)
+        try:
+            # 第一次区域调用只启动索引，不等待录入
+            corner = wintypes.RECT(0, 0, 1, 1)
+            self.dll.HideWindowsInRect(ctypes.byref(corner))
+            if not self.wait_for(lambda: self.stats().spatialWindows >= total, 3):
+                return False, f"空间索引只录入了 {self.stats().spatialWindows} 个窗口"
+            self.dll.ShowAllWindows()
+
+            query = wintypes.RECT(cell_w // 2, cell_h // 2, cell_w * 2 + cell_w // 2, cell_h * 2 + cell_h // 2)
+            start = time.perf_counter()
+            hidden = self.dll.HideWindowsInRect(ctypes.byref(query))
+            micros = (time.perf_counter() - start) * 1000000
+            examined = self.stats().lastSpatialExamined
+
+            wrong = 0
+            inside = 0
+            for _, hwnd in windows:
+                expected = overlaps(self.window_rect(hwnd), query)
+                inside += expected
+                wrong += expected != (self.affinity(hwnd) not in (None, WDA_NONE))
+        finally:
+            self.close_windows(windows)
+            # 同时清除区域，之后移入的窗口不再被隐藏
+            self.dll.ShowAllWindows()
+            if self.is_hidden:
+                self.dll.HideAllWindows()
+
+        detail = f"{total} 个窗口中 {inside} 个在区域内，检查了 {examined} 个，耗时 {micros:.0f} 微秒"
+        if not hidden:
+            return False, "HideWindowsInRect 失败"
+        if wrong:
+            return False, detail + f"，{wrong} 个窗口的状态与区域不符"
+        if examined * 4 > total:
+            return False, detail + "，检查的窗口过多"
+        return True, detail
+
+    def check_drag_into_region(self):
+        """
+        打开钩子，以屏幕右半边为共享区域调用 HideWindowsInRect。然后以每秒
+        数百次的频率把一个窗口从左半边拖进区域，同时在左半边内来回拖动另一个
+        窗口。被拖进区域的窗口必须在 DRAG_MAX_LATENCY 内受保护，另一个窗口
+        必须保持可被捕获；拖动期间的移动必须有合并，受预算限制的单轮处理最多
+        超出预算一次隐藏的时间。
+        """
+        self.enable_events()
+        width = self.root.winfo_screenwidth()
+        height = self.root.winfo_screenheight()
+        region = wintypes.RECT(width // 2, 0, width, height)
+        windows = self.open_windows(2, "拖动窗口", lambda i: f"200x150+40+{100 + 300 * i}")
+        (_, moving), (_, staying) = windows
+
+        def move(hwnd, x, y):
+            user32.SetWindowPos(hwnd, None, x, y, 0, 0, SWP_NOSIZE | SWP_NOZORDER | SWP_NOACTIVATE)
+
+        def overlaps(a, b):
+            return a.left < b.right and b.left < a.right and a.top < b.bottom and b.top < a.bottom
+
+        try:
+            # 一次隐藏的开销，作为单轮处理可以超出预算的部分
+            start = time.perf_counter()
+            user32.SetWindowDisplayAffinity(staying, WDA_EXCLUDEFROMCAPTURE)
+            hide_micros = int((time.perf_counter() - start) * 1000000)
+            user32.SetWindowDisplayAffinity(staying, WDA_NONE)
+
+            # 第一次区域调用只启动索引，等录入后再设置区域
+            self.dll.HideWindowsInRect(ctypes.byref(region))
+            if not self.wait_for(lambda: self.stats().spatialWindows >= 2, 3):
+                return False, "空间索引没有录入窗口"
+            self.pause(0.2)
+            self.dll.HideWindowsInRect(ctypes.byref(region))
+            if self.affinity(moving) != WDA_NONE or self.affinity(staying) != WDA_NONE:
+                return False, "区域外的窗口被隐藏了"
+
+            merged = self.stats().movesMerged
+            x, wobble = 40, 0
+            crossed_at = protected_at = None
+            end = None
+            while end is None or time.perf_counter() < end:
+                x = min(x + DRAG_STEP, width - 200)
+                wobble = (wobble + DRAG_STEP) % 200
+                move(moving, x, 100)
+                move(staying, 40 + wobble, 400)
+                now = time.perf_counter()
+                if crossed_at is None and overlaps(self.window_rect(moving), region):
+                    crossed_at = now
+                    end = now + 2 * DRAG_MAX_LATENCY
+                if crossed_at is not None and protected_at is None and self.affinity(moving) not in (None, WDA_NONE):
+                    protected_at = now
+                while time.perf_counter() < now + DRAG_INTERVAL:
+                    pass
+            self.root.update()
+            stats = self.stats()
+            staying_hidden = self.affinity(staying) != WDA_NONE
+        finally:
+            self.close_windows(windows)
+            # 同时清除区域
+            self.dll.ShowAllWindows()
+            if self.is_hidden:
+                self.dll.HideAllWindows()
+
+        if protected_at is None:
+            return False, "拖进区域的窗口没有被保护"
+        latency = (protected_at - crossed_at) * 1000
+        limit = MOVE_FLUSH_BUDGET_MICROS + 2 * hide_micros
+        detail = (f"进入区域 {latency:.1f} 毫秒后受保护，合并 {stats.movesMerged - merged} 次移动，"
+                  f"单轮最长 {stats.maxMoveFlushMicros} 微秒")
+        if latency > DRAG_MAX_LATENCY * 1000:
+            return False, detail
+        if staying_hidden:
+            return False, detail + "，区域外拖动的窗口被隐藏了"
+        if stats.movesMerged == merged:
+            return False, detail + "，拖动期间没有合并移动"
+        if stats.maxMoveFlushMicros > limit:
+            return False, detail + f"，超过 {limit} 微秒"
+        return True, detail
+
     def run(self):
         self.root.mainloop()
 
+    def run_all_checks(self):
+        """不经界面依次运行全部检查，返回是否全部通过"""
+        self.root.update()
+        self.get_window_handle()
+        if not self.dll:
+            return False
+
+        failed = [name for name, check in self.checks if not self.run_check(name, check)]
+        if failed:
+            print(f"未通过: {', '.join(failed)}")
+        return not failed
+
 if __name__ == "__main__":
     print("启动测试程序...")
     print(f"Python 进程 ID: {os.getpid()}")
+
+    # python test_window_hider.py --check [DLL 路径]：运行全部检查后退出，供 CI 使用
+    if len(sys.argv) > 1 and sys.argv[1] == "--check":
+        app = WindowHiderTest(sys.argv[2] if len(sys.argv) > 2 else None)
+        ok = app.run_all_checks()
+        app.root.destroy()
+        sys.exit(0 if ok else 1)
+
     app = WindowHiderTest()
     app.run()
 